@@ -0,0 +1,81 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Measures gc() time as the node count grows; it should scale linearly
+// ja: ノード数に対する gc() の所要時間を計測（線形に伸びることを確認）
+
+// en: Largest pool a 16-bit index can address
+// ja: 16 ビットインデックスで扱える最大プール
+static const size_t kPoolBytes = 65535;
+static const size_t kNodeCounts[] = {100, 200, 400, 800};
+
+uint8_t *pool = nullptr;
+
+static void runBenchmark(size_t nodeCount)
+{
+  AssocTree<0> doc(pool, kPoolBytes);
+  char key[8];
+  char value[16];
+  for (size_t i = 0; i < nodeCount; ++i)
+  {
+    snprintf(key, sizeof(key), "k%u", static_cast<unsigned>(i));
+    snprintf(value, sizeof(value), "value-%u", static_cast<unsigned>(i));
+    doc["bench"][key] = value;
+  }
+
+  // en: Delete every other entry and overwrite the rest to fragment both regions
+  // ja: 1 つおきに削除し、残りを上書きしてノード領域と文字列領域を断片化させる
+  for (size_t i = 0; i < nodeCount; ++i)
+  {
+    snprintf(key, sizeof(key), "k%u", static_cast<unsigned>(i));
+    if (i % 2 == 0)
+    {
+      doc["bench"][key].unset();
+    }
+    else
+    {
+      snprintf(value, sizeof(value), "updated-%u", static_cast<unsigned>(i));
+      doc["bench"][key] = value;
+    }
+  }
+
+  size_t before = doc.freeBytes();
+  uint32_t start = micros();
+  doc.gc();
+  uint32_t elapsed = micros() - start;
+
+  Serial.print(F("nodes="));
+  Serial.print(nodeCount);
+  Serial.print(F(" live="));
+  Serial.print(doc["bench"].size());
+  Serial.print(F(" free="));
+  Serial.print(before);
+  Serial.print(F("->"));
+  Serial.print(doc.freeBytes());
+  Serial.print(F(" gc="));
+  Serial.print(elapsed);
+  Serial.println(F("us"));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  pool = static_cast<uint8_t *>(malloc(kPoolBytes));
+}
+
+void loop()
+{
+  if (!pool)
+  {
+    Serial.println(F("Failed to allocate pool"));
+    delay(5000);
+    return;
+  }
+
+  for (size_t nodeCount : kNodeCounts)
+  {
+    runBenchmark(nodeCount);
+  }
+
+  delay(10000);
+}
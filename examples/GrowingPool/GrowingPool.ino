@@ -0,0 +1,102 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Fills a tree that starts at 256 bytes and grows on demand, and the same records into a fixed
+//     32 KB pool. The pool doubles each time it runs out, so the copying costs a constant amount per
+//     insert; the worst single insert shows the pause of the largest growth.
+// ja: 256 バイトから必要に応じて拡張するツリーと、固定 32KB のプールに同じレコードを書き込む。
+//     プールは足りなくなるたびに倍になるため、コピーのコストは 1 件あたり一定になる。
+//     最も遅い 1 件は最大の拡張による停止時間を示す。
+
+static const size_t kInitialBytes = 256;
+static const size_t kFixedBytes = 32768;
+static const uint32_t kEntries = 300;
+
+HeapAllocator heap;
+#if defined(ESP32)
+PsramAllocator psram;
+#endif
+PoolAllocator *allocator = &heap;
+uint8_t *fixedBuffer = nullptr;
+
+// en: Writes kEntries log records and returns the elapsed time
+// ja: kEntries 件のログレコードを書き込み、経過時間を返す
+static uint32_t fill(AssocTree<0> &tree, uint32_t &worst)
+{
+  char text[32];
+  worst = 0;
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < kEntries; ++i)
+  {
+    uint32_t begin = micros();
+    snprintf(text, sizeof(text), "sensor %lu reading ok", static_cast<unsigned long>(i));
+    NodeRef entry = tree["log"][static_cast<size_t>(i)];
+    entry["t"] = static_cast<int32_t>(i * 10);
+    entry["msg"] = text;
+    uint32_t took = micros() - begin;
+    if (took > worst)
+    {
+      worst = took;
+    }
+  }
+  return micros() - start;
+}
+
+void setup()
+{
+  Serial.begin(115200);
+#if defined(ESP32)
+  // en: Keep internal RAM free when the board has PSRAM
+  // ja: PSRAM があるボードでは内部 RAM を空けておく
+  if (psramFound())
+  {
+    allocator = &psram;
+  }
+#endif
+  fixedBuffer = static_cast<uint8_t *>(allocator->reallocate(nullptr, kFixedBytes));
+}
+
+void loop()
+{
+  if (!fixedBuffer)
+  {
+    Serial.println(F("Failed to allocate buffer"));
+    delay(10000);
+    return;
+  }
+
+  uint32_t grownWorst;
+  uint32_t fixedWorst;
+  uint32_t grownUs;
+  uint32_t fixedUs;
+  PoolStats stats;
+  bool complete;
+  {
+    AssocTree<0> grown(*allocator, kInitialBytes);
+    grownUs = fill(grown, grownWorst);
+    stats = grown.poolStats();
+    complete = grown["log"].size() == kEntries;
+  }
+  {
+    AssocTree<0> fixed(fixedBuffer, kFixedBytes);
+    fixedUs = fill(fixed, fixedWorst);
+    complete = complete && fixed["log"].size() == kEntries;
+  }
+
+  Serial.print(F("complete="));
+  Serial.print(complete ? 1 : 0);
+  Serial.print(F(" growths="));
+  Serial.print(stats.poolGrowths);
+  Serial.print(F(" pool="));
+  Serial.print(stats.poolBytes);
+  Serial.print(F(" grown="));
+  Serial.print(static_cast<double>(grownUs) / kEntries);
+  Serial.print(F("us/insert fixed="));
+  Serial.print(static_cast<double>(fixedUs) / kEntries);
+  Serial.print(F("us/insert worst grown="));
+  Serial.print(grownWorst);
+  Serial.print(F("us fixed="));
+  Serial.print(fixedWorst);
+  Serial.println(F("us"));
+  delay(10000);
+}
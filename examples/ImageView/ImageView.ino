@@ -0,0 +1,131 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Reads a configuration image where it lies, without copying it into a pool
+// ja: 設定イメージをプールへコピーせず、置かれた場所のまま読み取る
+
+static const uint32_t kRounds = 20;
+static const size_t kPoolBytes = 8192;
+
+// en: Stands in for read-only storage such as a flash partition mapped with esp_partition_mmap()
+// ja: esp_partition_mmap() でマップしたフラッシュパーティションなど、読み取り専用の領域の代わり
+alignas(8) static uint8_t storage[kPoolBytes + 64];
+static size_t storedBytes = 0;
+
+class BufferSink : public Sink
+{
+public:
+  BufferSink(uint8_t *out, size_t capacity) : out_(out), capacity_(capacity) {}
+
+  bool write(const char *data, size_t length) override
+  {
+    if (length > capacity_ - used)
+    {
+      return false;
+    }
+    memcpy(out_ + used, data, length);
+    used += length;
+    return true;
+  }
+
+  size_t used = 0;
+
+private:
+  uint8_t *out_;
+  size_t capacity_;
+};
+
+static void writeFactoryImage()
+{
+  AssocTree<kPoolBytes> doc;
+  doc["wifi"]["ssid"] = "factory-floor";
+  doc["wifi"]["channel"] = 6;
+  for (size_t i = 0; i < 40; ++i)
+  {
+    NodeRef device = doc["devices"][i];
+    device["id"] = static_cast<int32_t>(i);
+    device["name"] = String("sensor-") + String(static_cast<int>(i));
+    device["threshold"] = 10.5 + i;
+    device["enabled"] = (i % 3) != 0;
+  }
+  BufferSink sink(storage, sizeof(storage));
+  doc.writeImage(sink);
+  storedBytes = sink.used;
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  writeFactoryImage();
+}
+
+void loop()
+{
+  // en: Opening the view only checks the image; nothing is copied
+  // ja: ビューを開く際はイメージを検証するだけで、何もコピーしない
+  uint32_t start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    const AssocTreeView probe(storage, storedBytes);
+  }
+  uint32_t elapsed = micros() - start;
+  const AssocTreeView view(storage, storedBytes);
+  Serial.print(F("open view: "));
+  Serial.print(static_cast<float>(elapsed) / kRounds, 1);
+  Serial.print(F(" us RAM="));
+  Serial.print(sizeof(AssocTreeView));
+  Serial.print(F(" bytes image="));
+  Serial.println(storedBytes);
+
+  // en: For comparison, restore the same image into a RAM pool
+  // ja: 比較用に、同じイメージを RAM のプールへ復元
+  static AssocTree<kPoolBytes> copy;
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    copy.loadImage(storage, storedBytes);
+  }
+  elapsed = micros() - start;
+  Serial.print(F("loadImage: "));
+  Serial.print(static_cast<float>(elapsed) / kRounds, 1);
+  Serial.print(F(" us RAM="));
+  Serial.print(sizeof(copy));
+  Serial.println(F(" bytes"));
+
+  Serial.print(F("ssid="));
+  Serial.print(view["wifi"]["ssid"].as<String>(""));
+  Serial.print(F(" channel="));
+  Serial.println(view["wifi"]["channel"].as<int>(0));
+
+  size_t enabled = 0;
+  for (auto entry : view["devices"].children())
+  {
+    if (entry.value()["enabled"].as<bool>(false))
+    {
+      ++enabled;
+    }
+  }
+  Serial.print(F("devices="));
+  Serial.print(view["devices"].size());
+  Serial.print(F(" enabled="));
+  Serial.println(enabled);
+
+  // en: Writes fail and leave the image as it was
+  // ja: 書き込みは失敗し、イメージはそのまま
+  NodeRef channel = view["wifi"]["channel"];
+  channel = 11;
+  bool appended = view["devices"].append(1);
+  String json;
+  view.toJson(json);
+  String original;
+  copy.toJson(original);
+  Serial.print(F("valid="));
+  Serial.print(view.valid() ? F("yes") : F("no"));
+  Serial.print(F(" channel="));
+  Serial.print(channel.as<int>(0));
+  Serial.print(F(" appended="));
+  Serial.print(appended ? F("yes") : F("no"));
+  Serial.print(F(" same="));
+  Serial.println(json == original ? F("yes") : F("no"));
+  delay(10000);
+}
@@ -0,0 +1,74 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Runs gcStep() in the idle time of a 1 ms control loop instead of a blocking gc()
+// ja: ブロックする gc() の代わりに、1ms 周期の制御ループの空き時間で gcStep() を実行
+
+static const uint32_t kPeriodUs = 1000;
+// en: Upper bound for a single GC slice
+// ja: GC 1 区切りあたりの上限時間
+static const uint32_t kMaxPauseUs = 300;
+
+AssocTree<8192> doc;
+uint32_t nextTick = 0;
+uint32_t tick = 0;
+uint32_t longestPauseUs = 0;
+uint32_t cycles = 0;
+
+static void controlTask()
+{
+  // en: Overwriting strings every tick leaves garbage behind
+  // ja: 毎周期の文字列上書きでゴミが溜まる
+  char text[24];
+  snprintf(text, sizeof(text), "tick-%lu", static_cast<unsigned long>(tick));
+  doc["status"]["text"] = text;
+  doc["status"]["tick"] = static_cast<int32_t>(tick);
+  doc["status"]["raw"] = static_cast<int32_t>(analogRead(0));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  doc.setGcMaxPause(kMaxPauseUs);
+  nextTick = micros();
+}
+
+void loop()
+{
+  if (static_cast<int32_t>(micros() - nextTick) < 0)
+  {
+    // en: Idle until the next tick: advance the GC in bounded slices
+    // ja: 次の周期までの空き時間に GC を少しずつ進める
+    if (doc.freeBytes() < 4096 || doc.gcInProgress())
+    {
+      uint32_t start = micros();
+      if (doc.gcStep())
+      {
+        ++cycles;
+      }
+      uint32_t pause = micros() - start;
+      if (pause > longestPauseUs)
+      {
+        longestPauseUs = pause;
+      }
+    }
+    return;
+  }
+  nextTick += kPeriodUs;
+  controlTask();
+  ++tick;
+
+  if (tick % 1000 == 0)
+  {
+    Serial.print(F("tick="));
+    Serial.print(tick);
+    Serial.print(F(" free="));
+    Serial.print(doc.freeBytes());
+    Serial.print(F(" gcCycles="));
+    Serial.print(cycles);
+    Serial.print(F(" longestPause="));
+    Serial.print(longestPauseUs);
+    Serial.println(F("us"));
+    longestPauseUs = 0;
+  }
+}
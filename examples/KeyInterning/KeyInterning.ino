@@ -0,0 +1,66 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Stores the same 500-record log with and without key interning and compares pool usage
+// ja: 同じ 500 件のログをキーのインターン有無で格納し、プール使用量を比較
+
+static const size_t kPoolBytes = 65535;
+static const int kRecords = 500;
+
+uint8_t *pool = nullptr;
+
+static void runLog(InternMode mode, const char *label)
+{
+  AssocTree<0> doc(pool, kPoolBytes);
+  doc.setInterning(mode);
+  int stored = 0;
+  for (int i = 0; i < kRecords; ++i)
+  {
+    // en: Every record repeats the keys "ts", "value" and "unit"
+    // ja: 各レコードが "ts"・"value"・"unit" のキーを繰り返す
+    NodeRef record = doc["log"][i];
+    record["ts"] = static_cast<int32_t>(i * 1000);
+    record["value"] = 20.0 + (i % 50) * 0.1;
+    record["unit"] = "millivolt";
+    if (!doc["log"][i]["unit"].isString())
+    {
+      break;
+    }
+    ++stored;
+  }
+
+  PoolStats stats = doc.poolStats();
+  Serial.print(label);
+  Serial.print(F(" records="));
+  Serial.print(stored);
+  Serial.print(F(" free="));
+  Serial.print(doc.freeBytes());
+  Serial.print(F(" internHits="));
+  Serial.print(stats.internHits);
+  Serial.print(F(" saved="));
+  Serial.println(stats.internSavedBytes);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  pool = static_cast<uint8_t *>(malloc(kPoolBytes));
+}
+
+void loop()
+{
+  if (!pool)
+  {
+    Serial.println(F("Failed to allocate pool"));
+    delay(5000);
+    return;
+  }
+
+  runLog(InternMode::Off, "off");
+  runLog(InternMode::Keys, "keys");
+  // en: "millivolt" is shared as well
+  // ja: "millivolt" も共有される
+  runLog(InternMode::KeysAndValues, "keys+values");
+
+  delay(10000);
+}
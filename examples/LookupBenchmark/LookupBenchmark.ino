@@ -0,0 +1,104 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Compares hashed key lookup against a linear walk over the children
+// ja: ハッシュ索引によるキー検索と、子要素を線形に辿る検索の速度比較
+
+// en: Largest pool a 16-bit index can address
+// ja: 16 ビットインデックスで扱える最大プール
+static const size_t kPoolBytes = 65535;
+static const size_t kKeyCounts[] = {8, 64, 512, 4096};
+static const uint32_t kLookups = 20000;
+
+uint8_t *pool = nullptr;
+
+static void makeKey(char *out, size_t index)
+{
+  snprintf(out, 8, "k%u", static_cast<unsigned>(index));
+}
+
+// en: Emulates the old lookup: walk every child and compare its key
+// ja: 従来の検索を再現：全ての子を辿ってキーを比較
+static int linearFind(NodeRef obj, const char *key)
+{
+  for (auto entry : obj.children())
+  {
+    if (strcmp(entry.key(), key) == 0)
+    {
+      return entry.value().as<int>(-1);
+    }
+  }
+  return -1;
+}
+
+static void runBenchmark(size_t keyCount)
+{
+  AssocTree<0> doc(pool, kPoolBytes);
+  char key[8];
+  for (size_t i = 0; i < keyCount; ++i)
+  {
+    makeKey(key, i);
+    doc["bench"][key] = static_cast<int32_t>(i);
+  }
+
+  Serial.print(F("keys="));
+  Serial.print(keyCount);
+  if (doc["bench"].size() != keyCount)
+  {
+    // en: Does not fit in a 64 KB pool
+    // ja: 64KB のプールに収まらない
+    Serial.println(F(" skipped (pool full)"));
+    return;
+  }
+
+  NodeRef obj = doc["bench"];
+  uint32_t checksum = 0;
+
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < kLookups; ++i)
+  {
+    makeKey(key, i % keyCount);
+    checksum += obj[key].as<int>(0);
+  }
+  uint32_t hashedUs = micros() - start;
+
+  start = micros();
+  for (uint32_t i = 0; i < kLookups; ++i)
+  {
+    makeKey(key, i % keyCount);
+    checksum += linearFind(obj, key);
+  }
+  uint32_t linearUs = micros() - start;
+
+  Serial.print(F(" hashed="));
+  Serial.print(static_cast<float>(hashedUs) / kLookups, 3);
+  Serial.print(F("us linear="));
+  Serial.print(static_cast<float>(linearUs) / kLookups, 3);
+  Serial.print(F("us checksum="));
+  Serial.println(checksum);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  pool = static_cast<uint8_t *>(malloc(kPoolBytes));
+}
+
+void loop()
+{
+  if (!pool)
+  {
+    Serial.println(F("Failed to allocate pool"));
+    delay(5000);
+    return;
+  }
+
+  Serial.print(F("ASSOCTREE_INDEX_THRESHOLD="));
+  Serial.println(ASSOCTREE_INDEX_THRESHOLD);
+  for (size_t keyCount : kKeyCounts)
+  {
+    runBenchmark(keyCount);
+  }
+
+  delay(10000);
+}
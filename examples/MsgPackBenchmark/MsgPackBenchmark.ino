@@ -0,0 +1,137 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Compares the size and speed of MessagePack and JSON for the same document, and checks the round trip
+// ja: 同じ文書で MessagePack と JSON のサイズと速度を比較し、往復変換で一致するかを確認
+
+static const uint32_t kRounds = 50;
+static const size_t kDevices = 24;
+static const size_t kChunkBytes = 64;
+
+AssocTree<8192> doc;
+
+static char json[3072];
+static size_t jsonLength = 0;
+static uint8_t packed[2048];
+static size_t packedLength = 0;
+
+// en: Collects output into a fixed buffer, as before writing it to flash or a radio
+// ja: フラッシュや無線へ書き出す前のように、固定バッファへ出力を集める
+class BufferSink : public Sink
+{
+public:
+  BufferSink(char *out, size_t capacity) : out_(out), capacity_(capacity) {}
+
+  bool write(const char *data, size_t length) override
+  {
+    if (length > capacity_ - used)
+    {
+      return false;
+    }
+    memcpy(out_ + used, data, length);
+    used += length;
+    return true;
+  }
+
+  size_t used = 0;
+
+private:
+  char *out_;
+  size_t capacity_;
+};
+
+static void buildJson()
+{
+  jsonLength = snprintf(json, sizeof(json), "{\"wifi\":{\"ssid\":\"factory-floor\",\"channel\":6},\"devices\":[");
+  for (size_t i = 0; i < kDevices; ++i)
+  {
+    jsonLength += snprintf(json + jsonLength, sizeof(json) - jsonLength,
+                           "%s{\"id\":%u,\"name\":\"sensor-%u\",\"enabled\":%s,\"threshold\":%u.5,\"tags\":[\"env\",\"line%u\"]}",
+                           i ? "," : "", static_cast<unsigned>(i), static_cast<unsigned>(i), (i % 3) ? "true" : "false",
+                           static_cast<unsigned>(10 + i), static_cast<unsigned>(i % 4));
+  }
+  // en: Ends with an empty key and an empty value, the last item of the packed bytes
+  // ja: 空のキーと空の値で終わり、パックしたバイト列の最後の要素になる
+  jsonLength += snprintf(json + jsonLength, sizeof(json) - jsonLength, "],\"\":\"\"}");
+}
+
+static void printResult(const __FlashStringHelper *label, uint32_t elapsed)
+{
+  Serial.print(label);
+  Serial.print(static_cast<float>(elapsed) / kRounds, 1);
+  Serial.println(F(" us/doc"));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  buildJson();
+}
+
+void loop()
+{
+  bool ok = doc.fromJson(json, jsonLength);
+  String original;
+  doc.toJson(original);
+
+  // en: Write both formats into the same kind of buffer
+  // ja: 両方の形式を同じ種類のバッファへ出力
+  static char text[3072];
+  uint32_t start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    BufferSink sink(text, sizeof(text));
+    ok &= doc.writeJson(sink);
+  }
+  printResult(F("writeJson:    "), micros() - start);
+
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    BufferSink sink(reinterpret_cast<char *>(packed), sizeof(packed));
+    ok &= doc.writeMsgPack(sink);
+    packedLength = sink.used;
+  }
+  printResult(F("writeMsgPack: "), micros() - start);
+
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    ok &= doc.fromJson(json, jsonLength);
+  }
+  printResult(F("fromJson:     "), micros() - start);
+
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    ok &= doc.fromMsgPack(packed, packedLength);
+  }
+  printResult(F("fromMsgPack:  "), micros() - start);
+  String fromPacked;
+  doc.toJson(fromPacked);
+
+  // en: The same bytes delivered in small chunks, as from a radio link
+  // ja: 無線リンクから届くように、同じバイト列を小さな塊で渡す
+  MsgPackReader reader(doc);
+  for (size_t offset = 0; offset < packedLength; offset += kChunkBytes)
+  {
+    size_t length = packedLength - offset < kChunkBytes ? packedLength - offset : kChunkBytes;
+    reader.feed(packed + offset, length);
+  }
+  ok &= reader.finish();
+  String chunked;
+  doc.toJson(chunked);
+
+  Serial.print(F("json bytes="));
+  Serial.print(jsonLength);
+  Serial.print(F(" msgpack bytes="));
+  Serial.print(packedLength);
+  Serial.print(F(" ("));
+  Serial.print(100.0f * packedLength / jsonLength, 0);
+  Serial.println(F("%)"));
+  Serial.print(F("ok="));
+  Serial.print(ok ? F("yes") : F("no"));
+  Serial.print(F(" same="));
+  Serial.println(original == fromPacked && original == chunked ? F("yes") : F("no"));
+  delay(10000);
+}
@@ -0,0 +1,104 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Reports the node size of the configured layout, how many entries fit per KB and the lookup cost.
+//     Build once as is and once with -DASSOCTREE_COMPACT_NODES=1 to compare the layouts.
+// ja: 設定中のノードレイアウトのサイズ、1KB あたりの格納数、検索コストを表示
+//     そのままと -DASSOCTREE_COMPACT_NODES=1 付きでそれぞれビルドして比較する
+
+static const size_t kPoolBytes = 16384;
+static const size_t kLookupKeys = 200;
+static const uint32_t kLookups = 20000;
+
+uint8_t *pool = nullptr;
+
+static void printPerKb(const __FlashStringHelper *label, size_t count)
+{
+  Serial.print(label);
+  Serial.print(static_cast<float>(count) * 1024 / kPoolBytes, 1);
+  Serial.println(F(" per KB"));
+}
+
+static void makeKey(char *out, size_t index)
+{
+  snprintf(out, 8, "k%u", static_cast<unsigned>(index));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  pool = static_cast<uint8_t *>(malloc(kPoolBytes));
+}
+
+void loop()
+{
+  if (!pool)
+  {
+    Serial.println(F("Failed to allocate pool"));
+    delay(5000);
+    return;
+  }
+
+  Serial.print(F("layout="));
+  Serial.print(ASSOCTREE_COMPACT_NODES ? F("compact") : F("default"));
+  Serial.print(F(" nodeBytes="));
+  Serial.println(AssocTree<0>::kNodeBytes);
+
+  // en: Array elements only cost a node plus a dense index entry
+  // ja: 配列要素はノード 1 つと索引エントリ分のみ
+  {
+    AssocTree<0> doc(pool, kPoolBytes);
+    size_t count = 0;
+    while (doc["values"].append(static_cast<int32_t>(count)))
+    {
+      ++count;
+    }
+    printPerKb(F("array ints: "), count);
+  }
+
+  // en: Object entries also store their key in the string region
+  // ja: オブジェクトの要素はキーも文字列領域に格納する
+  {
+    AssocTree<0> doc(pool, kPoolBytes);
+    char key[8];
+    size_t count = 0;
+    while (true)
+    {
+      makeKey(key, count);
+      doc["map"][key] = 0.5;
+      if (doc["map"].size() != count + 1)
+      {
+        break;
+      }
+      ++count;
+    }
+    printPerKb(F("object doubles: "), count);
+  }
+
+  // en: Lookups over the same number of keys for every layout
+  // ja: どのレイアウトでも同じキー数で検索する
+  {
+    AssocTree<0> doc(pool, kPoolBytes);
+    char key[8];
+    for (size_t i = 0; i < kLookupKeys; ++i)
+    {
+      makeKey(key, i);
+      doc["map"][key] = 0.5;
+    }
+    NodeRef map = doc["map"];
+    float checksum = 0;
+    uint32_t start = micros();
+    for (uint32_t i = 0; i < kLookups; ++i)
+    {
+      makeKey(key, i % kLookupKeys);
+      checksum += map[key].as<float>(0);
+    }
+    uint32_t elapsed = micros() - start;
+    Serial.print(F("lookup: "));
+    Serial.print(static_cast<float>(elapsed) / kLookups, 3);
+    Serial.print(F("us checksum="));
+    Serial.println(checksum);
+  }
+
+  delay(10000);
+}
@@ -0,0 +1,179 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Compares fromJson() with parsing into a separate tree and copying every leaf through NodeRef
+// ja: fromJson() と、別のツリーへ解析してから NodeRef で葉を 1 つずつコピーする方法を比較
+
+static const uint32_t kRounds = 50;
+static const size_t kDevices = 24;
+static const size_t kChunkBytes = 64;
+static const size_t kPoolBytes = 8192;
+
+AssocTree<kPoolBytes> doc;
+// en: Stands in for the DOM of a separate JSON library
+// ja: 別の JSON ライブラリの DOM の代わり
+AssocTree<kPoolBytes> staging;
+
+static char json[3072];
+static size_t jsonLength = 0;
+
+struct PathStep
+{
+  const char *key;
+  size_t index;
+};
+static PathStep path[8];
+
+// en: Numbers JSON does not allow; fromJson() must reject every one
+// ja: JSON で許されない数値。fromJson() はすべて拒否する必要がある
+static const char *const kMalformed[] = {"[01]", "[-01]", "[1.]", "[.5]", "[1e]", "[1e+]", "[1.e5]"};
+
+static void buildJson()
+{
+  jsonLength = snprintf(json, sizeof(json), "{\"wifi\":{\"ssid\":\"factory-floor\",\"channel\":6},\"devices\":[");
+  for (size_t i = 0; i < kDevices; ++i)
+  {
+    jsonLength += snprintf(json + jsonLength, sizeof(json) - jsonLength,
+                           "%s{\"id\":%u,\"name\":\"sensor-%u\",\"enabled\":%s,\"threshold\":%u.5,\"tags\":[\"env\",\"line%u\"]}",
+                           i ? "," : "", static_cast<unsigned>(i), static_cast<unsigned>(i), (i % 3) ? "true" : "false",
+                           static_cast<unsigned>(10 + i), static_cast<unsigned>(i % 4));
+  }
+  jsonLength += snprintf(json + jsonLength, sizeof(json) - jsonLength, "]}");
+}
+
+// en: Resolves the leaf from the root again, as code copying out of another DOM does
+// ja: 別の DOM からコピーするコードと同じく、葉ごとにルートから辿り直す
+static NodeRef destination(size_t depth)
+{
+  NodeRef ref = path[0].key ? doc[path[0].key] : doc[path[0].index];
+  for (size_t i = 1; i < depth; ++i)
+  {
+    ref = path[i].key ? ref[path[i].key] : ref[path[i].index];
+  }
+  return ref;
+}
+
+static void copyLeaves(NodeRef source, size_t depth)
+{
+  for (auto entry : source.children())
+  {
+    path[depth].key = entry.isArrayEntry() ? nullptr : entry.key();
+    path[depth].index = entry.index();
+    NodeRef value = entry.value();
+    if (value.isObject() || value.isArray())
+    {
+      copyLeaves(value, depth + 1);
+      continue;
+    }
+    NodeRef target = destination(depth + 1);
+    if (value.isString())
+    {
+      target = value.asCString("");
+    }
+    else if (value.isDouble())
+    {
+      target = value.as<double>(0.0);
+    }
+    else if (value.isInt())
+    {
+      target = value.as<int32_t>(0);
+    }
+    else if (value.isBool())
+    {
+      target = value.as<bool>(false);
+    }
+    else
+    {
+      target = nullptr;
+    }
+  }
+}
+
+static size_t usedBytes(const AssocTree<kPoolBytes> &tree)
+{
+  return kPoolBytes - tree.freeBytes();
+}
+
+static void printResult(const __FlashStringHelper *label, uint32_t elapsed, size_t ramBytes)
+{
+  Serial.print(label);
+  // en: Bytes per microsecond is MB/s
+  // ja: 1 マイクロ秒あたりのバイト数がそのまま MB/s
+  Serial.print(static_cast<float>(jsonLength) * kRounds / elapsed, 2);
+  Serial.print(F(" MB/s poolBytes="));
+  Serial.println(ramBytes);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  buildJson();
+}
+
+void loop()
+{
+  Serial.print(F("json bytes="));
+  Serial.println(jsonLength);
+
+  uint32_t start = micros();
+  bool ok = true;
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    ok &= doc.fromJson(json, jsonLength);
+  }
+  uint32_t elapsed = micros() - start;
+  printResult(F("fromJson: "), elapsed, usedBytes(doc));
+  String direct;
+  doc.toJson(direct);
+
+  // en: The same text delivered in small chunks, as from a socket
+  // ja: ソケットから届くように、同じテキストを小さな塊で渡す
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    JsonReader reader(doc);
+    for (size_t offset = 0; offset < jsonLength; offset += kChunkBytes)
+    {
+      size_t length = jsonLength - offset < kChunkBytes ? jsonLength - offset : kChunkBytes;
+      reader.feed(json + offset, length);
+    }
+    ok &= reader.finish();
+  }
+  elapsed = micros() - start;
+  printResult(F("JsonReader (64B chunks): "), elapsed, usedBytes(doc));
+  String chunked;
+  doc.toJson(chunked);
+
+  // en: Parse into the staging tree, then copy every leaf into an emptied doc
+  // ja: 一時ツリーに解析してから、空にした doc へ葉を 1 つずつコピー
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    ok &= staging.fromJson(json, jsonLength);
+    ok &= doc.fromJson("{}", 2);
+    path[0].key = "wifi";
+    copyLeaves(staging["wifi"], 1);
+    path[0].key = "devices";
+    copyLeaves(staging["devices"], 1);
+  }
+  elapsed = micros() - start;
+  // en: Both trees are alive until the copy finishes
+  // ja: コピーが終わるまで両方のツリーが必要
+  printResult(F("staging + NodeRef copy: "), elapsed, usedBytes(staging) + usedBytes(doc));
+  String copied;
+  doc.toJson(copied);
+
+  bool rejected = true;
+  for (const char *text : kMalformed)
+  {
+    rejected &= !staging.fromJson(text, strlen(text));
+  }
+
+  Serial.print(F("ok="));
+  Serial.print(ok ? F("yes") : F("no"));
+  Serial.print(F(" same="));
+  Serial.print(direct == chunked && direct == copied ? F("yes") : F("no"));
+  Serial.print(F(" rejected="));
+  Serial.println(rejected ? F("yes") : F("no"));
+  delay(10000);
+}
@@ -0,0 +1,118 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Syncs a 1000-node document with JSON Merge Patches instead of full JSON. Each round changes
+//     1% of the values, then times diff() and applyPatch() and compares the patch with the full output.
+// ja: 1000 ノードの文書を、JSON 全体ではなく JSON Merge Patch で同期する。毎回値の 1% を変更し、
+//     diff() と applyPatch() の時間を計測して、パッチと全体出力の大きさを比較する。
+
+static const size_t kDevices = 40;
+static const size_t kFields = 24;
+static const size_t kChangesPerRound = 10;
+
+// en: doc is the live state, sent is what the gateway last received
+// ja: doc は現在の状態、sent はゲートウェイが最後に受け取った状態
+AssocTree<32768> doc;
+AssocTree<32768> sent;
+uint32_t rounds = 0;
+
+class StringSink : public Sink
+{
+public:
+  bool write(const char *data, size_t length) override
+  {
+    text.append(data, length);
+    return true;
+  }
+
+  std::string text;
+};
+
+class CountingSink : public Sink
+{
+public:
+  bool write(const char *data, size_t length) override
+  {
+    (void)data;
+    bytes += length;
+    return true;
+  }
+
+  size_t bytes = 0;
+};
+
+// en: Keys of up to 3 bytes are stored inside the node
+// ja: 3 バイトまでのキーはノード内に格納される
+static void key(char *out, char prefix, size_t i)
+{
+  snprintf(out, 4, "%c%u", prefix, static_cast<unsigned>(i));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  for (size_t d = 0; d < kDevices; ++d)
+  {
+    char device[4];
+    key(device, 'd', d);
+    for (size_t f = 0; f < kFields; ++f)
+    {
+      char field[4];
+      key(field, 'f', f);
+      doc["devices"][device][field] = static_cast<int32_t>(d * 100 + f);
+    }
+  }
+  std::string full;
+  doc.toJson(full);
+  sent.fromJson(full.data(), full.size());
+  Serial.print(F("nodes: "));
+  Serial.println(doc.poolStats().nodeSlots);
+}
+
+void loop()
+{
+  ++rounds;
+  for (size_t i = 0; i < kChangesPerRound; ++i)
+  {
+    char device[4];
+    char field[4];
+    key(device, 'd', (rounds * 7 + i * 13) % kDevices);
+    key(field, 'f', (rounds * 5 + i * 3) % kFields);
+    doc["devices"][device][field] = static_cast<int32_t>(rounds * 1000 + i);
+  }
+
+  StringSink patch;
+  uint32_t start = micros();
+  diff(sent, doc, patch);
+  const uint32_t diffTime = micros() - start;
+
+  CountingSink full;
+  start = micros();
+  doc.writeJson(full);
+  const uint32_t fullTime = micros() - start;
+
+  start = micros();
+  const bool applied = sent.applyPatch(patch.text.data(), patch.text.size());
+  const uint32_t applyTime = micros() - start;
+
+  // en: After the patch both trees must match, so the next diff is empty
+  // ja: パッチ適用後は両方のツリーが一致するため、次の diff は空になる
+  StringSink check;
+  diff(sent, doc, check);
+
+  Serial.print(F("diff: "));
+  Serial.print(diffTime);
+  Serial.print(F(" us, "));
+  Serial.print(patch.text.size());
+  Serial.print(F(" bytes  full json: "));
+  Serial.print(fullTime);
+  Serial.print(F(" us, "));
+  Serial.print(full.bytes);
+  Serial.print(F(" bytes  applyPatch: "));
+  Serial.print(applyTime);
+  Serial.print(F(" us, "));
+  Serial.print(applied ? F("ok") : F("failed"));
+  Serial.print(F("  in sync: "));
+  Serial.println(check.text == "{}" ? F("yes") : F("no"));
+  delay(5000);
+}
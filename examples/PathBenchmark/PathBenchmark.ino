@@ -0,0 +1,98 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Measures NodeRef size and the cost of chained operator[] access
+// ja: NodeRef のサイズと operator[] を連ねたアクセスのコストを計測
+
+static const uint32_t kIterations = 20000;
+
+// en: Layout of the previous NodeRef: 16 segments and 256 key bytes, copied whole by every operator[]
+// ja: 以前の NodeRef の構造：16 セグメントと 256 バイトのキー領域を operator[] のたびに丸ごとコピー
+struct LegacyRef
+{
+  void *tree;
+  uint16_t baseIndex;
+  uint16_t attachedIndex;
+  uint32_t revision;
+  uint8_t pendingCount;
+  uint16_t keyBytesUsed;
+  struct
+  {
+    uint8_t kind;
+    uint16_t keyOffset;
+    uint16_t keyLength;
+    size_t index;
+  } pending[16];
+  uint8_t keyStorage[256];
+  bool overflow;
+};
+
+AssocTree<4096> doc;
+LegacyRef legacy[4];
+
+// en: bufferCopied counts segment and key-buffer bytes copied per chain; the small fixed header is left out
+// ja: bufferCopied は 1 回のチェーンでコピーされるセグメントとキー領域のバイト数（小さな固定ヘッダは除く）
+static void printResult(const __FlashStringHelper *label, uint32_t elapsed, size_t bufferCopied)
+{
+  Serial.print(label);
+  Serial.print(static_cast<float>(elapsed) / kIterations, 3);
+  Serial.print(F("us bufferCopied="));
+  Serial.println(bufferCopied);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  doc["sensors"]["temp"]["value"] = 21;
+}
+
+void loop()
+{
+  Serial.print(F("sizeof(NodeRef)="));
+  Serial.print(sizeof(NodeRef));
+  Serial.print(F(" legacy="));
+  Serial.println(sizeof(LegacyRef));
+
+  // en: Every prefix exists, so each operator[] binds the child; the path is kept, but only its used part is copied
+  // ja: 途中のノードが全て存在するため、operator[] は子に即座に結び付く。パスも保持するが、コピーは使用中の部分のみ
+  int32_t checksum = 0;
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < kIterations; ++i)
+  {
+    checksum += doc["sensors"]["temp"]["value"].as<int>(0);
+  }
+  uint32_t elapsed = micros() - start;
+  // en: "temp" and "value" copy the 1 and 2 segments before them and the 7 and 11 key bytes
+  // ja: "temp" と "value" の段で、それまでの 1・2 セグメントと 7・11 バイトのキーをコピー
+  printResult(F("read chain: "), elapsed, 3 * sizeof(assoc_tree::detail::LazySegment) + 18);
+
+  // en: The same chain plus the three whole-object copies the old NodeRef made
+  // ja: 同じ処理に、以前の NodeRef が行っていた 3 回の丸ごとコピーを加えたもの
+  start = micros();
+  for (uint32_t i = 0; i < kIterations; ++i)
+  {
+    for (size_t level = 1; level < 4; ++level)
+    {
+      memcpy(&legacy[level], &legacy[level - 1], sizeof(LegacyRef));
+    }
+    checksum += doc["sensors"]["temp"]["value"].as<int>(0);
+  }
+  elapsed = micros() - start;
+  printResult(F("read chain (legacy copies): "), elapsed, 3 * (sizeof(LegacyRef::pending) + sizeof(LegacyRef::keyStorage)));
+
+  // en: A missing suffix is buffered the same way
+  // ja: 存在しない末尾も同じようにバッファに溜める
+  start = micros();
+  for (uint32_t i = 0; i < kIterations; ++i)
+  {
+    checksum += doc["sensors"]["humidity"]["value"].as<int>(0);
+  }
+  elapsed = micros() - start;
+  // en: "humidity" and "value" copy the 1 and 2 segments before them and the 7 and 15 key bytes
+  // ja: "humidity" と "value" の段で、それまでの 1・2 セグメントと 7・15 バイトのキーをコピー
+  printResult(F("missing suffix: "), elapsed, 3 * sizeof(assoc_tree::detail::LazySegment) + 22);
+
+  Serial.print(F("checksum="));
+  Serial.println(checksum);
+  delay(10000);
+}
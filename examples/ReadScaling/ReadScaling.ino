@@ -0,0 +1,104 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// en: Measures read throughput with 1 to 8 reader threads while one thread writes now and then.
+//     Build with ASSOCTREE_ENABLE_THREAD_SAFETY=1, and compare ASSOCTREE_LOCK_POLICY=ASSOCTREE_LOCK_SHARED
+//     with the default on a multi-core host. Reads first run without the lock and retry if a write overlapped;
+//     build with ASSOCTREE_OPTIMISTIC_READS=0 to measure the lock alone (on ESP32, its critical section).
+// ja: 1〜8 個の読み取りスレッドのスループットを、1 つのスレッドが時々書き込む状態で計測。
+//     ASSOCTREE_ENABLE_THREAD_SAFETY=1 でビルドし、マルチコアのホストで ASSOCTREE_LOCK_POLICY=ASSOCTREE_LOCK_SHARED と既定値を比較。
+//     読み取りはまずロックなしで実行し、書き込みと重なった場合はやり直す。ロックだけ（ESP32 ではクリティカルセクション）を
+//     計測するには ASSOCTREE_OPTIMISTIC_READS=0 でビルドする。
+
+static const size_t kKeys = 64;
+static const uint32_t kRunMs = 500;
+static const uint32_t kWriteIntervalMs = 5;
+
+AssocTree<16384> config;
+
+static void buildConfig()
+{
+  for (size_t i = 0; i < kKeys; ++i)
+  {
+    String key = String("setting") + String(static_cast<int>(i));
+    config["settings"][key.c_str()]["value"] = static_cast<int32_t>(i);
+    config["settings"][key.c_str()]["label"] = "reader scaling";
+  }
+}
+
+static void reader(const std::atomic<bool> *stop, std::atomic<uint32_t> *total, uint32_t seed)
+{
+  char key[16];
+  uint32_t reads = 0;
+  while (!stop->load(std::memory_order_relaxed))
+  {
+    seed = seed * 1103515245u + 12345u;
+    snprintf(key, sizeof(key), "setting%u", static_cast<unsigned>((seed >> 16) % kKeys));
+    NodeRef entry = config["settings"][key];
+    if (entry["value"].as<int>(-1) >= 0 && entry["label"].exists())
+    {
+      ++reads;
+    }
+  }
+  total->fetch_add(reads);
+}
+
+static uint32_t run(size_t threads, uint32_t &writes)
+{
+  std::atomic<bool> stop(false);
+  std::atomic<uint32_t> total(0);
+  std::vector<std::thread> pool;
+  for (size_t i = 0; i < threads; ++i)
+  {
+    pool.emplace_back(reader, &stop, &total, static_cast<uint32_t>(i + 1));
+  }
+
+  // en: The writer: bump one value every few milliseconds
+  // ja: 書き込み側：数ミリ秒ごとに値を 1 つ更新
+  writes = 0;
+  uint32_t start = millis();
+  while (millis() - start < kRunMs)
+  {
+    config["settings"]["setting0"]["value"] = static_cast<int32_t>(writes++);
+    delay(kWriteIntervalMs);
+  }
+  stop = true;
+  for (auto &thread : pool)
+  {
+    thread.join();
+  }
+  return total.load();
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  buildConfig();
+}
+
+void loop()
+{
+  uint32_t single = 0;
+  for (size_t threads = 1; threads <= 8; threads *= 2)
+  {
+    uint32_t writes = 0;
+    uint32_t reads = run(threads, writes);
+    if (threads == 1)
+    {
+      single = reads;
+    }
+    Serial.print(F("threads="));
+    Serial.print(static_cast<unsigned>(threads));
+    Serial.print(F(" reads/s="));
+    Serial.print(static_cast<unsigned long>(reads * (1000.0 / kRunMs)));
+    Serial.print(F(" speedup="));
+    Serial.print(single ? static_cast<float>(reads) / single : 0.0f, 2);
+    Serial.print(F(" writes="));
+    Serial.println(writes);
+  }
+  delay(10000);
+}
@@ -0,0 +1,162 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Serialization throughput on a number-heavy array, and whether every number reads back exactly
+// ja: 数値の多い配列の出力速度と、全ての数値が正確に読み戻せるかを計測
+
+// en: 2000 elements keep the nodes and array index inside the 64KB pool limit
+// ja: 2000 要素ならノードと配列の索引がプール上限 64KB に収まる
+static const size_t kElements = 2000;
+static const uint32_t kRounds = 10;
+
+AssocTree<60000> doc;
+
+// en: What a node holds: float with ASSOCTREE_COMPACT_NODES, otherwise double
+// ja: ノードが保持する型：ASSOCTREE_COMPACT_NODES では float、それ以外は double
+using StoredDouble = assoc_tree::detail::StoredDouble;
+
+static double sample(size_t i)
+{
+  return 20.0 + i * 0.013 - (i % 7) * 0.25;
+}
+
+static bool isIntElement(size_t i)
+{
+  return i % 4 == 0;
+}
+
+// en: Counts bytes only, so the timing is the writer itself
+// ja: バイト数を数えるだけなので、計測されるのは出力処理そのもの
+class CountingSink : public Sink
+{
+public:
+  bool write(const char *data, size_t length) override
+  {
+    (void)data;
+    bytes += length;
+    return true;
+  }
+
+  size_t bytes = 0;
+};
+
+// en: Parses each number in the stream and compares it with the stored value
+// ja: 出力中の数値を 1 つずつ解析し、格納した値と比較
+class VerifySink : public Sink
+{
+public:
+  bool write(const char *data, size_t length) override
+  {
+    for (size_t i = 0; i < length; ++i)
+    {
+      char c = data[i];
+      bool starts = (c >= '0' && c <= '9') || c == '-';
+      bool continues = used > 0 && (c == '.' || c == 'e' || c == 'E' || c == '+');
+      if (starts || continues)
+      {
+        if (used < sizeof(number) - 1)
+        {
+          number[used++] = c;
+        }
+      }
+      else if (used > 0)
+      {
+        check();
+      }
+    }
+    return true;
+  }
+
+  void check()
+  {
+    number[used] = '\0';
+    used = 0;
+    double parsed = strtod(number, nullptr);
+    bool exact = isIntElement(index) ? parsed == static_cast<int32_t>(index * 37)
+                                     : static_cast<StoredDouble>(parsed) == static_cast<StoredDouble>(sample(index));
+    if (!exact)
+    {
+      ++mismatches;
+    }
+    ++index;
+  }
+
+  char number[40];
+  size_t used = 0;
+  size_t index = 0;
+  uint32_t mismatches = 0;
+};
+
+void setup()
+{
+  Serial.begin(115200);
+  for (size_t i = 0; i < kElements; ++i)
+  {
+    if (isIntElement(i))
+    {
+      doc["values"][i] = static_cast<int32_t>(i * 37);
+    }
+    else
+    {
+      doc["values"][i] = sample(i);
+    }
+  }
+}
+
+void loop()
+{
+  CountingSink counter;
+  uint32_t start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    doc.writeJson(counter);
+  }
+  uint32_t elapsed = micros() - start;
+  size_t bytes = counter.bytes / kRounds;
+  Serial.print(F("writeJson: bytes="));
+  Serial.print(bytes);
+  Serial.print(F(" "));
+  Serial.print(static_cast<float>(counter.bytes) / elapsed, 2);
+  Serial.print(F(" MB/s "));
+  Serial.print(static_cast<float>(kElements) * kRounds / elapsed, 2);
+  Serial.println(F(" Mvalues/s"));
+
+  // en: The previous number formatting: std::to_string for ints, "%.6g" for doubles
+  // ja: 以前の数値整形：整数は std::to_string、double は "%.6g"
+  uint32_t lossy = 0;
+  size_t legacyBytes = 0;
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    for (size_t i = 0; i < kElements; ++i)
+    {
+      if (isIntElement(i))
+      {
+        legacyBytes += std::to_string(static_cast<int32_t>(i * 37)).size();
+      }
+      else
+      {
+        char text[32];
+        double value = static_cast<StoredDouble>(sample(i));
+        legacyBytes += snprintf(text, sizeof(text), "%.6g", value);
+        if (round == 0 && strtod(text, nullptr) != value)
+        {
+          ++lossy;
+        }
+      }
+    }
+  }
+  elapsed = micros() - start;
+  Serial.print(F("legacy formatting only: "));
+  Serial.print(static_cast<float>(kElements) * kRounds / elapsed, 2);
+  Serial.print(F(" Mvalues/s lossy="));
+  Serial.println(lossy);
+
+  VerifySink verify;
+  doc.writeJson(verify);
+  Serial.print(F("verified="));
+  Serial.print(verify.index);
+  Serial.print(F(" mismatches="));
+  Serial.println(verify.mismatches);
+  delay(10000);
+}
@@ -0,0 +1,87 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Takes point-in-time copies of a live tree and reads related values from them while the tree keeps changing.
+//     Only the used node and string bytes are copied, and readers of a snapshot take no lock.
+// ja: 変化し続けるツリーのある時点のコピーを取り、関連する値をそこから読み取る。
+//     コピーするのは使用中のノードと文字列のバイトだけで、スナップショットの読み取りはロックを取らない。
+
+static const uint32_t kRounds = 20;
+static const size_t kPoolBytes = 8192;
+
+AssocTree<kPoolBytes> live;
+
+// en: Room for the used bytes plus some growth; snapshot() fails if they do not fit
+// ja: 使用中のバイトに余裕を加えた領域。収まらない場合 snapshot() は失敗する
+alignas(8) static uint8_t snapshotBuffer[kPoolBytes / 2];
+
+static void buildState()
+{
+  live["motor"]["kp"] = 1.2;
+  live["motor"]["ki"] = 0.05;
+  live["motor"]["kd"] = 0.3;
+  live["motor"]["mode"] = "velocity";
+  for (size_t i = 0; i < 30; ++i)
+  {
+    NodeRef sensor = live["sensors"][i];
+    sensor["id"] = static_cast<int32_t>(i);
+    sensor["label"] = String("sensor-") + String(static_cast<int>(i));
+    sensor["value"] = 20.0 + i;
+  }
+}
+
+static void printGains(const char *label, const NodeRef &motor)
+{
+  Serial.print(label);
+  Serial.print(F(" kp="));
+  Serial.print(motor["kp"].as<double>(0.0), 3);
+  Serial.print(F(" ki="));
+  Serial.print(motor["ki"].as<double>(0.0), 3);
+  Serial.print(F(" kd="));
+  Serial.print(motor["kd"].as<double>(0.0), 3);
+  Serial.print(F(" mode="));
+  Serial.println(motor["mode"].as<String>(""));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  buildState();
+}
+
+void loop()
+{
+  uint32_t valid = 0;
+  uint32_t start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    const AssocTreeView probe = live.snapshot(snapshotBuffer, sizeof(snapshotBuffer));
+    valid += probe.valid() ? 1 : 0;
+  }
+  uint32_t elapsed = micros() - start;
+  Serial.print(F("snapshot: "));
+  Serial.print(static_cast<float>(elapsed) / kRounds, 1);
+  Serial.print(F(" us copied="));
+  Serial.print(live.imageBytes());
+  Serial.print(F(" of "));
+  Serial.print(kPoolBytes);
+  Serial.print(F(" pool bytes valid="));
+  Serial.print(valid);
+  Serial.print(F("/"));
+  Serial.println(kRounds);
+
+  // en: The snapshot keeps the values it was taken with
+  // ja: スナップショットは取得時の値を保持する
+  const AssocTreeView before = live.snapshot(snapshotBuffer, sizeof(snapshotBuffer));
+  live["motor"]["kp"] = live["motor"]["kp"].as<double>(0.0) + 0.1;
+  live["motor"]["ki"] = live["motor"]["ki"].as<double>(0.0) * 2;
+  live["motor"]["mode"] = live["motor"]["mode"].as<String>("") == "velocity" ? "position" : "velocity";
+  live["sensors"][3]["value"] = live["sensors"][3]["value"].as<double>(0.0) + 1.5;
+  printGains("snapshot:", before["motor"]);
+  printGains("live:    ", live["motor"]);
+  Serial.print(F("sensor 3 snapshot="));
+  Serial.print(before["sensors"][3]["value"].as<double>(0.0), 1);
+  Serial.print(F(" live="));
+  Serial.println(live["sensors"][3]["value"].as<double>(0.0), 1);
+  delay(10000);
+}
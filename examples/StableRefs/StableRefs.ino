@@ -0,0 +1,112 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Caches NodeRefs to sensor values and keeps using them across gc(). Nodes the collection does
+//     not move keep their index, and moved ones are found through the relocation map gc() leaves.
+// ja: センサー値への NodeRef をキャッシュし、gc() をまたいで使い続ける。GC で移動しないノードは
+//     インデックスがそのままで、移動したノードは gc() が残す移動表から求める。
+
+static const size_t kSensors = 32;
+static const uint32_t kReads = 20;
+
+AssocTree<8192> tree;
+NodeRef cached[kSensors];
+
+static String sensorKey(size_t i)
+{
+  return String("sensor_") + String(static_cast<int>(i));
+}
+
+// en: Temporary entries created before the sensors leave holes below them once removed
+// ja: センサーより先に作った一時的な項目を削除すると、その下に空きができる
+static void churn()
+{
+  for (size_t i = 0; i < 24; ++i)
+  {
+    tree["scratch"][i] = "temporary value that takes a block";
+  }
+}
+
+static int32_t sumCached()
+{
+  int32_t sum = 0;
+  for (size_t i = 0; i < kSensors; ++i)
+  {
+    sum += cached[i].as<int32_t>(0);
+  }
+  return sum;
+}
+
+static int32_t sumByPath()
+{
+  int32_t sum = 0;
+  for (size_t i = 0; i < kSensors; ++i)
+  {
+    sum += tree["sensors"][sensorKey(i).c_str()].as<int32_t>(0);
+  }
+  return sum;
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  churn();
+  for (size_t i = 0; i < kSensors; ++i)
+  {
+    tree["sensors"][sensorKey(i).c_str()] = static_cast<int32_t>(i);
+    cached[i] = tree["sensors"][sensorKey(i).c_str()];
+  }
+}
+
+void loop()
+{
+  tree["scratch"].unset();
+  const size_t freeBefore = tree.freeBytes();
+  uint32_t start = micros();
+  tree.gc();
+  const uint32_t gcTime = micros() - start;
+
+  size_t attached = 0;
+  for (size_t i = 0; i < kSensors; ++i)
+  {
+    attached += cached[i].isAttached() ? 1 : 0;
+    // en: A write stores the new index, so the reference keeps up with later collections too
+    // ja: 書き込みで新しいインデックスを保存するため、以降の GC にも追従する
+    cached[i] = cached[i].as<int32_t>(0) + 1;
+  }
+
+  int32_t check = 0;
+  start = micros();
+  for (uint32_t round = 0; round < kReads; ++round)
+  {
+    check += sumCached();
+  }
+  const uint32_t cachedTime = micros() - start;
+  start = micros();
+  for (uint32_t round = 0; round < kReads; ++round)
+  {
+    check -= sumByPath();
+  }
+  const uint32_t pathTime = micros() - start;
+
+  Serial.print(F("gc: "));
+  Serial.print(gcTime);
+  Serial.print(F(" us free "));
+  Serial.print(freeBefore);
+  Serial.print(F(" -> "));
+  Serial.print(tree.freeBytes());
+  Serial.print(F("  cached refs still attached: "));
+  Serial.print(attached);
+  Serial.print(F("/"));
+  Serial.println(kSensors);
+  Serial.print(F("read "));
+  Serial.print(kSensors);
+  Serial.print(F(" values: cached "));
+  Serial.print(static_cast<float>(cachedTime) / kReads, 1);
+  Serial.print(F(" us  by path "));
+  Serial.print(static_cast<float>(pathTime) / kReads, 1);
+  Serial.print(F(" us  match="));
+  Serial.println(check == 0 ? F("yes") : F("no"));
+  churn();
+  delay(10000);
+}
@@ -0,0 +1,74 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Streams a document as JSON through a Sink instead of building a String first
+// ja: String を作らずに、Sink を通して文書を JSON として順に送り出す
+
+AssocTree<8192> doc;
+
+// en: A custom sink: counts the chunks and bytes and keeps a simple checksum
+// ja: 独自の Sink：チャンク数とバイト数を数え、簡単なチェックサムを計算
+class ChecksumSink : public Sink
+{
+public:
+  bool write(const char *data, size_t length) override
+  {
+    ++chunks;
+    bytes += length;
+    for (size_t i = 0; i < length; ++i)
+    {
+      checksum = checksum * 31 + static_cast<uint8_t>(data[i]);
+    }
+    return true;
+  }
+
+  uint32_t chunks = 0;
+  size_t bytes = 0;
+  uint32_t checksum = 0;
+};
+
+void setup()
+{
+  Serial.begin(115200);
+  char name[16];
+  for (int i = 0; i < 40; ++i)
+  {
+    snprintf(name, sizeof(name), "sensor-%d", i);
+    doc["sensors"][i]["name"] = name;
+    doc["sensors"][i]["value"] = i * 0.5;
+    doc["sensors"][i]["ok"] = (i % 7) != 0;
+  }
+}
+
+void loop()
+{
+  // en: Any Print works: Serial, WiFiClient, File...
+  // ja: Serial、WiFiClient、File など Print であれば何でも出力先にできる
+  PrintSink serialSink(Serial);
+  doc.writeJson(serialSink);
+  Serial.println();
+
+  ChecksumSink counter;
+  uint32_t start = micros();
+  bool ok = doc.writeJson(counter);
+  uint32_t elapsed = micros() - start;
+
+  // en: toJson(String&) keeps the whole document in RAM at once
+  // ja: toJson(String&) は文書全体を一度に RAM 上に保持する
+  String json;
+  doc.toJson(json);
+
+  Serial.print(F("ok="));
+  Serial.print(ok ? F("yes") : F("no"));
+  Serial.print(F(" bytes="));
+  Serial.print(counter.bytes);
+  Serial.print(F(" chunks="));
+  Serial.print(counter.chunks);
+  Serial.print(F(" checksum="));
+  Serial.print(counter.checksum);
+  Serial.print(F(" elapsed="));
+  Serial.print(elapsed);
+  Serial.print(F("us toJsonStringBytes="));
+  Serial.println(json.length());
+  delay(10000);
+}
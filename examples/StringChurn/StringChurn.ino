@@ -0,0 +1,75 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Rewrites status strings and churns keys in a small pool without calling gc()
+// ja: 小さなプールで gc() を呼ばずに文字列の上書きとキーの追加・削除を繰り返す
+
+static const uint32_t kRounds = 100000;
+
+AssocTree<4096> doc;
+
+static void printStats(uint32_t round)
+{
+  PoolStats stats = doc.poolStats();
+  Serial.print(F("round="));
+  Serial.print(round);
+  Serial.print(F(" free="));
+  Serial.print(doc.freeBytes());
+  Serial.print(F(" listed="));
+  Serial.print(stats.freeBlockBytes);
+  Serial.print(F(" inPlace="));
+  Serial.print(stats.inPlaceStrings);
+  Serial.print(F(" reusedBlocks="));
+  Serial.print(stats.reusedBlocks);
+  Serial.print(F(" reusedNodes="));
+  Serial.println(stats.reusedNodeSlots);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+}
+
+void loop()
+{
+  char text[48];
+  char key[8];
+  uint32_t failures = 0;
+  uint32_t start = micros();
+  for (uint32_t round = 1; round <= kRounds; ++round)
+  {
+    // en: A ~40 byte status string whose length changes every update
+    // ja: 更新のたびに長さが変わる約 40 バイトのステータス文字列
+    snprintf(text, sizeof(text), "uptime=%lu rssi=%d state=%s", static_cast<unsigned long>(round), -40 - static_cast<int>(round % 50), (round % 3) ? "ok" : "degraded");
+    doc["status"]["text"] = text;
+
+    // en: Fill 24 cache keys, then remove them all, and repeat
+    // ja: キャッシュのキーを 24 個追加した後に全て削除、を繰り返す
+    snprintf(key, sizeof(key), "k%u", static_cast<unsigned>(round % 24));
+    if ((round / 24) % 2 == 0)
+    {
+      doc["cache"][key] = text;
+    }
+    else
+    {
+      doc["cache"][key].unset();
+    }
+
+    if (!doc["status"]["text"].isString())
+    {
+      ++failures;
+    }
+    if (round % 20000 == 0)
+    {
+      printStats(round);
+    }
+  }
+  uint32_t elapsed = micros() - start;
+
+  Serial.print(F("failures="));
+  Serial.print(failures);
+  Serial.print(F(" elapsed="));
+  Serial.print(elapsed);
+  Serial.println(F("us"));
+  delay(10000);
+}
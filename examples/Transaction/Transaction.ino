@@ -0,0 +1,114 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Applies a batch of config fields one write at a time and as one transaction, then shows a
+//     transaction that runs out of pool space leaving the tree exactly as it was.
+// ja: 設定値の一括更新を 1 件ずつの書き込みと 1 つのトランザクションで比較し、
+//     プール不足になったトランザクションがツリーを元のまま残すことを示す。
+
+static const uint32_t kRounds = 20;
+static const size_t kFields = 40;
+
+AssocTree<8192> config;
+AssocTree<3072> small;
+
+static String fieldName(size_t i)
+{
+  return String("field_") + String(static_cast<int>(i));
+}
+
+static void buildConfig(assoc_tree::AssocTreeBase &tree)
+{
+  tree["net"]["ssid"] = "workshop-ap";
+  tree["net"]["retries"] = 3;
+  for (size_t i = 0; i < kFields; ++i)
+  {
+    tree["motor"]["params"][fieldName(i).c_str()] = static_cast<int32_t>(i);
+  }
+}
+
+static void applySingle(int32_t base)
+{
+  for (size_t i = 0; i < kFields; ++i)
+  {
+    config["motor"]["params"][fieldName(i).c_str()] = base + static_cast<int32_t>(i);
+  }
+}
+
+static bool applyBatch(int32_t base)
+{
+  Transaction txn(config);
+  // en: Look the shared prefix up once; the tree cannot be collected while the transaction is open
+  // ja: 共通の接頭辞は一度だけ検索する。トランザクション中はツリーが GC されない
+  NodeRef params = txn["motor"]["params"];
+  for (size_t i = 0; i < kFields; ++i)
+  {
+    params[fieldName(i).c_str()] = base + static_cast<int32_t>(i);
+  }
+  return txn.commit();
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  buildConfig(config);
+  buildConfig(small);
+}
+
+void loop()
+{
+  uint32_t start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    applySingle(static_cast<int32_t>(round * 100));
+  }
+  const uint32_t single = micros() - start;
+
+  uint32_t committed = 0;
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    committed += applyBatch(static_cast<int32_t>(round * 100)) ? 1 : 0;
+  }
+  const uint32_t batch = micros() - start;
+
+  Serial.print(F("single writes: "));
+  Serial.print(static_cast<float>(single) / kRounds, 1);
+  Serial.print(F(" us/update  transaction: "));
+  Serial.print(static_cast<float>(batch) / kRounds, 1);
+  Serial.print(F(" us/update  committed="));
+  Serial.print(committed);
+  Serial.print(F("/"));
+  Serial.println(kRounds);
+
+  // en: Grow the small tree until the pool is full; the failed transaction changes nothing
+  // ja: 小さいツリーをプールが尽きるまで拡張する。失敗したトランザクションは何も変更しない
+  String before;
+  small.toJson(before);
+  const size_t freeBefore = small.freeBytes();
+  size_t written = 0;
+  bool kept = false;
+  {
+    Transaction txn(small);
+    txn["net"]["ssid"] = "replaced before the pool runs out";
+    for (size_t i = 0; i < 200 && !txn.failed(); ++i)
+    {
+      txn["log"][fieldName(i).c_str()] = "an entry that will not fit";
+      ++written;
+    }
+    kept = txn.commit();
+  }
+  String after;
+  small.toJson(after);
+  Serial.print(F("full pool: writes="));
+  Serial.print(written);
+  Serial.print(F(" committed="));
+  Serial.print(kept ? F("yes") : F("no"));
+  Serial.print(F(" unchanged="));
+  Serial.print(before == after ? F("yes") : F("no"));
+  Serial.print(F(" free="));
+  Serial.print(freeBefore);
+  Serial.print(F(" -> "));
+  Serial.println(small.freeBytes());
+  delay(10000);
+}
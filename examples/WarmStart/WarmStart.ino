@@ -0,0 +1,133 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Saves the pool as an image and restores it, compared with saving and parsing JSON
+// ja: プールをイメージとして保存・復元し、JSON で保存して解析し直す方法と比較
+
+static const uint32_t kRounds = 20;
+static const size_t kPoolBytes = 8192;
+
+AssocTree<kPoolBytes> doc;
+
+// en: Stands in for a file or flash partition
+// ja: ファイルやフラッシュパーティションの代わり
+static uint8_t storage[kPoolBytes + 64];
+// en: The pool an image is adopted into on boot
+// ja: 起動時にイメージを引き継ぐプール
+static uint8_t bootPool[kPoolBytes + 64];
+
+class BufferSink : public Sink
+{
+public:
+  BufferSink(uint8_t *out, size_t capacity) : out_(out), capacity_(capacity) {}
+
+  bool write(const char *data, size_t length) override
+  {
+    if (length > capacity_ - used)
+    {
+      return false;
+    }
+    memcpy(out_ + used, data, length);
+    used += length;
+    return true;
+  }
+
+  size_t used = 0;
+
+private:
+  uint8_t *out_;
+  size_t capacity_;
+};
+
+static void buildConfig()
+{
+  doc["wifi"]["ssid"] = "factory-floor";
+  doc["wifi"]["channel"] = 6;
+  for (size_t i = 0; i < 40; ++i)
+  {
+    NodeRef device = doc["devices"][i];
+    device["id"] = static_cast<int32_t>(i);
+    device["name"] = String("sensor-") + String(static_cast<int>(i));
+    device["threshold"] = 10.5 + i;
+    device["enabled"] = (i % 3) != 0;
+  }
+}
+
+static void printResult(const __FlashStringHelper *label, uint32_t elapsed, size_t bytes)
+{
+  Serial.print(label);
+  Serial.print(static_cast<float>(elapsed) / kRounds, 1);
+  Serial.print(F(" us bytes="));
+  Serial.println(bytes);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  buildConfig();
+}
+
+void loop()
+{
+  String original;
+  doc.toJson(original);
+  bool ok = true;
+
+  // en: Shutdown and boot through JSON text
+  // ja: JSON テキストを経由した終了と起動
+  size_t jsonBytes = 0;
+  uint32_t start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    BufferSink sink(storage, sizeof(storage));
+    ok &= doc.writeJson(sink);
+    jsonBytes = sink.used;
+  }
+  printResult(F("save JSON:    "), micros() - start, jsonBytes);
+
+  AssocTree<0> parsed(bootPool, sizeof(bootPool));
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    ok &= parsed.fromJson(reinterpret_cast<const char *>(storage), jsonBytes);
+  }
+  printResult(F("boot fromJson: "), micros() - start, jsonBytes);
+
+  // en: Shutdown and boot through a pool image
+  // ja: プールイメージを経由した終了と起動
+  size_t imageBytes = 0;
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    BufferSink sink(storage, sizeof(storage));
+    ok &= doc.writeImage(sink);
+    imageBytes = sink.used;
+  }
+  printResult(F("save image:   "), micros() - start, imageBytes);
+
+  start = micros();
+  for (uint32_t round = 0; round < kRounds; ++round)
+  {
+    ok &= parsed.loadImage(storage, imageBytes);
+  }
+  printResult(F("boot loadImage: "), micros() - start, imageBytes);
+
+  // en: Read the image straight into the boot pool and adopt it there, with no second buffer
+  // ja: イメージを起動用プールへ直接読み込み、2 つ目のバッファなしでそのまま引き継ぐ
+  memcpy(bootPool, storage, imageBytes);
+  start = micros();
+  AssocTree<0> adopted(bootPool, sizeof(bootPool), imageBytes);
+  uint32_t elapsed = micros() - start;
+  Serial.print(F("boot adopt in place: "));
+  Serial.print(elapsed);
+  Serial.print(F(" us free="));
+  Serial.println(adopted.freeBytes());
+
+  String restored;
+  adopted.toJson(restored);
+  Serial.print(F("ok="));
+  Serial.print(ok && adopted.adopted() ? F("yes") : F("no"));
+  Serial.print(F(" same="));
+  Serial.println(restored == original ? F("yes") : F("no"));
+  delay(10000);
+}
@@ -0,0 +1,103 @@
+#include <Arduino.h>
+#include <AssocTree.h>
+
+// en: Finds changed settings by watching the subtree instead of rescanning and comparing it every
+//     loop. Status values are written every pass; a setting changes only now and then.
+// ja: 毎ループ再走査して比較する代わりに、サブツリーを監視して変更された設定を見つける。
+//     ステータスは毎回書き込み、設定はときどきだけ変わる。
+
+static const size_t kSettings = 24;
+static const uint32_t kPasses = 200;
+
+AssocTree<4096> doc;
+int32_t lastSeen[kSettings];
+size_t settingsWatch = assoc_tree::AssocTreeBase::kNoWatch;
+uint32_t token = 0;
+
+static String settingKey(size_t i)
+{
+  return String("opt_") + String(static_cast<int>(i));
+}
+
+static void simulate(uint32_t pass)
+{
+  doc["status"]["uptime"] = static_cast<int32_t>(pass);
+  doc["status"]["rssi"] = static_cast<int32_t>(-40 - pass % 20);
+  if (pass % 25 == 0)
+  {
+    doc["settings"][settingKey(pass % kSettings).c_str()] = static_cast<int32_t>(pass);
+  }
+}
+
+// en: Rescans every setting and compares it with the last value seen
+// ja: すべての設定を再走査し、前回の値と比較する
+static size_t pollSettings()
+{
+  size_t changed = 0;
+  for (size_t i = 0; i < kSettings; ++i)
+  {
+    const int32_t value = doc["settings"][settingKey(i).c_str()].as<int32_t>(0);
+    if (value != lastSeen[i])
+    {
+      lastSeen[i] = value;
+      ++changed;
+    }
+  }
+  return changed;
+}
+
+static size_t watchSettings()
+{
+  size_t changed = 0;
+  // en: The callback runs only when something under "settings" was written
+  // ja: "settings" 以下に書き込みがあったときだけコールバックが呼ばれる
+  token = doc.forEachChangedSince(token, [&](size_t, NodeRef)
+                                  { changed += pollSettings(); });
+  return changed;
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  for (size_t i = 0; i < kSettings; ++i)
+  {
+    doc["settings"][settingKey(i).c_str()] = 0;
+    lastSeen[i] = 0;
+  }
+  settingsWatch = doc.watch(doc["settings"]);
+  token = doc.changeToken();
+}
+
+void loop()
+{
+  size_t polled = 0;
+  uint32_t start = micros();
+  for (uint32_t pass = 1; pass <= kPasses; ++pass)
+  {
+    simulate(pass);
+    polled += pollSettings();
+  }
+  const uint32_t pollTime = micros() - start;
+  token = doc.changeToken();
+
+  size_t watched = 0;
+  start = micros();
+  for (uint32_t pass = 1; pass <= kPasses; ++pass)
+  {
+    simulate(pass + kPasses);
+    watched += watchSettings();
+  }
+  const uint32_t watchTime = micros() - start;
+
+  Serial.print(F("polling: "));
+  Serial.print(static_cast<float>(pollTime) / kPasses, 1);
+  Serial.print(F(" us/pass, "));
+  Serial.print(polled);
+  Serial.print(F(" changes  watch: "));
+  Serial.print(static_cast<float>(watchTime) / kPasses, 1);
+  Serial.print(F(" us/pass, "));
+  Serial.print(watched);
+  Serial.print(F(" changes  watch id "));
+  Serial.println(static_cast<int>(settingsWatch));
+  delay(10000);
+}
@@ -1,14 +1,679 @@
 #include "AssocTree.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
+#ifndef ARDUINO
+#include <chrono>
+#endif
 
 namespace assoc_tree {
 namespace {
 
-constexpr size_t kNodeSize = sizeof(detail::Node);
+constexpr size_t kNodeSize = AssocTreeBase::kNodeBytes;
+constexpr uint16_t kMinIndexCapacity = 16;
+
+uint32_t hashKey(const char* data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+size_t indexCapacityFor(size_t count) {
+  size_t capacity = kMinIndexCapacity;
+  while (capacity < count * 2) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+// Every allocation in the string region is a block that ends with a 16-bit
+// trailer holding `size | 1`. The odd value tells it apart from the even
+// reference links compactStrings() threads through the trailer, and the top
+// bit flags blocks released to the free lists.
+constexpr size_t kTrailerBytes = sizeof(uint16_t);
+constexpr uint16_t kRawTrailer = 1;
+constexpr uint16_t kFreeTrailer = 0x8000;
+constexpr uint16_t kBlockSizeMask = 0x7FFE;
+
+size_t blockBytes(size_t dataBytes) {
+  return ((dataBytes + 1) & ~static_cast<size_t>(1)) + kTrailerBytes;
+}
+
+size_t stringBlockBytes(size_t len) {
+  return blockBytes(len + 1);
+}
+
+uint16_t threadLink(uint16_t nodeIndex, uint8_t field) {
+  return static_cast<uint16_t>((nodeIndex << 2) | (field << 1));
+}
+
+// Released string-region blocks are kept on size-classed free lists; a free
+// block starts with the next offset and a copy of its trailer.
+constexpr size_t kMinFreeBlock = 2 * sizeof(uint16_t);
+// Entries tried per class before moving on to a larger class.
+constexpr size_t kFreeBlockScan = 8;
+
+size_t blockClass(size_t bytes) {
+  size_t cls = 0;
+  for (size_t rest = bytes >> 3; rest != 0 && cls + 1 < detail::kBlockClasses; rest >>= 1) {
+    ++cls;
+  }
+  return cls;
+}
+
+size_t tableBlockBytes(size_t capacity) {
+  return blockBytes(sizeof(detail::IndexHeader) + capacity * sizeof(uint16_t));
+}
+
+// Blocks handled per gcStep() string window; each window scans the nodes twice.
+constexpr size_t kGcWindowBlocks = 32;
+// Mark/clear visits between pause-clock checks.
+constexpr size_t kGcMarkChunk = 16;
+
+// A transaction's undo journal is a chain of blocks taken from the free gap,
+// newest first. Each starts with this header. A node record continues with
+// the node's bytes from before its first change; a block record (node is
+// kReleaseRecord or kTakenRecord) with a BlockRecord for an older block to
+// release on commit, or an older free block reused by the transaction.
+struct JournalRecord {
+  uint16_t previous;
+  uint16_t node;
+};
+
+struct BlockRecord {
+  uint16_t offset;
+  uint16_t bytes;
+};
+
+constexpr uint16_t kReleaseRecord = detail::kInvalidIndex;
+constexpr uint16_t kTakenRecord = detail::kInvalidIndex - 1;
+
+// Journal records one write may take from the top of the gap, short of
+// releasing a subtree: the target, its parent, the last sibling and a
+// reused slot, plus a reused block.
+size_t writeJournalBytes() {
+  return 4 * blockBytes(sizeof(JournalRecord) + kNodeSize) +
+         blockBytes(sizeof(JournalRecord) + sizeof(BlockRecord));
+}
+
+// Growable pools stop short of 64 KB, as offsets are 16 bits and the pool
+// size is even. Their blocks are over-allocated so the pool can start on a
+// node boundary.
+constexpr size_t kMaxPoolBytes = std::numeric_limits<uint16_t>::max() - 1;
+constexpr size_t kPoolSlack = alignof(detail::Node) - 1;
+
+uint8_t* alignedPool(uint8_t* block) {
+  const size_t misalign = reinterpret_cast<uintptr_t>(block) % alignof(detail::Node);
+  return misalign == 0 ? block : block + (alignof(detail::Node) - misalign);
+}
+
+uint32_t nowMicros() {
+#ifdef ARDUINO
+  return micros();
+#else
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now().time_since_epoch())
+                                   .count());
+#endif
+}
+
+size_t arrayCapacityFor(size_t count) {
+  size_t capacity = kMinIndexCapacity;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+bool isJsonSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+bool isNumberChar(char c) {
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+// Shortest round-trip formatting of doubles (Grisu2, F. Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers", 2010). The
+// digits are the fewest that parse back to the same stored value, computed
+// for the precision of detail::StoredDouble.
+struct DiyFp {
+  uint64_t f;
+  int e;
+
+  DiyFp(uint64_t significand, int exponent) : f(significand), e(exponent) {}
+
+  DiyFp operator-(const DiyFp& rhs) const { return DiyFp(f - rhs.f, e); }
+
+  // Upper 64 bits of the 128-bit product, rounded.
+  DiyFp operator*(const DiyFp& rhs) const {
+    const uint64_t kMask32 = 0xFFFFFFFFu;
+    const uint64_t a = f >> 32;
+    const uint64_t b = f & kMask32;
+    const uint64_t c = rhs.f >> 32;
+    const uint64_t d = rhs.f & kMask32;
+    const uint64_t ac = a * c;
+    const uint64_t bc = b * c;
+    const uint64_t ad = a * d;
+    const uint64_t bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & kMask32) + (bc & kMask32);
+    mid += static_cast<uint64_t>(1) << 31;
+    return DiyFp(ac + (ad >> 32) + (bc >> 32) + (mid >> 32), e + rhs.e + 64);
+  }
+
+  DiyFp normalized() const {
+    DiyFp result = *this;
+    while (!(result.f & (static_cast<uint64_t>(1) << 63))) {
+      result.f <<= 1;
+      --result.e;
+    }
+    return result;
+  }
+};
+
+template <typename T>
+struct FloatTraits;
+
+template <>
+struct FloatTraits<double> {
+  using Bits = uint64_t;
+  static constexpr int kSignificandBits = 52;
+  static constexpr int kExponentBias = 0x3FF + kSignificandBits;
+};
+
+template <>
+struct FloatTraits<float> {
+  using Bits = uint32_t;
+  static constexpr int kSignificandBits = 23;
+  static constexpr int kExponentBias = 0x7F + kSignificandBits;
+};
+
+// 10^-348, 10^-340, ..., 10^340 as normalized 64-bit significands and binary
+// exponents.
+const uint64_t kCachedPowersF[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+    0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+    0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+    0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull,
+};
+
+const int16_t kCachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+const uint64_t kPow10[] = {
+    1ull,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+// A cached power c such that the exponent of w * c lands in [-60, -32].
+DiyFp cachedPower(int e, int& k) {
+  const double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int rounded = static_cast<int>(dk);
+  if (dk - rounded > 0.0) {
+    ++rounded;
+  }
+  const unsigned index = static_cast<unsigned>((rounded >> 3) + 1);
+  k = -(-348 + static_cast<int>(index << 3));
+  return DiyFp(kCachedPowersF[index], kCachedPowersE[index]);
+}
+
+void grisuRound(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa,
+                uint64_t distance) {
+  while (rest < distance && delta - rest >= tenKappa &&
+         (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance)) {
+    --digits[length - 1];
+    rest += tenKappa;
+  }
+}
+
+int decimalDigits(uint32_t n) {
+  int count = 1;
+  while (count < 10 && n >= kPow10[count]) {
+    ++count;
+  }
+  return count;
+}
+
+// Writes the digits of `w`, any number inside (lower, upper), and returns
+// their count; the value is digits * 10^k.
+int digitGen(const DiyFp& w, const DiyFp& upper, uint64_t delta, char* digits, int& k) {
+  const DiyFp one(static_cast<uint64_t>(1) << -upper.e, upper.e);
+  const uint64_t distance = (upper - w).f;
+  uint32_t p1 = static_cast<uint32_t>(upper.f >> -one.e);
+  uint64_t p2 = upper.f & (one.f - 1);
+  int length = 0;
+  for (int kappa = decimalDigits(p1); kappa > 0;) {
+    const uint32_t divisor = static_cast<uint32_t>(kPow10[kappa - 1]);
+    const uint32_t d = p1 / divisor;
+    p1 %= divisor;
+    if (d || length) {
+      digits[length++] = static_cast<char>('0' + d);
+    }
+    --kappa;
+    const uint64_t rest = (static_cast<uint64_t>(p1) << -one.e) + p2;
+    if (rest <= delta) {
+      k += kappa;
+      grisuRound(digits, length, delta, rest, kPow10[kappa] << -one.e, distance);
+      return length;
+    }
+  }
+  for (int kappa = 0;;) {
+    p2 *= 10;
+    delta *= 10;
+    const char d = static_cast<char>(p2 >> -one.e);
+    if (d || length) {
+      digits[length++] = static_cast<char>('0' + d);
+    }
+    p2 &= one.f - 1;
+    --kappa;
+    if (p2 < delta) {
+      k += kappa;
+      const int index = -kappa;
+      grisuRound(digits, length, delta, p2, one.f, distance * (index < 20 ? kPow10[index] : 0));
+      return length;
+    }
+  }
+}
+
+size_t writeExponent(int exponent, char* out) {
+  size_t n = 0;
+  if (exponent < 0) {
+    out[n++] = '-';
+    exponent = -exponent;
+  }
+  if (exponent >= 100) {
+    out[n++] = static_cast<char>('0' + exponent / 100);
+    exponent %= 100;
+    out[n++] = static_cast<char>('0' + exponent / 10);
+  } else if (exponent >= 10) {
+    out[n++] = static_cast<char>('0' + exponent / 10);
+  }
+  out[n++] = static_cast<char>('0' + exponent % 10);
+  return n;
+}
+
+// Formats a finite, positive value; `out` needs 26 bytes.
+template <typename T>
+size_t formatPositive(T value, char* out) {
+  using Traits = FloatTraits<T>;
+  typename Traits::Bits bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const typename Traits::Bits hidden = static_cast<typename Traits::Bits>(1)
+                                       << Traits::kSignificandBits;
+  const int biased = static_cast<int>(bits >> Traits::kSignificandBits);
+  uint64_t f = bits & (hidden - 1);
+  int e;
+  if (biased != 0) {
+    f += hidden;
+    e = biased - Traits::kExponentBias;
+  } else {
+    e = 1 - Traits::kExponentBias;
+  }
+
+  // The boundaries halfway to the neighbouring values; the lower gap is half
+  // as wide at a power of two.
+  const DiyFp upper = DiyFp((f << 1) + 1, e - 1).normalized();
+  DiyFp lower = f == hidden ? DiyFp((f << 2) - 1, e - 2) : DiyFp((f << 1) - 1, e - 1);
+  lower.f <<= lower.e - upper.e;
+  lower.e = upper.e;
+
+  int k = 0;
+  const DiyFp power = cachedPower(upper.e, k);
+  const DiyFp w = DiyFp(f, e).normalized() * power;
+  DiyFp high = upper * power;
+  DiyFp low = lower * power;
+  ++low.f;
+  --high.f;
+  char digits[20];
+  const int length = digitGen(w, high, high.f - low.f, digits, k);
+
+  // digits * 10^k, written like JavaScript but always with a fraction or an
+  // exponent so the value reads back as a double.
+  const int point = length + k;  // 10^(point-1) <= value < 10^point
+  size_t n = 0;
+  if (length <= point && point <= 21) {
+    std::memcpy(out, digits, static_cast<size_t>(length));
+    n = static_cast<size_t>(length);
+    while (n < static_cast<size_t>(point)) {
+      out[n++] = '0';
+    }
+    out[n++] = '.';
+    out[n++] = '0';
+  } else if (0 < point && point <= 21) {
+    std::memcpy(out, digits, static_cast<size_t>(point));
+    out[point] = '.';
+    std::memcpy(out + point + 1, digits + point, static_cast<size_t>(length - point));
+    n = static_cast<size_t>(length + 1);
+  } else if (-6 < point && point <= 0) {
+    out[n++] = '0';
+    out[n++] = '.';
+    for (int i = point; i < 0; ++i) {
+      out[n++] = '0';
+    }
+    std::memcpy(out + n, digits, static_cast<size_t>(length));
+    n += static_cast<size_t>(length);
+  } else {
+    out[n++] = digits[0];
+    if (length > 1) {
+      out[n++] = '.';
+      std::memcpy(out + n, digits + 1, static_cast<size_t>(length - 1));
+      n += static_cast<size_t>(length - 1);
+    }
+    out[n++] = 'e';
+    n += writeExponent(point - 1, out + n);
+  }
+  return n;
+}
+
+// Formats a stored double; NaN and infinities have no JSON form and are
+// written as null. `out` needs 27 bytes.
+size_t formatDouble(detail::StoredDouble value, char* out) {
+  if (!std::isfinite(value)) {
+    std::memcpy(out, "null", 4);
+    return 4;
+  }
+  size_t n = 0;
+  if (std::signbit(value)) {
+    out[n++] = '-';
+    value = -value;
+  }
+  if (value == 0) {
+    std::memcpy(out + n, "0.0", 3);
+    return n + 3;
+  }
+  return n + formatPositive(value, out + n);
+}
+
+// `out` needs 11 bytes.
+size_t formatInt(int32_t value, char* out) {
+  char digits[10];
+  uint32_t magnitude = value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+  size_t count = 0;
+  do {
+    digits[count++] = static_cast<char>('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  size_t n = 0;
+  if (value < 0) {
+    out[n++] = '-';
+  }
+  while (count > 0) {
+    out[n++] = digits[--count];
+  }
+  return n;
+}
+
+// Collects writer output so the caller's sink sees chunks of a fixed size.
+class ChunkedSink : public Sink {
+ public:
+  explicit ChunkedSink(Sink& target) : target_(target) {}
+
+  bool write(const char* data, size_t length) override {
+    while (length > 0) {
+      if (used_ == sizeof(buffer_) && !flush()) {
+        return false;
+      }
+      const size_t n = std::min(length, sizeof(buffer_) - used_);
+      std::memcpy(buffer_ + used_, data, n);
+      used_ += n;
+      data += n;
+      length -= n;
+    }
+    return true;
+  }
+
+  bool flush() {
+    const bool ok = used_ == 0 || target_.write(buffer_, used_);
+    used_ = 0;
+    return ok;
+  }
+
+ private:
+  Sink& target_;
+  char buffer_[ASSOCTREE_JSON_CHUNK_BYTES];
+  size_t used_ = 0;
+};
+
+class StringSink : public Sink {
+ public:
+  explicit StringSink(std::string& out) : out_(out) {}
+  bool write(const char* data, size_t length) override {
+    out_.append(data, length);
+    return true;
+  }
+
+ private:
+  std::string& out_;
+};
+
+#ifdef ARDUINO
+class ArduinoStringSink : public Sink {
+ public:
+  explicit ArduinoStringSink(String& out) : out_(out) {}
+  bool write(const char* data, size_t length) override {
+    for (size_t i = 0; i < length; ++i) {
+      out_ += data[i];
+    }
+    return true;
+  }
+
+ private:
+  String& out_;
+};
+#endif
+
+int hexDigit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Header of a pool image. The node region follows, then the string region
+// with its offsets lowered as if the gap were empty, so the two regions form
+// a complete pool of `nodeCount * kNodeSize + stringBytes` bytes. Fields use
+// the host byte order; an image from a host with the other order fails the
+// magic check.
+struct ImageHeader {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t nodeBytes;
+  uint8_t doubleBytes;
+  uint8_t reserved;
+  uint16_t nodeCount;
+  uint16_t stringBytes;
+  uint16_t freeNode;
+  uint16_t freeNodeCount;
+  uint32_t internRefBytes;
+  uint32_t internBlockBytes;
+  // imageHash() of the header with this field zero, then of both regions.
+  uint32_t checksum;
+  uint32_t padding;
+};
+
+// Keeps the node region aligned when the image itself is, and lets the
+// writer hash the header and each node as separate pieces.
+static_assert(sizeof(ImageHeader) % alignof(detail::Node) == 0,
+              "ImageHeader must preserve node alignment");
+static_assert(sizeof(ImageHeader) % 4 == 0 && sizeof(detail::Node) % 4 == 0,
+              "image pieces must be whole 32-bit words");
+
+constexpr uint32_t kImageMagic = 0x4d495441;  // "ATIM" on little-endian hosts
+constexpr uint8_t kImageVersion = 1;
+
+constexpr uint32_t kImageHashSeed = 2166136261u;
+
+// FNV-1a over 32-bit words, continued from `hash`. Any change to a single
+// word changes the result. Splitting the input gives the same hash as long
+// as every piece but the last is a multiple of 4 bytes.
+uint32_t imageHash(uint32_t hash, const void* data, size_t len) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (; len >= sizeof(uint32_t); len -= sizeof(uint32_t), bytes += sizeof(uint32_t)) {
+    uint32_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    hash = (hash ^ word) * 16777619u;
+  }
+  for (; len > 0; --len) {
+    hash = (hash ^ *bytes++) * 16777619u;
+  }
+  return hash;
+}
+
+// Checks everything in the header that does not depend on the target pool,
+// then the checksum unless `verify` is false.
+bool readImageHeader(const uint8_t* image, size_t length, ImageHeader& header,
+                     bool verify = true) {
+  if (!image || length < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, image, sizeof(header));
+  const uint32_t checksum = header.checksum;
+  header.checksum = 0;
+  const size_t poolBytes = static_cast<size_t>(header.nodeCount) * kNodeSize + header.stringBytes;
+  return header.magic == kImageMagic && header.version == kImageVersion &&
+         header.nodeBytes == kNodeSize && header.doubleBytes == sizeof(detail::StoredDouble) &&
+         header.nodeCount > 0 && length == sizeof(header) + poolBytes &&
+         poolBytes <= std::numeric_limits<uint16_t>::max() &&
+         (!verify || imageHash(imageHash(kImageHashSeed, &header, sizeof(header)),
+                               image + sizeof(header), poolBytes) == checksum);
+}
+
+class HashSink : public Sink {
+ public:
+  bool write(const char* data, size_t length) override {
+    hash = imageHash(hash, data, length);
+    return true;
+  }
+
+  uint32_t hash = kImageHashSeed;
+};
+
+// MessagePack type bytes used by the writer and reader.
+constexpr uint8_t kMsgPackNil = 0xc0;
+constexpr uint8_t kMsgPackFalse = 0xc2;
+constexpr uint8_t kMsgPackTrue = 0xc3;
+constexpr uint8_t kMsgPackFloat32 = 0xca;
+constexpr uint8_t kMsgPackFloat64 = 0xcb;
+constexpr uint8_t kMsgPackUint8 = 0xcc;
+constexpr uint8_t kMsgPackInt8 = 0xd0;
+constexpr uint8_t kMsgPackStr8 = 0xd9;
+constexpr uint8_t kMsgPackArray16 = 0xdc;
+constexpr uint8_t kMsgPackMap16 = 0xde;
+
+// Writes a type byte followed by `bytes` bytes of `value`, big-endian.
+size_t putMsgPack(char* out, uint8_t type, uint64_t value, size_t bytes) {
+  out[0] = static_cast<char>(type);
+  for (size_t i = 0; i < bytes; ++i) {
+    out[1 + i] = static_cast<char>(value >> (8 * (bytes - 1 - i)));
+  }
+  return bytes + 1;
+}
+
+// Header of a string, array or map: the fix form below `fixLimit`, then the
+// 8-bit form when the type has one (`type8` != 0), then 16 and 32 bits.
+size_t msgPackLength(char* out, size_t length, uint8_t fixType, size_t fixLimit,
+                     uint8_t type8, uint8_t type16) {
+  if (length < fixLimit) {
+    out[0] = static_cast<char>(fixType | length);
+    return 1;
+  }
+  if (type8 != 0 && length <= 0xFF) {
+    return putMsgPack(out, type8, length, 1);
+  }
+  if (length <= 0xFFFF) {
+    return putMsgPack(out, type16, length, 2);
+  }
+  return putMsgPack(out, static_cast<uint8_t>(type16 + 1), length, 4);
+}
+
+// Smallest encoding that holds the value.
+size_t msgPackInt(char* out, int32_t value) {
+  if (value >= -32 && value <= 0x7F) {
+    out[0] = static_cast<char>(value);
+    return 1;
+  }
+  if (value > 0) {
+    const size_t bytes = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : 4;
+    return putMsgPack(out, static_cast<uint8_t>(kMsgPackUint8 + (bytes == 4 ? 2 : bytes - 1)),
+                      static_cast<uint32_t>(value), bytes);
+  }
+  const size_t bytes = value >= -0x80 ? 1 : value >= -0x8000 ? 2 : 4;
+  return putMsgPack(out, static_cast<uint8_t>(kMsgPackInt8 + (bytes == 4 ? 2 : bytes - 1)),
+                    static_cast<uint32_t>(value), bytes);
+}
+
+// Doubles keep the width they are stored with.
+size_t msgPackDouble(char* out, detail::StoredDouble value) {
+  using Bits = std::conditional<sizeof(value) == 4, uint32_t, uint64_t>::type;
+  Bits bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return putMsgPack(out, sizeof(bits) == 4 ? kMsgPackFloat32 : kMsgPackFloat64, bits,
+                    sizeof(bits));
+}
 
 }  // namespace
 
@@ -16,17 +681,40 @@ NodeRef::NodeRef(AssocTreeBase* tree, uint16_t baseIndex, uint16_t attachedIndex
     : tree_(tree),
       baseIndex_(baseIndex),
       attachedIndex_(attachedIndex),
-      revision_(tree ? tree->revision_ : 0) {}
+      revision_(tree ? tree->revision_ : 0),
+      generation_(tree ? tree->generationOf(attachedIndex) : 0),
+      baseGeneration_(tree ? tree->generationOf(baseIndex) : 0) {}
+
+NodeRef::NodeRef(const NodeRef& other) {
+  *this = other;
+}
+
+NodeRef& NodeRef::operator=(const NodeRef& other) {
+  if (this == &other) {
+    return *this;
+  }
+  tree_ = other.tree_;
+  baseIndex_ = other.baseIndex_;
+  attachedIndex_ = other.attachedIndex_;
+  revision_ = other.revision_;
+  generation_ = other.generation_;
+  baseGeneration_ = other.baseGeneration_;
+  pendingCount_ = other.pendingCount_;
+  keyBytesUsed_ = other.keyBytesUsed_;
+  overflow_ = other.overflow_;
+  std::copy(other.pending_, other.pending_ + other.pendingCount_, pending_);
+  std::memcpy(keyStorage_, other.keyStorage_, other.keyBytesUsed_);
+  return *this;
+}
 
 NodeRef NodeRef::operator[](const char* key) const {
-  auto guard = makeGuard();
   const char* safe = key ? key : "";
-  return withKeySegment(safe, std::strlen(safe));
+  const size_t len = std::strlen(safe);
+  return readConsistent([&] { return withKeySegment(safe, len); });
 }
 
 NodeRef NodeRef::operator[](size_t index) const {
-  auto guard = makeGuard();
-  return withIndexSegment(index);
+  return readConsistent([&] { return withIndexSegment(index); });
 }
 
 NodeRef NodeRef::operator[](int index) const {
@@ -93,20 +781,21 @@ NodeRef& NodeRef::operator=(const char* value) {
   if (!value) {
     return (*this = nullptr);
   }
-  uint16_t idx = ensureAttached();
+  const size_t length = std::strlen(value);
+  uint16_t idx = ensureAttached(stringBlockBytes(length));
   if (idx == detail::kInvalidIndex) {
     return *this;
   }
   detail::Node* node = tree_->nodeAt(idx);
   if (node) {
-    tree_->setNodeString(*node, value, std::strlen(value));
+    tree_->setNodeString(*node, value, length);
   }
   return *this;
 }
 
 NodeRef& NodeRef::operator=(const std::string& value) {
   auto guard = makeGuard();
-  uint16_t idx = ensureAttached();
+  uint16_t idx = ensureAttached(stringBlockBytes(value.size()));
   if (idx == detail::kInvalidIndex) {
     return *this;
   }
@@ -120,7 +809,7 @@ NodeRef& NodeRef::operator=(const std::string& value) {
 #ifdef ARDUINO
 NodeRef& NodeRef::operator=(const String& value) {
   auto guard = makeGuard();
-  uint16_t idx = ensureAttached();
+  uint16_t idx = ensureAttached(stringBlockBytes(value.length()));
   if (idx == detail::kInvalidIndex) {
     return *this;
   }
@@ -133,30 +822,32 @@ NodeRef& NodeRef::operator=(const String& value) {
 #endif
 
 const char* NodeRef::asCString(const char* defaultValue) const {
-  auto guard = makeGuard();
+  auto guard = makeReadGuard();
   uint16_t idx = resolveExisting();
   if (idx == detail::kInvalidIndex) {
     return defaultValue;
   }
-  const detail::Node* node = tree_->nodeAt(idx);
-  if (!node || node->type != detail::NodeType::String ||
-      !node->value.asString.valid()) {
-    return defaultValue;
-  }
-  return tree_->stringAt(node->value.asString);
+  const detail::Node* node = std::as_const(*tree_).nodeAt(idx);
+  const char* data = node ? tree_->stringData(*node) : nullptr;
+  return data ? data : defaultValue;
 }
 
 NodeRef::operator bool() const {
-  auto guard = makeGuard();
+  return readConsistent([&] { return readTruthy(); });
+}
+
+bool NodeRef::readTruthy() const {
   uint16_t idx = resolveExisting();
   if (idx == detail::kInvalidIndex) {
     return false;
   }
   const AssocTreeBase* tree = tree_;
-  const detail::Node* node = tree ? tree->nodeAt(idx) : nullptr;
-  if (!node) {
+  const detail::Node* live = tree ? tree->nodeAt(idx) : nullptr;
+  if (!live) {
     return false;
   }
+  const detail::Node snapshot = *live;
+  const detail::Node* node = &snapshot;
   switch (node->type) {
     case detail::NodeType::Null:
       return false;
@@ -167,41 +858,28 @@ NodeRef::operator bool() const {
     case detail::NodeType::Double:
       return node->value.asDouble != 0.0;
     case detail::NodeType::String:
-      return node->value.asString.valid() && node->value.asString.length > 0;
+      return tree->stringLength(*node) > 0;
     case detail::NodeType::Object:
-    case detail::NodeType::Array: {
-      const detail::Node* child = node->firstChild == detail::kInvalidIndex
-                                      ? nullptr
-                                      : tree->nodeAt(node->firstChild);
-      while (child) {
-        if (child->used) {
-          return true;
-        }
-        if (child->nextSibling == detail::kInvalidIndex) {
-          break;
-        }
-        child = tree->nodeAt(child->nextSibling);
-      }
-      return false;
-    }
+    case detail::NodeType::Array:
+      return node->value.asContainer.count > 0;
     default:
       return false;
   }
 }
 
 bool NodeRef::exists() const {
-  auto guard = makeGuard();
-  return resolveExisting() != detail::kInvalidIndex;
+  return readConsistent([&] { return resolveExisting() != detail::kInvalidIndex; });
 }
 
 detail::NodeType NodeRef::type() const {
-  auto guard = makeGuard();
-  uint16_t idx = resolveExisting();
-  if (idx == detail::kInvalidIndex || !tree_) {
-    return detail::NodeType::Null;
-  }
-  const detail::Node* node = tree_->nodeAt(idx);
-  return node ? node->type : detail::NodeType::Null;
+  return readConsistent([&] {
+    uint16_t idx = resolveExisting();
+    if (idx == detail::kInvalidIndex || !tree_) {
+      return detail::NodeType::Null;
+    }
+    const detail::Node* node = std::as_const(*tree_).nodeAt(idx);
+    return node ? node->type : detail::NodeType::Null;
+  });
 }
 
 #define ASSOCTREE_DEFINE_TYPE_CHECK(NAME, ENUM)           \
@@ -220,52 +898,56 @@ ASSOCTREE_DEFINE_TYPE_CHECK(isArray, Array)
 #undef ASSOCTREE_DEFINE_TYPE_CHECK
 
 size_t NodeRef::size() const {
-  auto guard = makeGuard();
-  uint16_t idx = resolveExisting();
-  if (idx == detail::kInvalidIndex || !tree_) {
-    return 0;
-  }
-  const detail::Node* node = tree_->nodeAt(idx);
-  if (!node) {
-    return 0;
-  }
-  if (node->type != detail::NodeType::Object &&
-      node->type != detail::NodeType::Array) {
-    return 0;
-  }
-  return tree_->countChildren(idx);
+  return readConsistent([&]() -> size_t {
+    uint16_t idx = resolveExisting();
+    if (idx == detail::kInvalidIndex || !tree_) {
+      return 0;
+    }
+    const detail::Node* node = std::as_const(*tree_).nodeAt(idx);
+    if (!node) {
+      return 0;
+    }
+    if (node->type != detail::NodeType::Object &&
+        node->type != detail::NodeType::Array) {
+      return 0;
+    }
+    return tree_->countChildren(idx);
+  });
 }
 
 bool NodeRef::contains(const char* key) const {
-  auto guard = makeGuard();
   if (!tree_ || !key) {
     return false;
   }
-  uint16_t idx = resolveExisting();
-  if (idx == detail::kInvalidIndex) {
-    return false;
-  }
-  const detail::Node* node = tree_->nodeAt(idx);
-  if (!node || node->type != detail::NodeType::Object) {
-    return false;
-  }
-  return tree_->findChildByKey(idx, key, std::strlen(key)) != detail::kInvalidIndex;
+  const size_t len = std::strlen(key);
+  return readConsistent([&] {
+    uint16_t idx = resolveExisting();
+    if (idx == detail::kInvalidIndex) {
+      return false;
+    }
+    const detail::Node* node = std::as_const(*tree_).nodeAt(idx);
+    if (!node || node->type != detail::NodeType::Object) {
+      return false;
+    }
+    return tree_->findChildByKey(idx, key, len) != detail::kInvalidIndex;
+  });
 }
 
 bool NodeRef::contains(size_t index) const {
-  auto guard = makeGuard();
   if (!tree_) {
     return false;
   }
-  uint16_t idx = resolveExisting();
-  if (idx == detail::kInvalidIndex) {
-    return false;
-  }
-  const detail::Node* node = tree_->nodeAt(idx);
-  if (!node || node->type != detail::NodeType::Array) {
-    return false;
-  }
-  return tree_->findChildByIndex(idx, index) != detail::kInvalidIndex;
+  return readConsistent([&] {
+    uint16_t idx = resolveExisting();
+    if (idx == detail::kInvalidIndex) {
+      return false;
+    }
+    const detail::Node* node = std::as_const(*tree_).nodeAt(idx);
+    if (!node || node->type != detail::NodeType::Array) {
+      return false;
+    }
+    return tree_->findChildByIndex(idx, index) != detail::kInvalidIndex;
+  });
 }
 
 bool NodeRef::append(int32_t value) {
@@ -296,69 +978,80 @@ bool NodeRef::append(const String& value) {
 
 void NodeRef::clear() {
   auto guard = makeGuard();
-  if (!tree_) {
+  if (!tree_ || tree_->readOnly_) {
     return;
   }
   uint16_t idx = resolveExisting();
   if (idx == detail::kInvalidIndex) {
     return;
   }
+  tree_->reserve(0);
   detail::Node* node = tree_->nodeAt(idx);
   if (!node) {
     return;
   }
-  uint16_t child = node->firstChild;
-  while (child != detail::kInvalidIndex) {
-    detail::Node* c = tree_->nodeAt(child);
-    uint16_t next = c ? c->nextSibling : detail::kInvalidIndex;
-    if (c && c->used) {
-      tree_->detachNode(child);
-    }
-    child = next;
-  }
+  tree_->releaseChildren(*node);
 }
 
 void NodeRef::unset() {
   auto guard = makeGuard();
   uint16_t idx = resolveExisting();
-  if (idx == detail::kInvalidIndex) {
+  if (idx == detail::kInvalidIndex || tree_->readOnly_) {
     return;
   }
+  tree_->reserve(0);
   tree_->detachNode(idx);
   attachedIndex_ = detail::kInvalidIndex;
   pendingCount_ = 0;
   keyBytesUsed_ = 0;
   overflow_ = false;
   baseIndex_ = tree_->rootIndex();
+  baseGeneration_ = tree_->generationOf(baseIndex_);
 }
 
 bool NodeRef::isAttached() const {
-  auto guard = makeGuard();
+  auto guard = makeReadGuard();
   if (!tree_) {
     return false;
   }
-  if (pendingCount_ != 0) {
-    return false;
-  }
-  if (attachedIndex_ == detail::kInvalidIndex) {
-    return false;
-  }
-  return revision_ == tree_->revision_;
+  return tree_->follow(attachedIndex_, revision_, generation_) != detail::kInvalidIndex;
 }
 
-uint16_t NodeRef::ensureAttached() {
-  if (!tree_) {
+uint16_t NodeRef::ensureAttached(size_t valueBytes) {
+  if (!tree_ || tree_->readOnly_) {
     return detail::kInvalidIndex;
   }
   if (overflow_) {
+    tree_->failTransaction();
     return detail::kInvalidIndex;
   }
-  if (revision_ != tree_->revision_) {
-    attachedIndex_ = detail::kInvalidIndex;
+  // Follow the node if gc() moved it, and drop it if its slot was freed
+  // since. A base that cannot be followed must not be replaced by the root.
+  attachedIndex_ = tree_->follow(attachedIndex_, revision_, generation_);
+  if (attachedIndex_ != detail::kInvalidIndex) {
+    generation_ = tree_->generationOf(attachedIndex_);
   }
+  if (pendingCount_ != 0 && attachedIndex_ != detail::kInvalidIndex) {
+    // The path was bound by operator[] and its node is still there.
+    baseIndex_ = attachedIndex_;
+    baseGeneration_ = generation_;
+    pendingCount_ = 0;
+    keyBytesUsed_ = 0;
+  }
+  if (pendingCount_ != 0 && baseIndex_ != detail::kInvalidIndex) {
+    baseIndex_ = tree_->follow(baseIndex_, revision_, baseGeneration_);
+    if (baseIndex_ == detail::kInvalidIndex) {
+      tree_->failTransaction();
+      return detail::kInvalidIndex;
+    }
+    baseGeneration_ = tree_->generationOf(baseIndex_);
+  }
+  touchRevision();
   if (pendingCount_ == 0) {
     if (attachedIndex_ != detail::kInvalidIndex) {
-      touchRevision();
+      tree_->reserve(valueBytes);
+    } else {
+      tree_->failTransaction();
     }
     return attachedIndex_;
   }
@@ -369,9 +1062,14 @@ uint16_t NodeRef::ensureAttached() {
   if (idx != detail::kInvalidIndex) {
     attachedIndex_ = idx;
     baseIndex_ = idx;
+    generation_ = tree_->generationOf(idx);
+    baseGeneration_ = generation_;
     pendingCount_ = 0;
     keyBytesUsed_ = 0;
     touchRevision();
+    tree_->reserve(valueBytes);
+  } else {
+    tree_->failTransaction();
   }
   return idx;
 }
@@ -384,16 +1082,18 @@ uint16_t NodeRef::resolveExisting() const {
   if (overflow_) {
     return detail::kInvalidIndex;
   }
-  if (pendingCount_ == 0) {
-    if (attachedIndex_ != detail::kInvalidIndex &&
-        revision_ == tree->revision_) {
-      return attachedIndex_;
-    }
-    return detail::kInvalidIndex;
+  const uint16_t bound = tree->follow(attachedIndex_, revision_, generation_);
+  if (pendingCount_ == 0 || bound != detail::kInvalidIndex) {
+    return bound;
   }
   uint16_t anchor = baseIndex_;
   if (anchor == detail::kInvalidIndex) {
     anchor = tree->rootIndex();
+  } else {
+    anchor = tree->follow(anchor, revision_, baseGeneration_);
+    if (anchor == detail::kInvalidIndex) {
+      return detail::kInvalidIndex;
+    }
   }
   return tree->findExisting(anchor, pendingPath());
 }
@@ -402,23 +1102,37 @@ void NodeRef::touchRevision() {
   revision_ = tree_ ? tree_->revision_ : 0;
 }
 
+uint16_t NodeRef::boundIndex() const {
+  if (overflow_) {
+    return detail::kInvalidIndex;
+  }
+  return tree_->follow(attachedIndex_, revision_, generation_);
+}
+
 NodeRef NodeRef::withKeySegment(const char* key, size_t len) const {
   if (!tree_) {
     return *this;
   }
+  // An existing child is bound right away. The path is kept as well, so a
+  // ref whose node was unset resolves it again like a lazy one.
+  const uint16_t bound = boundIndex();
+  const uint16_t child =
+      bound != detail::kInvalidIndex ? tree_->findChildByKey(bound, key, len) : detail::kInvalidIndex;
   NodeRef next = *this;
-  if (!prepareForSegment(next)) {
-    next.overflow_ = true;
-    return next;
-  }
-  if (!appendKey(next, key, len)) {
-    next.overflow_ = true;
-    return next;
+  if (!prepareForSegment(next) || !appendKey(next, key, len)) {
+    if (!dropExistingPrefix(next) || !prepareForSegment(next) || !appendKey(next, key, len)) {
+      if (child != detail::kInvalidIndex) {
+        return NodeRef(tree_, child, child);
+      }
+      next.overflow_ = true;
+      return next;
+    }
   }
   detail::LazySegment& seg = next.pending_[next.pendingCount_++];
   seg.kind = detail::LazySegment::Kind::Key;
   seg.keyOffset = next.keyBytesUsed_ - static_cast<uint16_t>(len);
   seg.keyLength = static_cast<uint16_t>(len);
+  bindSegment(next, child);
   return next;
 }
 
@@ -426,18 +1140,25 @@ NodeRef NodeRef::withIndexSegment(size_t index) const {
   if (!tree_) {
     return *this;
   }
+  const uint16_t bound = boundIndex();
+  const uint16_t child =
+      bound != detail::kInvalidIndex ? tree_->findChildByIndex(bound, index) : detail::kInvalidIndex;
   NodeRef next = *this;
-  if (!prepareForSegment(next)) {
-    next.overflow_ = true;
-    return next;
-  }
-  if (next.pendingCount_ >= ASSOCTREE_MAX_LAZY_SEGMENTS) {
-    next.overflow_ = true;
-    return next;
+  // No array can hold that many nodes, so the index can never be created.
+  const bool creatable = index < detail::kInvalidIndex;
+  if (!prepareForSegment(next) || !creatable) {
+    if (!creatable || !dropExistingPrefix(next) || !prepareForSegment(next)) {
+      if (child != detail::kInvalidIndex) {
+        return NodeRef(tree_, child, child);
+      }
+      next.overflow_ = true;
+      return next;
+    }
   }
   detail::LazySegment& seg = next.pending_[next.pendingCount_++];
   seg.kind = detail::LazySegment::Kind::Index;
-  seg.index = index;
+  seg.index = static_cast<uint16_t>(index);
+  bindSegment(next, child);
   return next;
 }
 
@@ -445,16 +1166,77 @@ bool NodeRef::prepareForSegment(NodeRef& ref) const {
   if (ref.pendingCount_ == 0) {
     if (ref.attachedIndex_ != detail::kInvalidIndex) {
       ref.baseIndex_ = ref.attachedIndex_;
+      ref.baseGeneration_ = ref.generation_;
       ref.attachedIndex_ = detail::kInvalidIndex;
     } else if (ref.baseIndex_ == detail::kInvalidIndex) {
       ref.baseIndex_ = tree_ ? tree_->rootIndex() : detail::kInvalidIndex;
+      ref.baseGeneration_ = tree_ ? tree_->generationOf(ref.baseIndex_) : 0;
+    }
+  } else {
+    // The bound node belongs to the shorter path.
+    ref.attachedIndex_ = detail::kInvalidIndex;
+    if (ref.baseIndex_ == detail::kInvalidIndex) {
+      ref.baseIndex_ = tree_ ? tree_->rootIndex() : detail::kInvalidIndex;
+      ref.baseGeneration_ = tree_ ? tree_->generationOf(ref.baseIndex_) : 0;
     }
-  } else if (ref.baseIndex_ == detail::kInvalidIndex) {
-    ref.baseIndex_ = tree_ ? tree_->rootIndex() : detail::kInvalidIndex;
   }
   return ref.pendingCount_ < ASSOCTREE_MAX_LAZY_SEGMENTS;
 }
 
+bool NodeRef::dropExistingPrefix(NodeRef& ref) const {
+  // The path is full: rebase on its deepest existing node, so only the
+  // missing suffix stays buffered. The fallback then starts at that node.
+  uint16_t node = ref.baseIndex_ == detail::kInvalidIndex
+                      ? tree_->rootIndex()
+                      : tree_->follow(ref.baseIndex_, ref.revision_, ref.baseGeneration_);
+  uint8_t count = 0;
+  uint16_t keyBytes = 0;
+  while (node != detail::kInvalidIndex && count < ref.pendingCount_) {
+    const detail::LazySegment& seg = ref.pending_[count];
+    const uint16_t child =
+        seg.kind == detail::LazySegment::Kind::Key
+            ? tree_->findChildByKey(node, reinterpret_cast<const char*>(ref.keyStorage_ + seg.keyOffset),
+                                    seg.keyLength)
+            : tree_->findChildByIndex(node, seg.index);
+    if (child == detail::kInvalidIndex) {
+      break;
+    }
+    if (seg.kind == detail::LazySegment::Kind::Key) {
+      keyBytes = static_cast<uint16_t>(keyBytes + seg.keyLength);
+    }
+    node = child;
+    ++count;
+  }
+  if (node == detail::kInvalidIndex || count == 0) {
+    return false;
+  }
+  ref.pendingCount_ = static_cast<uint8_t>(ref.pendingCount_ - count);
+  std::copy(ref.pending_ + count, ref.pending_ + count + ref.pendingCount_, ref.pending_);
+  for (uint8_t i = 0; i < ref.pendingCount_; ++i) {
+    if (ref.pending_[i].kind == detail::LazySegment::Kind::Key) {
+      ref.pending_[i].keyOffset = static_cast<uint16_t>(ref.pending_[i].keyOffset - keyBytes);
+    }
+  }
+  ref.keyBytesUsed_ = static_cast<uint16_t>(ref.keyBytesUsed_ - keyBytes);
+  std::memmove(ref.keyStorage_, ref.keyStorage_ + keyBytes, ref.keyBytesUsed_);
+  ref.baseIndex_ = node;
+  ref.baseGeneration_ = tree_->generationOf(node);
+  // A path that exists completely leaves a ref bound to its node.
+  ref.attachedIndex_ = ref.pendingCount_ == 0 ? node : detail::kInvalidIndex;
+  ref.generation_ = ref.baseGeneration_;
+  ref.touchRevision();
+  return true;
+}
+
+void NodeRef::bindSegment(NodeRef& ref, uint16_t child) const {
+  // `child` was found at the current revision; a ref from before the last
+  // gc() keeps resolving its path instead.
+  if (child != detail::kInvalidIndex && ref.revision_ == tree_->revision_) {
+    ref.attachedIndex_ = child;
+    ref.generation_ = tree_->generationOf(child);
+  }
+}
+
 bool NodeRef::appendKey(NodeRef& ref, const char* key, size_t len) const {
   if (len > ASSOCTREE_LAZY_KEY_BYTES) {
     return false;
@@ -482,8 +1264,15 @@ detail::LockGuard NodeRef::makeGuard() const {
   return detail::LockGuard(nullptr);
 }
 
+detail::LockGuard NodeRef::makeReadGuard() const {
+  if (tree_) {
+    return tree_->makeReadGuard();
+  }
+  return detail::LockGuard(nullptr);
+}
+
 NodeRange NodeRef::children() const {
-  auto guard = makeGuard();
+  auto guard = makeReadGuard();
   if (!tree_) {
     return NodeRange();
   }
@@ -491,7 +1280,7 @@ NodeRange NodeRef::children() const {
   if (idx == detail::kInvalidIndex) {
     return NodeRange();
   }
-  const detail::Node* node = tree_->nodeAt(idx);
+  const detail::Node* node = std::as_const(*tree_).nodeAt(idx);
   if (!node) {
     return NodeRange();
   }
@@ -502,27 +1291,35 @@ NodeRange NodeRef::children() const {
   return NodeRange(tree_, node->firstChild, node->type == detail::NodeType::Array, tree_->revision_);
 }
 
-NodeEntry::NodeEntry(AssocTreeBase* tree, uint16_t nodeIndex, bool isArray, size_t arrayIndex)
-    : tree_(tree), nodeIndex_(nodeIndex), isArray_(isArray), arrayIndex_(arrayIndex) {}
+NodeEntry::NodeEntry(
+    AssocTreeBase* tree,
+    uint16_t nodeIndex,
+    bool isArray,
+    uint32_t revision,
+    size_t arrayIndex)
+    : tree_(tree),
+      nodeIndex_(nodeIndex),
+      isArray_(isArray),
+      revision_(revision),
+      arrayIndex_(arrayIndex) {}
 
 const char* NodeEntry::key() const {
-  auto guard = tree_ ? tree_->makeLockGuard() : detail::LockGuard(nullptr);
-  if (!tree_ || isArray_ || nodeIndex_ == detail::kInvalidIndex) {
+  auto guard = tree_ ? tree_->makeReadGuard() : detail::LockGuard(nullptr);
+  if (!tree_ || isArray_) {
     return "";
   }
-  const detail::Node* node = tree_->nodeAt(nodeIndex_);
-  if (!node || !node->key.valid()) {
-    return "";
-  }
-  return tree_->stringAt(node->key);
+  const detail::Node* node = std::as_const(*tree_).nodeAt(tree_->rebind(nodeIndex_, revision_));
+  const char* data = node ? tree_->keyData(*node) : nullptr;
+  return data ? data : "";
 }
 
 NodeRef NodeEntry::value() const {
-  auto guard = tree_ ? tree_->makeLockGuard() : detail::LockGuard(nullptr);
-  if (!tree_ || nodeIndex_ == detail::kInvalidIndex) {
+  auto guard = tree_ ? tree_->makeReadGuard() : detail::LockGuard(nullptr);
+  const uint16_t index = tree_ ? tree_->rebind(nodeIndex_, revision_) : detail::kInvalidIndex;
+  if (index == detail::kInvalidIndex) {
     return NodeRef();
   }
-  return NodeRef(tree_, nodeIndex_, nodeIndex_);
+  return NodeRef(tree_, index, index);
 }
 
 NodeIterator::NodeIterator(
@@ -536,7 +1333,7 @@ NodeIterator::NodeIterator(
       isArray_(isArray),
       revision_(revision),
       arrayIndex_(arrayIndex) {
-  auto guard = tree_ ? tree_->makeLockGuard() : detail::LockGuard(nullptr);
+  auto guard = tree_ ? tree_->makeReadGuard() : detail::LockGuard(nullptr);
   advanceToValid();
 }
 
@@ -546,11 +1343,11 @@ void NodeIterator::advanceToValid() {
     return;
   }
   if (revision_ != tree_->revision_) {
-    current_ = detail::kInvalidIndex;
-    return;
+    current_ = tree_->rebind(current_, revision_);
+    revision_ = tree_->revision_;
   }
   while (current_ != detail::kInvalidIndex) {
-    const detail::Node* node = tree_->nodeAt(current_);
+    const detail::Node* node = std::as_const(*tree_).nodeAt(current_);
     if (node && node->used) {
       return;
     }
@@ -559,24 +1356,24 @@ void NodeIterator::advanceToValid() {
 }
 
 NodeEntry NodeIterator::operator*() const {
-  auto guard = tree_ ? tree_->makeLockGuard() : detail::LockGuard(nullptr);
-  return NodeEntry(tree_, current_, isArray_, arrayIndex_);
+  auto guard = tree_ ? tree_->makeReadGuard() : detail::LockGuard(nullptr);
+  return NodeEntry(tree_, current_, isArray_, revision_, arrayIndex_);
 }
 
 NodeIterator& NodeIterator::operator++() {
-  auto guard = tree_ ? tree_->makeLockGuard() : detail::LockGuard(nullptr);
+  auto guard = tree_ ? tree_->makeReadGuard() : detail::LockGuard(nullptr);
   if (!tree_ || current_ == detail::kInvalidIndex) {
     current_ = detail::kInvalidIndex;
     return *this;
   }
   if (revision_ != tree_->revision_) {
-    current_ = detail::kInvalidIndex;
-    return *this;
+    current_ = tree_->rebind(current_, revision_);
+    revision_ = tree_->revision_;
   }
   if (isArray_) {
     ++arrayIndex_;
   }
-  const detail::Node* node = tree_->nodeAt(current_);
+  const detail::Node* node = std::as_const(*tree_).nodeAt(current_);
   current_ = node ? node->nextSibling : detail::kInvalidIndex;
   advanceToValid();
   return *this;
@@ -604,6 +1401,9 @@ NodeIterator NodeRange::end() const {
 }
 
 AssocTreeBase::AssocTreeBase(uint8_t* buffer, size_t totalBytes)
+    : AssocTreeBase(buffer, totalBytes, true) {}
+
+AssocTreeBase::AssocTreeBase(uint8_t* buffer, size_t totalBytes, bool reset)
     : buffer_(buffer),
       totalBytes_(std::min(
           totalBytes,
@@ -611,7 +1411,173 @@ AssocTreeBase::AssocTreeBase(uint8_t* buffer, size_t totalBytes)
       nodeTop_(0),
       strTop_(0),
       nodeCount_(0),
-      revision_(1) {
+      revision_(1),
+      stableRevision_(1) {
+  if (attachBuffer() && reset) {
+    resetPool();
+  }
+}
+
+AssocTreeBase::AssocTreeBase(PoolAllocator& allocator, size_t initialBytes)
+    : AssocTreeBase(nullptr, 0, false) {
+  const size_t bytes = std::min(std::max(initialBytes, kNodeSize), kMaxPoolBytes);
+  block_ = static_cast<uint8_t*>(allocator.reallocate(nullptr, bytes + kPoolSlack));
+  if (!block_) {
+    return;  // left without a pool, as for a null buffer
+  }
+  allocator_ = &allocator;
+  buffer_ = alignedPool(block_);
+  totalBytes_ = bytes;
+  if (attachBuffer()) {
+    resetPool();
+  }
+}
+
+void AssocTreeBase::releasePool() {
+  if (allocator_) {
+    allocator_->release(block_);
+    allocator_ = nullptr;
+    block_ = nullptr;
+    buffer_ = nullptr;
+  }
+}
+
+void AssocTreeBase::reserveGap(size_t bytes) {
+  if (!buffer_ || readOnly_) {
+    return;
+  }
+  if (txnDepth_ != 0) {
+    bytes += writeJournalBytes();
+  }
+  if (strTop_ < nodeTop_ || strTop_ - nodeTop_ < bytes) {
+    growPool(bytes);
+  }
+}
+
+size_t AssocTreeBase::childBytes(uint16_t parentIndex, size_t added) const {
+  size_t bytes = added * kNodeSize;
+  const Node* parent = nodeAt(parentIndex);
+  const size_t count = countChildren(parentIndex) + added;
+  if (ASSOCTREE_INDEX_THRESHOLD == 0 || added == 0 || !parent ||
+      count <= ASSOCTREE_INDEX_THRESHOLD) {
+    return bytes;
+  }
+  // A table that has to grow is built again at the new size.
+  const size_t capacity =
+      parent->type == NodeType::Array ? arrayCapacityFor(count) : indexCapacityFor(count);
+  const detail::IndexHeader* header = indexHeader(*parent);
+  if (!header || header->capacity < capacity) {
+    bytes += tableBlockBytes(capacity);
+  }
+  return bytes;
+}
+
+bool AssocTreeBase::growPool(size_t gap) {
+  // Doubling keeps the copying to a constant amount per byte stored.
+  const size_t used = nodeTop_ + (totalBytes_ - strTop_);
+  size_t target = totalBytes_;
+  while (target < used + gap && target < kMaxPoolBytes) {
+    target = std::min(target * 2, kMaxPoolBytes);
+  }
+  if (target <= totalBytes_) {
+    return false;
+  }
+  const size_t pad = static_cast<size_t>(buffer_ - block_);
+  auto* block = static_cast<uint8_t*>(allocator_->reallocate(block_, target + kPoolSlack));
+  if (!block) {
+    return false;
+  }
+  // The node region and the gap (which may hold a reader's scratch copy)
+  // stay at the front; the string region moves to the new end.
+  uint8_t* buffer = alignedPool(block);
+  if (buffer != block + pad) {
+    std::memmove(buffer, block + pad, totalBytes_);
+  }
+  const size_t delta = target - totalBytes_;
+  std::memmove(buffer + strTop_ + delta, buffer + strTop_, totalBytes_ - strTop_);
+  block_ = block;
+  buffer_ = buffer;
+  totalBytes_ = target;
+  rebasePool(delta);
+  ++poolGrowths_;
+  return true;
+}
+
+void AssocTreeBase::rebasePool(size_t delta) {
+  // String-region offsets count from the start of the pool, so everything
+  // that names a block moves up with it. Node indices stay as they are.
+  const auto shift = [delta](uint16_t& offset) {
+    offset = static_cast<uint16_t>(offset + delta);
+  };
+  uint16_t* refs[3];
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    // Not through nodeAt(), which would journal the node.
+    Node* node = reinterpret_cast<Node*>(buffer_ + static_cast<size_t>(i) * kNodeSize);
+    if (node->used) {
+      for (size_t r = 0, n = blockRefs(*node, refs); r < n; ++r) {
+        shift(*refs[r]);
+      }
+    }
+  }
+  for (size_t cls = 0; cls < detail::kBlockClasses; ++cls) {
+    for (uint16_t* link = &freeBlocks_[cls]; *link != 0;
+         link = reinterpret_cast<uint16_t*>(buffer_ + *link)) {
+      shift(*link);
+    }
+  }
+  for (size_t i = 0; i < ASSOCTREE_INTERN_SLOTS; ++i) {
+    if (internSlots_[i].valid()) {
+      shift(internSlots_[i].offset);
+    }
+  }
+  if (relocation_ != 0) {
+    shift(relocation_);
+  }
+  if (gcPhase_ == GcPhase::Strings) {
+    gcRead_ += delta;
+    gcWrite_ += delta;
+  }
+  strTop_ += delta;
+  if (txnDepth_ == 0) {
+    return;
+  }
+  txnStrTop_ += delta;
+  shift(txnState_);
+  Checkpoint checkpoint;
+  std::memcpy(&checkpoint, buffer_ + txnState_, sizeof(checkpoint));
+  checkpoint.strTop += delta;
+  for (uint16_t& head : checkpoint.freeBlocks) {
+    if (head != 0) {
+      shift(head);
+    }
+  }
+  std::memcpy(buffer_ + txnState_, &checkpoint, sizeof(checkpoint));
+  // Each record starts with the offset of the one before it.
+  for (uint16_t* link = &txnJournal_; *link != 0;
+       link = reinterpret_cast<uint16_t*>(buffer_ + *link)) {
+    shift(*link);
+    uint8_t* record = buffer_ + *link;
+    JournalRecord header;
+    std::memcpy(&header, record, sizeof(header));
+    if (header.node == kReleaseRecord || header.node == kTakenRecord) {
+      BlockRecord block;
+      std::memcpy(&block, record + sizeof(header), sizeof(block));
+      shift(block.offset);
+      std::memcpy(record + sizeof(header), &block, sizeof(block));
+    } else {
+      Node saved;
+      std::memcpy(&saved, record + sizeof(header), kNodeSize);
+      if (saved.used) {
+        for (size_t r = 0, n = blockRefs(saved, refs); r < n; ++r) {
+          shift(*refs[r]);
+        }
+        std::memcpy(record + sizeof(header), &saved, kNodeSize);
+      }
+    }
+  }
+}
+
+bool AssocTreeBase::attachBuffer() {
   auto invalidate = [this]() {
     buffer_ = nullptr;
     totalBytes_ = 0;
@@ -622,7 +1588,7 @@ AssocTreeBase::AssocTreeBase(uint8_t* buffer, size_t totalBytes)
   };
   if (!buffer_ || totalBytes_ == 0) {
     invalidate();
-    return;
+    return false;
   }
   size_t alignment = alignof(Node);
   size_t misalign = reinterpret_cast<uintptr_t>(buffer_) % alignment;
@@ -630,22 +1596,18 @@ AssocTreeBase::AssocTreeBase(uint8_t* buffer, size_t totalBytes)
     size_t adjust = alignment - misalign;
     if (totalBytes_ <= adjust) {
       invalidate();
-      return;
+      return false;
     }
     buffer_ += adjust;
     totalBytes_ -= adjust;
   }
+  totalBytes_ &= ~static_cast<size_t>(1);
   strTop_ = totalBytes_;
   if (totalBytes_ < kNodeSize) {
     invalidate();
-    return;
-  }
-  createNode();  // root
-  Node* root = nodeAt(rootIndex());
-  if (root) {
-    root->type = NodeType::Object;
-    root->used = 1;
+    return false;
   }
+  return true;
 }
 
 NodeRef AssocTreeBase::operator[](const char* key) {
@@ -656,171 +1618,706 @@ NodeRef AssocTreeBase::operator[](size_t index) {
   return makeRootRef()[index];
 }
 
+NodeRef AssocTreeView::operator[](const char* key) const {
+  return root()[key];
+}
+
+NodeRef AssocTreeView::operator[](size_t index) const {
+  return root()[index];
+}
+
+NodeRef AssocTreeView::root() const {
+  // Safe to hand out: every write through a read-only tree fails.
+  return const_cast<AssocTreeView*>(this)->makeRootRef();
+}
+
+PoolStats AssocTreeBase::poolStats() const {
+  auto guard = makeReadGuard();
+  PoolStats stats;
+  stats.nodeSlots = nodeCount_;
+  stats.freeNodeSlots = freeNodeCount_;
+  stats.reusedNodeSlots = reusedNodes_;
+  stats.freeBlockBytes = freeBlockBytes_;
+  stats.reusedBlocks = reusedBlocks_;
+  stats.inPlaceStrings = inPlaceStrings_;
+  stats.internHits = internHits_;
+  stats.internSavedBytes =
+      internRefBytes_ > internBlockBytes_ ? internRefBytes_ - internBlockBytes_ : 0;
+  stats.poolBytes = totalBytes_;
+  stats.poolGrowths = poolGrowths_;
+  return stats;
+}
+
 size_t AssocTreeBase::freeBytes() const {
-  auto guard = makeLockGuard();
+  auto guard = makeReadGuard();
+  size_t gap = gcPhase_ == GcPhase::Strings ? gcWrite_ - gcRead_ : 0;
   if (strTop_ <= nodeTop_) {
-    return 0;
+    return gap;
   }
-  return strTop_ - nodeTop_;
+  return strTop_ - nodeTop_ + gap;
 }
 
 void AssocTreeBase::gc() {
   auto guard = makeLockGuard();
-  if (!buffer_) {
+  if (!buffer_ || readOnly_ || txnDepth_ != 0) {
     return;
   }
+  // An unfinished gcStep() cycle leaves the tree consistent, so just drop it.
+  gcPhase_ = GcPhase::Idle;
+  freeNode_ = detail::kInvalidIndex;
+  freeNodeCount_ = 0;
+  clearFreeBlocks();
+  clearInterned();
   for (uint16_t i = 0; i < nodeCount_; ++i) {
     Node* node = nodeAt(i);
     if (node) {
       node->mark = 0;
     }
   }
-  markReachable(rootIndex());
+  uint16_t cursor = rootIndex();
+  bool backtracking = false;
+  markReachable(cursor, backtracking, std::numeric_limits<size_t>::max());
+  const uint16_t oldCount = nodeCount_;
   compactNodes();
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    Node* node = nodeAt(i);
+    if (node && (node->type == NodeType::Object || node->type == NodeType::Array)) {
+      node->value.asContainer.table = 0;
+    }
+  }
   compactStrings();
-  ++revision_;
+  recordRelocation(oldCount);
+  if (ASSOCTREE_INDEX_THRESHOLD > 0) {
+    for (uint16_t i = 0; i < nodeCount_; ++i) {
+      const Node* node = nodeAt(i);
+      if (!node || node->value.asContainer.count <= ASSOCTREE_INDEX_THRESHOLD) {
+        continue;
+      }
+      if (node->type == NodeType::Object) {
+        buildIndex(i, indexCapacityFor(node->value.asContainer.count));
+      } else if (node->type == NodeType::Array) {
+        buildIndex(i, arrayCapacityFor(node->value.asContainer.count));
+      }
+    }
+  }
 }
 
-bool AssocTreeBase::toJson(std::string& out) const {
+bool AssocTreeBase::gcStep(size_t budget) {
   auto guard = makeLockGuard();
+  if (!buffer_ || readOnly_) {
+    return true;
+  }
+  if (txnDepth_ != 0) {
+    return gcPhase_ == GcPhase::Idle;
+  }
+  if (gcPhase_ == GcPhase::Idle) {
+    gcPhase_ = GcPhase::ClearMarks;
+    gcCursor_ = 0;
+  }
+  const uint32_t start = nowMicros();
+  // Always make some progress, even with a zero budget.
+  size_t remaining = std::max<size_t>(budget, 1);
+  while (gcPhase_ != GcPhase::Idle && remaining > 0) {
+    remaining -= std::min(remaining, gcAdvance());
+    if (gcMaxPauseUs_ != 0 && static_cast<uint32_t>(nowMicros() - start) >= gcMaxPauseUs_) {
+      break;
+    }
+  }
+  return gcPhase_ == GcPhase::Idle;
+}
+
+bool AssocTreeBase::gcInProgress() const {
+  auto guard = makeReadGuard();
+  return gcPhase_ != GcPhase::Idle;
+}
+
+void AssocTreeBase::setGcMaxPause(uint32_t micros) {
+  auto guard = makeLockGuard();
+  gcMaxPauseUs_ = micros;
+}
+
+void AssocTreeBase::setInterning(InternMode mode) {
+  auto guard = makeLockGuard();
+  internMode_ = mode;
+}
+
+bool AssocTreeBase::writeJson(Sink& sink) const {
+  auto guard = makeReadGuard();
   if (!buffer_) {
-    out.clear();
     return false;
   }
   const Node* root = nodeAt(rootIndex());
   if (!root || !root->used) {
-    out.clear();
     return false;
   }
+  ChunkedSink chunks(sink);
+  return writeJsonNode(chunks, rootIndex()) && chunks.flush();
+}
+
+bool AssocTreeBase::toJson(std::string& out) const {
   out.clear();
-  return writeJsonNode(out, rootIndex());
+  StringSink sink(out);
+  if (!writeJson(sink)) {
+    out.clear();
+    return false;
+  }
+  return true;
 }
 
 #ifdef ARDUINO
 bool AssocTreeBase::toJson(String& out) const {
-  std::string buffer;
-  if (!toJson(buffer)) {
+  out = String();
+  ArduinoStringSink sink(out);
+  if (!writeJson(sink)) {
     out = String();
     return false;
   }
-  out = buffer.c_str();
   return true;
 }
 #endif
 
-NodeRef AssocTreeBase::makeRootRef() {
-  return NodeRef(this, rootIndex(), rootIndex());
+bool AssocTreeBase::fromJson(const char* json, size_t length) {
+  JsonReader reader(*this);
+  return reader.feed(json, length) && reader.finish();
 }
 
-AssocTreeBase::Node* AssocTreeBase::nodeAt(uint16_t index) {
-  if (!buffer_ || index == detail::kInvalidIndex) {
-    return nullptr;
-  }
-  size_t offset = static_cast<size_t>(index) * kNodeSize;
-  if (offset + kNodeSize > nodeTop_) {
-    return nullptr;
+bool AssocTreeBase::applyPatch(const char* json, size_t length) {
+  JsonReader reader(*this, JsonMode::MergePatch);
+  return reader.feed(json, length) && reader.finish();
+}
+
+bool diff(const AssocTreeBase& from, const AssocTreeBase& to, Sink& sink) {
+  // Locked in address order, so two threads diffing the same pair both ways
+  // cannot deadlock.
+  const AssocTreeBase* first = &from < &to ? &from : &to;
+  const AssocTreeBase* second = first == &from ? &to : &from;
+  auto guard = first->makeReadGuard();
+  auto otherGuard = second != first ? second->makeReadGuard() : detail::LockGuard(nullptr);
+  if (!from.buffer_ || !to.buffer_) {
+    return false;
   }
-  return reinterpret_cast<Node*>(buffer_ + offset);
+  ChunkedSink chunks(sink);
+  return to.writeDiff(chunks, from) && chunks.flush();
 }
 
-const AssocTreeBase::Node* AssocTreeBase::nodeAt(uint16_t index) const {
-  if (!buffer_ || index == detail::kInvalidIndex) {
-    return nullptr;
+bool AssocTreeBase::writeMsgPack(Sink& sink) const {
+  auto guard = makeReadGuard();
+  if (!buffer_) {
+    return false;
   }
-  size_t offset = static_cast<size_t>(index) * kNodeSize;
-  if (offset + kNodeSize > nodeTop_) {
-    return nullptr;
+  const Node* root = nodeAt(rootIndex());
+  if (!root || !root->used) {
+    return false;
   }
-  return reinterpret_cast<const Node*>(buffer_ + offset);
+  ChunkedSink chunks(sink);
+  return writeMsgPackNode(chunks, rootIndex()) && chunks.flush();
 }
 
-const char* AssocTreeBase::stringAt(const StringSlot& slot) const {
-  if (!buffer_ || !slot.valid()) {
-    return "";
+bool AssocTreeBase::toMsgPack(std::string& out) const {
+  out.clear();
+  StringSink sink(out);
+  if (!writeMsgPack(sink)) {
+    out.clear();
+    return false;
   }
-  size_t offset = slot.offset;
-  size_t len = slot.length;
-  if (offset + len + 1 > totalBytes_) {
-    return "";
+  return true;
+}
+
+bool AssocTreeBase::fromMsgPack(const uint8_t* data, size_t length) {
+  MsgPackReader reader(*this);
+  return reader.feed(data, length) && reader.finish();
+}
+
+size_t AssocTreeBase::imageBytes() const {
+  auto guard = makeReadGuard();
+  if (!buffer_) {
+    return 0;
   }
-  return reinterpret_cast<const char*>(buffer_ + offset);
+  return sizeof(ImageHeader) + nodeTop_ + (totalBytes_ - strTop_);
 }
 
-void AssocTreeBase::setNodeNull(Node& node) {
-  node.type = NodeType::Null;
-  node.value.asInt = 0;
+bool AssocTreeBase::writeImage(Sink& sink) const {
+  auto guard = makeReadGuard();
+  // A collection in progress leaves gaps in the string region.
+  if (!buffer_ || gcPhase_ != GcPhase::Idle) {
+    return false;
+  }
+  ImageHeader header{};
+  header.magic = kImageMagic;
+  header.version = kImageVersion;
+  header.nodeBytes = static_cast<uint8_t>(kNodeSize);
+  header.doubleBytes = static_cast<uint8_t>(sizeof(detail::StoredDouble));
+  header.nodeCount = nodeCount_;
+  header.stringBytes = static_cast<uint16_t>(totalBytes_ - strTop_);
+  header.freeNode = freeNode_;
+  header.freeNodeCount = freeNodeCount_;
+  header.internRefBytes = static_cast<uint32_t>(internRefBytes_);
+  header.internBlockBytes = static_cast<uint32_t>(internBlockBytes_);
+  // The checksum goes first, so the body is produced twice.
+  HashSink hasher;
+  hasher.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  writeImageBody(hasher);
+  header.checksum = hasher.hash;
+  ChunkedSink chunks(sink);
+  return chunks.write(reinterpret_cast<const char*>(&header), sizeof(header)) &&
+         writeImageBody(chunks) && chunks.flush();
 }
 
-void AssocTreeBase::setNodeBool(Node& node, bool value) {
-  node.type = NodeType::Bool;
-  node.value.asBool = value;
+bool AssocTreeBase::loadImage(const uint8_t* image, size_t length) {
+  auto guard = makeLockGuard();
+  return adoptImage(image, length);
 }
 
-void AssocTreeBase::setNodeInt(Node& node, int32_t value) {
-  node.type = NodeType::Int;
-  node.value.asInt = value;
+bool AssocTreeBase::writeImageBody(Sink& out) const {
+  const uint16_t gap = static_cast<uint16_t>(strTop_ - nodeTop_);
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    Node node = *nodeAt(i);
+    if (node.used) {
+      uint16_t* refs[3];
+      for (size_t r = 0, n = blockRefs(node, refs); r < n; ++r) {
+        *refs[r] = static_cast<uint16_t>(*refs[r] - gap);
+      }
+    }
+    if (!out.write(reinterpret_cast<const char*>(&node), kNodeSize)) {
+      return false;
+    }
+  }
+  // Free-list links inside released blocks are left stale; loading rebuilds
+  // the lists from the block trailers.
+  return out.write(reinterpret_cast<const char*>(buffer_ + strTop_), totalBytes_ - strTop_);
 }
 
-void AssocTreeBase::setNodeDouble(Node& node, double value) {
-  node.type = NodeType::Double;
-  node.value.asDouble = value;
+AssocTreeView AssocTreeBase::snapshot(uint8_t* buffer, size_t bytes) const {
+  const size_t length = readConsistent([&] { return copySnapshot(buffer, bytes); });
+  // A copy that passed the sequence check is a consistent tree.
+  return AssocTreeView(length ? buffer : nullptr, length, false);
 }
 
-void AssocTreeBase::setNodeString(Node& node, const char* data, size_t len) {
-  if (!data) {
-    setNodeNull(node);
-    return;
+size_t AssocTreeBase::copySnapshot(uint8_t* buffer, size_t bytes) const {
+  // Each field is read once, so an optimistic copy sizes itself from the
+  // values it checked.
+  const uint16_t nodeCount = nodeCount_;
+  const size_t strTop = strTop_;
+  const size_t totalBytes = totalBytes_;
+  const size_t nodeBytes = static_cast<size_t>(nodeCount) * kNodeSize;
+  if (!buffer_ || !buffer || reinterpret_cast<uintptr_t>(buffer) % alignof(Node) != 0 ||
+      nodeCount == 0 || nodeBytes > strTop || strTop > totalBytes) {
+    return 0;
   }
-  StringSlot slot = storeString(data, len);
-  if (!slot.valid()) {
-    return;
+  const size_t stringBytes = totalBytes - strTop;
+  const size_t length = sizeof(ImageHeader) + nodeBytes + stringBytes;
+  if (length > bytes) {
+    return 0;
   }
-  node.type = NodeType::String;
-  node.value.asString = slot;
+  ImageHeader header{};
+  header.magic = kImageMagic;
+  header.version = kImageVersion;
+  header.nodeBytes = static_cast<uint8_t>(kNodeSize);
+  header.doubleBytes = static_cast<uint8_t>(sizeof(detail::StoredDouble));
+  header.nodeCount = nodeCount;
+  header.stringBytes = static_cast<uint16_t>(stringBytes);
+  header.freeNode = freeNode_;
+  header.freeNodeCount = freeNodeCount_;
+  header.internRefBytes = static_cast<uint32_t>(internRefBytes_);
+  header.internBlockBytes = static_cast<uint32_t>(internBlockBytes_);
+  std::memcpy(buffer, &header, sizeof(header));
+  uint8_t* nodes = buffer + sizeof(header);
+  std::memcpy(nodes, buffer_, nodeBytes);
+  std::memcpy(nodes + nodeBytes, buffer_ + strTop, stringBytes);
+  // Lowered as in writeImageBody(), but on the copy.
+  const uint16_t gap = static_cast<uint16_t>(strTop - nodeBytes);
+  for (uint16_t i = 0; i < nodeCount; ++i) {
+    Node* node = reinterpret_cast<Node*>(nodes + static_cast<size_t>(i) * kNodeSize);
+    if (node->used) {
+      uint16_t* refs[3];
+      for (size_t r = 0, n = blockRefs(*node, refs); r < n; ++r) {
+        *refs[r] = static_cast<uint16_t>(*refs[r] - gap);
+      }
+    }
+  }
+  return length;
 }
 
-uint16_t AssocTreeBase::ensurePath(uint16_t baseIndex, detail::LazyPathRef path) {
-  if (!path.segments || path.count == 0) {
-    return baseIndex;
+size_t AssocTreeBase::watch(const NodeRef& ref) {
+  auto guard = makeLockGuard();
+  if (ref.tree_ != this || txnDepth_ != 0) {
+    return kNoWatch;
   }
-  uint16_t current = baseIndex;
-  for (size_t i = 0; i < path.count; ++i) {
-    const auto& segment = path.segments[i];
-    Node* parent = nodeAt(current);
-    if (!parent) {
-      return detail::kInvalidIndex;
+  const uint16_t index = ref.resolveExisting();
+  if (index == detail::kInvalidIndex) {
+    return kNoWatch;
+  }
+  for (size_t id = 0; id < ASSOCTREE_WATCH_SLOTS; ++id) {
+    Watch& watch = watches_[id];
+    if (!watch.used) {
+      watch.node = index;
+      watch.used = true;
+      watch.changed = changeSeq_;
+      ++watchCount_;
+      return id;
     }
-    if (segment.kind == detail::LazySegment::Kind::Key) {
-      if (parent->type == NodeType::Null) {
-        parent->type = NodeType::Object;
-      }
-      if (parent->type != NodeType::Object) {
-        return detail::kInvalidIndex;
-      }
-      const char* key = path.keyData(segment);
-      uint16_t child = findChildByKey(current, key, segment.keyLength);
-      if (child == detail::kInvalidIndex) {
-        child = appendChild(current);
-        if (child == detail::kInvalidIndex) {
-          return detail::kInvalidIndex;
-        }
-        Node* node = nodeAt(child);
-        if (!node) {
+  }
+  return kNoWatch;
+}
+
+void AssocTreeBase::unwatch(size_t id) {
+  auto guard = makeLockGuard();
+  if (id >= ASSOCTREE_WATCH_SLOTS || !watches_[id].used) {
+    return;
+  }
+  if (watches_[id].node != detail::kInvalidIndex) {
+    --watchCount_;
+  }
+  watches_[id] = Watch();
+}
+
+uint32_t AssocTreeBase::changeToken() const {
+  auto guard = makeReadGuard();
+  return changeSeq_;
+}
+
+bool AssocTreeBase::adoptImage(const uint8_t* image, size_t length) {
+  if (!buffer_ || readOnly_ || txnDepth_ != 0) {
+    failTransaction();
+    return false;
+  }
+  ImageHeader header;
+  if (!readImageHeader(image, length, header)) {
+    resetPool();
+    return false;
+  }
+  if (length - sizeof(header) > totalBytes_ && allocator_ &&
+      (image + length <= block_ || image >= buffer_ + totalBytes_)) {
+    // Emptied first, so growing has nothing to move.
+    resetPool();
+    reserve(length - sizeof(header));
+  }
+  if (length - sizeof(header) > totalBytes_) {
+    resetPool();
+    return false;
+  }
+
+  // The image may start at the pool itself, so move whichever region would
+  // otherwise be overwritten first.
+  const size_t nodeBytes = static_cast<size_t>(header.nodeCount) * kNodeSize;
+  const uint8_t* nodes = image + sizeof(header);
+  const uint8_t* strings = nodes + nodeBytes;
+  uint8_t* stringTarget = buffer_ + totalBytes_ - header.stringBytes;
+  if (stringTarget > strings) {
+    std::memmove(stringTarget, strings, header.stringBytes);
+    std::memmove(buffer_, nodes, nodeBytes);
+  } else {
+    std::memmove(buffer_, nodes, nodeBytes);
+    std::memmove(stringTarget, strings, header.stringBytes);
+  }
+
+  nodeTop_ = nodeBytes;
+  strTop_ = totalBytes_ - header.stringBytes;
+  nodeCount_ = header.nodeCount;
+  freeNode_ = header.freeNode;
+  freeNodeCount_ = header.freeNodeCount;
+  gcPhase_ = GcPhase::Idle;
+  invalidateRefs();
+  endWatchesOnLoad();
+  const uint16_t gap = static_cast<uint16_t>(strTop_ - nodeTop_);
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    Node* node = nodeAt(i);
+    if (node->used) {
+      uint16_t* refs[3];
+      for (size_t r = 0, n = blockRefs(*node, refs); r < n; ++r) {
+        *refs[r] = static_cast<uint16_t>(*refs[r] + gap);
+      }
+    }
+  }
+  if (!checkPool()) {
+    resetPool();
+    return false;
+  }
+  mergeFreeBlocks();
+  clearInterned();
+  internRefBytes_ = header.internRefBytes;
+  internBlockBytes_ = header.internBlockBytes;
+  return true;
+}
+
+bool AssocTreeBase::mapImage(const uint8_t* image, size_t length, bool verify) {
+  ImageHeader header;
+  if (!readImageHeader(image, length, header, verify) ||
+      reinterpret_cast<uintptr_t>(image) % alignof(Node) != 0) {
+    return false;
+  }
+  // The image body is a pool without a free gap, so it is used where it lies.
+  buffer_ = const_cast<uint8_t*>(image + sizeof(header));
+  totalBytes_ = length - sizeof(header);
+  nodeTop_ = static_cast<size_t>(header.nodeCount) * kNodeSize;
+  strTop_ = nodeTop_;
+  nodeCount_ = header.nodeCount;
+  freeNode_ = header.freeNode;
+  freeNodeCount_ = header.freeNodeCount;
+  internRefBytes_ = header.internRefBytes;
+  internBlockBytes_ = header.internBlockBytes;
+  readOnly_ = true;
+  if (verify && !checkPool()) {
+    buffer_ = nullptr;
+    totalBytes_ = 0;
+    nodeTop_ = 0;
+    strTop_ = 0;
+    nodeCount_ = 0;
+    return false;
+  }
+  return true;
+}
+
+void AssocTreeBase::resetPool() {
+  if (!buffer_ || readOnly_ || txnDepth_ != 0) {
+    return;
+  }
+  nodeTop_ = 0;
+  strTop_ = totalBytes_;
+  nodeCount_ = 0;
+  freeNode_ = detail::kInvalidIndex;
+  freeNodeCount_ = 0;
+  clearFreeBlocks();
+  clearInterned();
+  internRefBytes_ = 0;
+  internBlockBytes_ = 0;
+  gcPhase_ = GcPhase::Idle;
+  invalidateRefs();
+  endWatchesOnLoad();
+  createNode();  // root
+  Node* root = nodeAt(rootIndex());
+  if (root) {
+    makeContainer(*root, NodeType::Object);
+    root->used = 1;
+  }
+}
+
+NodeRef AssocTreeBase::makeRootRef() {
+  return readConsistent([&] { return NodeRef(this, rootIndex(), rootIndex()); });
+}
+
+AssocTreeBase::Node* AssocTreeBase::nodeAt(uint16_t index) {
+  if (!buffer_ || index == detail::kInvalidIndex) {
+    return nullptr;
+  }
+  size_t offset = static_cast<size_t>(index) * kNodeSize;
+  if (offset + kNodeSize > nodeTop_) {
+    return nullptr;
+  }
+  // Writes go through this overload, so an open transaction journals older
+  // nodes here; reads must use the const one. Once the transaction has
+  // failed, a half-done write may have left links inconsistent, so no
+  // further write is let through.
+  if (txnDepth_ != 0 &&
+      (txnFailed_ || (index < txnNodeCount_ && !journalNode(index)))) {
+    return nullptr;
+  }
+  return reinterpret_cast<Node*>(buffer_ + offset);
+}
+
+const AssocTreeBase::Node* AssocTreeBase::nodeAt(uint16_t index) const {
+  if (!buffer_ || index == detail::kInvalidIndex) {
+    return nullptr;
+  }
+  size_t offset = static_cast<size_t>(index) * kNodeSize;
+  if (offset + kNodeSize > nodeTop_) {
+    return nullptr;
+  }
+  return reinterpret_cast<const Node*>(buffer_ + offset);
+}
+
+const char* AssocTreeBase::stringAt(const StringSlot& slot) const {
+  if (!buffer_ || !slot.valid()) {
+    return "";
+  }
+  size_t offset = slot.offset;
+  size_t len = slot.length;
+  if (offset + len + 1 > totalBytes_) {
+    return "";
+  }
+  return reinterpret_cast<const char*>(buffer_ + offset);
+}
+
+const char* AssocTreeBase::keyData(const Node& node) const {
+  if (node.keyInline) {
+    return node.inlineKey();
+  }
+  return node.key.valid() ? stringAt(node.key) : nullptr;
+}
+
+size_t AssocTreeBase::keyLength(const Node& node) const {
+  if (node.keyInline) {
+    return node.inlineKeyLength;
+  }
+  return node.key.valid() ? node.key.length : 0;
+}
+
+bool AssocTreeBase::keyEquals(const Node& node, const char* key, size_t len) const {
+  // Inline keys compare without touching the string region.
+  if (node.keyInline) {
+    return node.inlineKeyLength == len && std::memcmp(node.inlineKey(), key, len) == 0;
+  }
+  // One copy of the slot, so an optimistic reader checks the bounds of the
+  // same offset and length it compares.
+  const StringSlot slot = node.key;
+  return slot.valid() && slot.length == len && slot.offset + len + 1 <= totalBytes_ &&
+         std::memcmp(buffer_ + slot.offset, key, len) == 0;
+}
+
+uint32_t AssocTreeBase::keyHash(const Node& node) const {
+  const char* data = keyData(node);
+  return data ? hashKey(data, keyLength(node)) : 0;
+}
+
+const char* AssocTreeBase::stringData(const Node& node) const {
+  if (node.type != NodeType::String) {
+    return nullptr;
+  }
+  if (node.valueInline) {
+    return node.inlineString();
+  }
+  return node.value.asString.valid() ? stringAt(node.value.asString) : nullptr;
+}
+
+size_t AssocTreeBase::stringLength(const Node& node) const {
+  if (node.type != NodeType::String) {
+    return 0;
+  }
+  if (node.valueInline) {
+    // Bounded, in case an optimistic reader sees a half-written value.
+    const char* data = node.inlineString();
+    return std::find(data, data + Node::kInlineStringChars, '\0') - data;
+  }
+  return node.value.asString.valid() ? node.value.asString.length : 0;
+}
+
+void AssocTreeBase::setNodeNull(Node& node) {
+  noteChange(indexOf(node));
+  releaseValue(node);
+  node.type = NodeType::Null;
+  node.value.asInt = 0;
+}
+
+void AssocTreeBase::setNodeBool(Node& node, bool value) {
+  noteChange(indexOf(node));
+  releaseValue(node);
+  node.type = NodeType::Bool;
+  node.value.asBool = value;
+}
+
+void AssocTreeBase::setNodeInt(Node& node, int32_t value) {
+  noteChange(indexOf(node));
+  releaseValue(node);
+  node.type = NodeType::Int;
+  node.value.asInt = value;
+}
+
+void AssocTreeBase::setNodeDouble(Node& node, double value) {
+  noteChange(indexOf(node));
+  releaseValue(node);
+  node.type = NodeType::Double;
+  node.value.asDouble = static_cast<detail::StoredDouble>(value);
+}
+
+void AssocTreeBase::setNodeString(Node& node, const char* data, size_t len) {
+  noteChange(indexOf(node));
+  if (!data) {
+    setNodeNull(node);
+    return;
+  }
+  if (len <= Node::kInlineStringChars && !std::memchr(data, '\0', len)) {
+    // Copied first: `data` may point into the block about to be released.
+    char chars[Node::kInlineStringChars + 1] = {};
+    std::memcpy(chars, data, len);
+    releaseValue(node);
+    node.type = NodeType::String;
+    node.valueInline = 1;
+    std::memcpy(node.inlineString(), chars, sizeof(chars));
+    return;
+  }
+  const bool share = internMode_ == InternMode::KeysAndValues;
+  StringSlot& current = node.value.asString;
+  if (!share && node.type == NodeType::String && !node.valueInline && current.valid() &&
+      !node.internedValue && (txnDepth_ == 0 || current.offset < txnStrTop_) &&
+      len < std::numeric_limits<uint16_t>::max() &&
+      stringBlockBytes(len) <= stringBlockBytes(current.length)) {
+    // Overwrite in place and hand the unused tail of the block back.
+    const size_t oldBytes = stringBlockBytes(current.length);
+    const size_t newBytes = stringBlockBytes(len);
+    std::memmove(buffer_ + current.offset, data, len);
+    buffer_[current.offset + len] = '\0';
+    if ((len & 1) == 0) {
+      buffer_[current.offset + len + 1] = '\0';
+    }
+    if (newBytes < oldBytes) {
+      *reinterpret_cast<uint16_t*>(buffer_ + current.offset + newBytes - kTrailerBytes) =
+          static_cast<uint16_t>(newBytes | kRawTrailer);
+      releaseBlock(static_cast<uint16_t>(current.offset + newBytes), oldBytes - newBytes);
+    }
+    current.length = static_cast<uint16_t>(len);
+    ++inPlaceStrings_;
+    return;
+  }
+  bool interned = false;
+  StringSlot slot = share ? storeShared(data, len, interned) : storeString(data, len);
+  if (!slot.valid()) {
+    failTransaction();
+    return;
+  }
+  releaseValue(node);
+  node.type = NodeType::String;
+  node.value.asString = slot;
+  node.internedValue = interned;
+}
+
+uint16_t AssocTreeBase::ensurePath(uint16_t baseIndex, detail::LazyPathRef path) {
+  if (!path.segments || path.count == 0) {
+    return baseIndex;
+  }
+  uint16_t current = baseIndex;
+  for (size_t i = 0; i < path.count; ++i) {
+    const auto& segment = path.segments[i];
+    if (segment.kind == detail::LazySegment::Kind::Key) {
+      reserveChildren(current, 1, stringBlockBytes(segment.keyLength));
+    } else if (allocator_) {
+      const size_t count = countChildren(current);
+      reserveChildren(current, segment.index < count ? 0 : segment.index + 1 - count);
+    }
+    Node* parent = nodeAt(current);
+    if (!parent) {
+      return detail::kInvalidIndex;
+    }
+    if (segment.kind == detail::LazySegment::Kind::Key) {
+      if (parent->type == NodeType::Null) {
+        makeContainer(*parent, NodeType::Object);
+      }
+      if (parent->type != NodeType::Object) {
+        return detail::kInvalidIndex;
+      }
+      const char* key = path.keyData(segment);
+      uint16_t child = findChildByKey(current, key, segment.keyLength);
+      if (child == detail::kInvalidIndex) {
+        child = appendChild(current);
+        if (child == detail::kInvalidIndex) {
+          return detail::kInvalidIndex;
+        }
+        Node* node = nodeAt(child);
+        if (!node) {
           return detail::kInvalidIndex;
         }
         node->type = NodeType::Null;
-        node->key = storeString(key, segment.keyLength);
-        if (!node->key.valid()) {
+        if (!storeKey(*node, key, segment.keyLength)) {
           detachNode(child);
           return detail::kInvalidIndex;
         }
+        indexInsert(current, child);
       }
       current = child;
       continue;
     }
 
     if (parent->type == NodeType::Null) {
-      parent->type = NodeType::Array;
+      makeContainer(*parent, NodeType::Array);
     }
     if (parent->type != NodeType::Array) {
       return detail::kInvalidIndex;
@@ -867,7 +2364,11 @@ uint16_t AssocTreeBase::findExisting(uint16_t baseIndex, detail::LazyPathRef pat
 }
 
 detail::LockGuard AssocTreeBase::makeLockGuard() const {
-  return detail::LockGuard(&lock_);
+  return detail::LockGuard(readOnly_ ? nullptr : &lock_);
+}
+
+detail::LockGuard AssocTreeBase::makeReadGuard() const {
+  return detail::LockGuard(readOnly_ ? nullptr : &lock_, true);
 }
 
 void AssocTreeBase::detachNode(uint16_t nodeIndex) {
@@ -875,26 +2376,46 @@ void AssocTreeBase::detachNode(uint16_t nodeIndex) {
   if (!node || node->parent == detail::kInvalidIndex) {
     return;
   }
-  Node* parent = nodeAt(node->parent);
+  const uint16_t parentIndex = node->parent;
+  Node* parent = nodeAt(parentIndex);
   if (!parent) {
     return;
   }
-  uint16_t* link = &parent->firstChild;
-  while (*link != detail::kInvalidIndex) {
-    if (*link == nodeIndex) {
-      *link = node->nextSibling;
-      break;
+  endWatches(nodeIndex, true);
+  noteChange(parentIndex);
+  uint16_t prev = indexErase(parentIndex, nodeIndex);
+  if (prev == detail::kInvalidIndex && parent->firstChild != nodeIndex) {
+    uint16_t cursor = parent->firstChild;
+    while (cursor != detail::kInvalidIndex) {
+      const Node* current = std::as_const(*this).nodeAt(cursor);
+      if (!current) {
+        break;
+      }
+      if (current->nextSibling == nodeIndex) {
+        prev = cursor;
+        break;
+      }
+      cursor = current->nextSibling;
     }
-    Node* current = nodeAt(*link);
-    if (!current) {
-      break;
+  }
+  if (prev != detail::kInvalidIndex) {
+    Node* before = nodeAt(prev);
+    if (before) {
+      before->nextSibling = node->nextSibling;
     }
-    link = &current->nextSibling;
+  } else if (parent->firstChild == nodeIndex) {
+    parent->firstChild = node->nextSibling;
+  }
+  if (parent->value.asContainer.count > 0) {
+    --parent->value.asContainer.count;
   }
-  node->parent = detail::kInvalidIndex;
+  detail::IndexHeader* header = indexHeader(*parent);
+  if (header && parent->type == NodeType::Object && header->tail == nodeIndex) {
+    header->tail = prev;
+  }
+  gcRestartMark();
   node->nextSibling = detail::kInvalidIndex;
-  node->used = 0;
-  node->type = NodeType::Null;
+  freeNodes(nodeIndex);
 }
 
 uint16_t AssocTreeBase::appendChild(uint16_t parentIndex) {
@@ -902,6 +2423,7 @@ uint16_t AssocTreeBase::appendChild(uint16_t parentIndex) {
   if (!parent) {
     return detail::kInvalidIndex;
   }
+  noteChange(parentIndex);
   uint16_t childIndex = createNode();
   if (childIndex == detail::kInvalidIndex) {
     return detail::kInvalidIndex;
@@ -913,377 +2435,2926 @@ uint16_t AssocTreeBase::appendChild(uint16_t parentIndex) {
   child->parent = parentIndex;
   child->nextSibling = detail::kInvalidIndex;
   child->firstChild = detail::kInvalidIndex;
-  if (parent->firstChild == detail::kInvalidIndex) {
-    parent->firstChild = childIndex;
+  uint16_t tail = lastChild(*parent);
+  Node* prev = nodeAt(tail);
+  if (!prev && tail != detail::kInvalidIndex) {
+    return detail::kInvalidIndex;
+  }
+  if (prev) {
+    prev->nextSibling = childIndex;
   } else {
-    uint16_t cursor = parent->firstChild;
-    Node* prev = nodeAt(cursor);
-    while (prev && prev->nextSibling != detail::kInvalidIndex) {
-      cursor = prev->nextSibling;
-      prev = nodeAt(cursor);
-    }
-    if (prev) {
-      prev->nextSibling = childIndex;
-    }
+    parent->firstChild = childIndex;
   }
+  ++parent->value.asContainer.count;
   child->used = 1;
+  if (parent->type == NodeType::Array) {
+    indexAppend(parentIndex, childIndex);
+  } else if (detail::IndexHeader* header = indexHeader(*parent)) {
+    header->tail = childIndex;
+  }
   return childIndex;
 }
 
 uint16_t AssocTreeBase::createNode() {
-  if (!buffer_) {
-    return detail::kInvalidIndex;
-  }
-  if (nodeCount_ == detail::kInvalidIndex) {
+  if (!buffer_ || txnFailed_) {
     return detail::kInvalidIndex;
   }
-  size_t newTop = nodeTop_ + kNodeSize;
-  if (newTop > strTop_) {
-    return detail::kInvalidIndex;
+  uint16_t index = freeNode_;
+  Node* node = nullptr;
+  uint8_t generation = 0;
+  if (index != detail::kInvalidIndex) {
+    node = nodeAt(index);
+    if (!node) {
+      return detail::kInvalidIndex;
+    }
+    freeNode_ = node->nextSibling;
+    --freeNodeCount_;
+    ++reusedNodes_;
+    generation = node->generation;
+  } else {
+    if (nodeCount_ == detail::kInvalidIndex) {
+      return detail::kInvalidIndex;
+    }
+    size_t newTop = nodeTop_ + kNodeSize;
+    if (newTop > strTop_ && freeBlockBytes_ != 0 && gcPhase_ != GcPhase::Strings &&
+        txnDepth_ == 0) {
+      // Free blocks next to strTop_ may give the middle back.
+      mergeFreeBlocks();
+    }
+    if (newTop > strTop_) {
+      return detail::kInvalidIndex;
+    }
+    index = nodeCount_;
+    node = reinterpret_cast<Node*>(buffer_ + nodeTop_);
+    nodeTop_ = newTop;
+    ++nodeCount_;
   }
-  uint16_t index = nodeCount_;
-  Node* node = reinterpret_cast<Node*>(buffer_ + nodeTop_);
   *node = Node();
+  node->generation = generation;
   node->used = 1;
-  nodeTop_ = newTop;
-  ++nodeCount_;
+  // Allocate black once a gcStep() cycle is marking so it keeps the new node.
+  // While marks are still being cleared the mark pass will reach it anyway,
+  // and a black node would stop that pass from descending to its children.
+  node->mark = gcPhase_ != GcPhase::Idle && gcPhase_ != GcPhase::ClearMarks;
   return index;
 }
 
+void AssocTreeBase::freeNodes(uint16_t first) {
+  // `first`, its following siblings and all their descendants go onto the
+  // free list. Each child chain is spliced into the pending list, so the
+  // walk needs no stack.
+  uint16_t pending = first;
+  while (pending != detail::kInvalidIndex) {
+    Node* node = nodeAt(pending);
+    if (!node) {
+      break;
+    }
+    uint16_t next = node->nextSibling;
+    if ((node->type == NodeType::Object || node->type == NodeType::Array) &&
+        node->firstChild != detail::kInvalidIndex) {
+      Node* last = nodeAt(node->firstChild);
+      while (last && last->nextSibling != detail::kInvalidIndex) {
+        last = nodeAt(last->nextSibling);
+      }
+      if (last) {
+        last->nextSibling = next;
+        next = node->firstChild;
+      }
+    }
+    if (!node->keyInline) {
+      releaseString(node->key, node->internedKey);
+    }
+    if (node->type == NodeType::String) {
+      releaseValue(*node);
+    } else if (const detail::IndexHeader* header = indexHeader(*node)) {
+      releaseBlock(node->value.asContainer.table, tableBlockBytes(header->capacity));
+    }
+    const uint8_t generation = (node->generation + 1) % Node::kGenerations;
+    *node = Node();
+    node->generation = generation;
+    // Incremental node compaction treats unused slots as holes, so they must
+    // not be linked while it runs.
+    if (gcPhase_ != GcPhase::Nodes) {
+      node->nextSibling = freeNode_;
+      freeNode_ = pending;
+      ++freeNodeCount_;
+    }
+    pending = next;
+  }
+}
+
+uint16_t AssocTreeBase::allocateBlock(size_t dataBytes) {
+  size_t bytes = blockBytes(dataBytes);
+  if (!buffer_ || txnFailed_ || bytes > kBlockSizeMask) {
+    return 0;
+  }
+  if (uint16_t reused = takeFreeBlock(bytes)) {
+    return reused;
+  }
+  // Merging rewrites older free blocks, which an open transaction must be
+  // able to restore.
+  if (gcPhase_ != GcPhase::Strings && freeBlockBytes_ >= bytes && txnDepth_ == 0 &&
+      (strTop_ < nodeTop_ || strTop_ - nodeTop_ < bytes)) {
+    mergeFreeBlocks();
+    if (uint16_t reused = takeFreeBlock(bytes)) {
+      return reused;
+    }
+  }
+  if (gcPhase_ == GcPhase::Strings && gcWrite_ - gcRead_ >= bytes) {
+    // Fill the gap left by string sliding from its top so the compacted
+    // part stays contiguous.
+    gcWrite_ -= bytes;
+    *reinterpret_cast<uint16_t*>(buffer_ + gcWrite_ + bytes - kTrailerBytes) =
+        static_cast<uint16_t>(bytes | kRawTrailer);
+    gcMarkGap();
+    return static_cast<uint16_t>(gcWrite_);
+  }
+  return takeGap(bytes);
+}
+
+uint16_t AssocTreeBase::takeGap(size_t bytes) {
+  if (strTop_ < nodeTop_ || strTop_ - nodeTop_ < bytes) {
+    return 0;
+  }
+  strTop_ -= bytes;
+  uint16_t* trailer = reinterpret_cast<uint16_t*>(buffer_ + strTop_ + bytes - kTrailerBytes);
+  *trailer = static_cast<uint16_t>(bytes | kRawTrailer);
+  return static_cast<uint16_t>(strTop_);
+}
+
 AssocTreeBase::StringSlot AssocTreeBase::storeString(const char* data, size_t len) {
   StringSlot slot;
-  if (!buffer_) {
+  if (!buffer_ || len >= std::numeric_limits<uint16_t>::max()) {
     slot.invalidate();
     return slot;
   }
-  if (len > std::numeric_limits<uint16_t>::max()) {
+  uint16_t offset = allocateBlock(len + 1);
+  if (offset == 0) {
     slot.invalidate();
     return slot;
   }
-  size_t bytes = len + 1;
-  if (bytes > freeBytes()) {
-    slot.invalidate();
-    return slot;
+  std::memmove(buffer_ + offset, data, len);
+  buffer_[offset + len] = '\0';
+  if ((len & 1) == 0) {
+    buffer_[offset + len + 1] = '\0';
   }
-  strTop_ -= bytes;
-  std::memmove(buffer_ + strTop_, data, len);
-  buffer_[strTop_ + len] = '\0';
-  slot.offset = static_cast<uint16_t>(strTop_);
+  slot.offset = offset;
   slot.length = static_cast<uint16_t>(len);
   return slot;
 }
 
-uint16_t AssocTreeBase::findChildByKey(
-    uint16_t parentIndex,
-    const char* key,
-    size_t len) const {
-  const Node* parent = nodeAt(parentIndex);
-  if (!parent || !parent->used || parent->type != NodeType::Object) {
-    return detail::kInvalidIndex;
+bool AssocTreeBase::storeKey(Node& node, const char* key, size_t len) {
+  if (len <= Node::kInlineKeyChars) {
+    std::memset(node.inlineKey(), 0, sizeof(node.key));
+    std::memcpy(node.inlineKey(), key, len);
+    node.keyInline = 1;
+    node.inlineKeyLength = static_cast<uint8_t>(len);
+    return true;
   }
-  uint16_t child = parent->firstChild;
-  while (child != detail::kInvalidIndex) {
-    const Node* node = nodeAt(child);
-    if (!node) {
-      break;
-    }
-    if (node->used && node->key.valid() &&
-        node->key.length == len) {
-      const char* stored = stringAt(node->key);
-      if (stored && std::memcmp(stored, key, len) == 0) {
-        return child;
-      }
-    }
-    child = node->nextSibling;
+  bool interned = false;
+  node.key = internMode_ != InternMode::Off ? storeShared(key, len, interned)
+                                            : storeString(key, len);
+  node.internedKey = interned;
+  return node.key.valid();
+}
+
+AssocTreeBase::StringSlot AssocTreeBase::storeShared(
+    const char* data,
+    size_t len,
+    bool& interned) {
+  interned = false;
+  // gcStep() moves blocks while sliding strings, so nothing is shared then.
+  if (gcPhase_ == GcPhase::Strings) {
+    return storeString(data, len);
   }
-  return detail::kInvalidIndex;
+  StringSlot& entry = internSlots_[hashKey(data, len) & (ASSOCTREE_INTERN_SLOTS - 1)];
+  const size_t bytes = stringBlockBytes(len);
+  if (entry.valid() && entry.length == len &&
+      std::memcmp(buffer_ + entry.offset, data, len) == 0) {
+    ++internHits_;
+    internRefBytes_ += bytes;
+    interned = true;
+    return entry;
+  }
+  StringSlot slot = storeString(data, len);
+  if (slot.valid()) {
+    entry = slot;
+    internRefBytes_ += bytes;
+    internBlockBytes_ += bytes;
+    interned = true;
+  }
+  return slot;
 }
 
-uint16_t AssocTreeBase::findChildByIndex(
-    uint16_t parentIndex,
-    size_t targetIndex) const {
-  const Node* parent = nodeAt(parentIndex);
-  if (!parent || !parent->used || parent->type != NodeType::Array) {
-    return detail::kInvalidIndex;
+void AssocTreeBase::releaseString(const StringSlot& slot, bool interned) {
+  if (!slot.valid()) {
+    return;
   }
-  uint16_t child = parent->firstChild;
-  size_t index = 0;
-  while (child != detail::kInvalidIndex) {
-    const Node* node = nodeAt(child);
-    if (!node) {
-      break;
-    }
-    if (node->used) {
-      if (index == targetIndex) {
-        return child;
-      }
-      ++index;
+  const size_t bytes = stringBlockBytes(slot.length);
+  if (interned) {
+    // Other nodes may still use the block; compaction drops it once unused.
+    internRefBytes_ -= std::min(internRefBytes_, bytes);
+    return;
+  }
+  releaseBlock(slot.offset, bytes);
+}
+
+void AssocTreeBase::clearInterned() {
+  for (size_t i = 0; i < ASSOCTREE_INTERN_SLOTS; ++i) {
+    internSlots_[i].invalidate();
+  }
+}
+
+void AssocTreeBase::makeContainer(Node& node, NodeType type) {
+  noteChange(indexOf(node));
+  releaseValue(node);
+  node.type = type;
+  node.value.asContainer.table = 0;
+  node.value.asContainer.count = 0;
+}
+
+void AssocTreeBase::releaseChildren(Node& node) {
+  if (node.type != NodeType::Object && node.type != NodeType::Array) {
+    return;
+  }
+  if (node.firstChild != detail::kInvalidIndex) {
+    gcRestartMark();
+    const uint16_t index = indexOf(node);
+    endWatches(index, false);
+    noteChange(index);
+  }
+  uint16_t first = node.firstChild;
+  node.firstChild = detail::kInvalidIndex;
+  freeNodes(first);
+  if (const detail::IndexHeader* header = indexHeader(node)) {
+    releaseBlock(node.value.asContainer.table, tableBlockBytes(header->capacity));
+  }
+  node.value.asContainer.table = 0;
+  node.value.asContainer.count = 0;
+}
+
+void AssocTreeBase::releaseValue(Node& node) {
+  if (node.type == NodeType::String) {
+    if (!node.valueInline) {
+      releaseString(node.value.asString, node.internedValue);
     }
-    child = node->nextSibling;
+    node.value.asString.invalidate();
+    node.internedValue = 0;
+    node.valueInline = 0;
+    return;
   }
-  return detail::kInvalidIndex;
+  releaseChildren(node);
 }
 
-size_t AssocTreeBase::countChildren(uint16_t parentIndex) const {
-  const Node* parent = nodeAt(parentIndex);
-  if (!parent || !parent->used || parent->firstChild == detail::kInvalidIndex) {
-    return 0;
+void AssocTreeBase::releaseBlock(uint16_t offset, size_t bytes) {
+  if (!buffer_ || bytes < kTrailerBytes || offset < strTop_ || offset + bytes > totalBytes_) {
+    return;
   }
-  size_t count = 0;
-  uint16_t child = parent->firstChild;
-  while (child != detail::kInvalidIndex) {
-    const Node* node = nodeAt(child);
-    if (!node) {
+  uint16_t* trailer = reinterpret_cast<uint16_t*>(buffer_ + offset + bytes - kTrailerBytes);
+  if (txnDepth_ != 0 && offset >= txnStrTop_) {
+    // A split-off tail still carries the whole free block's trailer. As a
+    // plain dead block it is reclaimed by the next gc() if the record
+    // cannot be kept.
+    *trailer = static_cast<uint16_t>(bytes | kRawTrailer);
+    journalBlock(kReleaseRecord, offset, bytes);
+    return;
+  }
+  if (gcPhase_ == GcPhase::Strings) {
+    // gcStep() is sliding blocks: leave a plain dead block for it to drop.
+    *trailer = static_cast<uint16_t>(bytes | kRawTrailer);
+    return;
+  }
+  if (offset == strTop_) {
+    strTop_ += bytes;
+    return;
+  }
+  *trailer = static_cast<uint16_t>(bytes | kRawTrailer | kFreeTrailer);
+  freeBlockBytes_ += bytes;
+  // A 2-byte block cannot carry a link; it only waits to be merged.
+  if (bytes < kMinFreeBlock) {
+    return;
+  }
+  const size_t cls = blockClass(bytes);
+  uint16_t* words = reinterpret_cast<uint16_t*>(buffer_ + offset);
+  words[0] = freeBlocks_[cls];
+  words[1] = *trailer;
+  freeBlocks_[cls] = offset;
+}
+
+void AssocTreeBase::mergeFreeBlocks() {
+  // Walk the string region top-down through the trailers, join runs of
+  // adjacent free blocks and rebuild the lists. A run that reaches strTop_
+  // goes back to the free middle of the pool.
+  clearFreeBlocks();
+  size_t read = totalBytes_;
+  size_t runTop = 0;
+  while (read > strTop_) {
+    const uint16_t trailer = *reinterpret_cast<const uint16_t*>(buffer_ + read - kTrailerBytes);
+    const size_t size = trailer & kBlockSizeMask;
+    if (!(trailer & kRawTrailer) || size < kTrailerBytes || size > read - strTop_) {
       break;
     }
-    if (node->used) {
-      ++count;
+    const bool free = (trailer & kFreeTrailer) != 0;
+    if (runTop != 0 && (!free || runTop - (read - size) > kBlockSizeMask)) {
+      releaseBlock(static_cast<uint16_t>(read), runTop - read);
+      runTop = 0;
+    }
+    if (free && runTop == 0) {
+      runTop = read;
+    }
+    read -= size;
+  }
+  if (runTop != 0) {
+    if (read == strTop_) {
+      strTop_ = runTop;
+    } else {
+      releaseBlock(static_cast<uint16_t>(read), runTop - read);
     }
-    child = node->nextSibling;
   }
-  return count;
 }
 
-bool AssocTreeBase::writeJsonNode(std::string& out, uint16_t nodeIndex) const {
-  const Node* node = nodeAt(nodeIndex);
-  if (!node) {
-    return false;
-  }
-  switch (node->type) {
-    case NodeType::Null:
-      out += "null";
-      return true;
-    case NodeType::Bool:
-      out += node->value.asBool ? "true" : "false";
-      return true;
-    case NodeType::Int:
-      out += std::to_string(node->value.asInt);
-      return true;
-    case NodeType::Double: {
-      char buffer[32];
-      int len = std::snprintf(buffer, sizeof(buffer), "%.6g", node->value.asDouble);
-      if (len <= 0) {
-        return false;
-      }
-      out.append(buffer, static_cast<size_t>(len));
-      return true;
-    }
-    case NodeType::String:
-      if (node->value.asString.valid()) {
-        appendEscapedString(
-            out,
-            stringAt(node->value.asString),
-            node->value.asString.length);
-      } else {
-        out += "\"\"";
-      }
-      return true;
-    case NodeType::Object: {
-      out.push_back('{');
-      bool first = true;
-      uint16_t child = node->firstChild;
-      while (child != detail::kInvalidIndex) {
-        const Node* entry = nodeAt(child);
-        if (!entry) {
-          break;
-        }
-        if (entry->used && entry->key.valid()) {
-          if (!first) {
-            out.push_back(',');
-          }
-          first = false;
-          appendEscapedString(
-              out, stringAt(entry->key), entry->key.length);
-          out.push_back(':');
-          if (!writeJsonNode(out, child)) {
-            return false;
-          }
+uint16_t AssocTreeBase::takeFreeBlock(size_t bytes) {
+  for (size_t cls = blockClass(bytes); cls < detail::kBlockClasses; ++cls) {
+    uint16_t prev = 0;
+    uint16_t offset = freeBlocks_[cls];
+    for (size_t scanned = 0; offset != 0 && scanned < kFreeBlockScan; ++scanned) {
+      uint16_t* words = reinterpret_cast<uint16_t*>(buffer_ + offset);
+      const size_t size = words[1] & kBlockSizeMask;
+      if (size >= bytes) {
+        if (txnDepth_ != 0 && offset >= txnStrTop_ &&
+            !journalBlock(kTakenRecord, offset, size)) {
+          return 0;
         }
-        child = entry->nextSibling;
-      }
-      out.push_back('}');
-      return true;
-    }
-    case NodeType::Array: {
-      out.push_back('[');
-      bool first = true;
-      uint16_t child = node->firstChild;
-      while (child != detail::kInvalidIndex) {
-        const Node* entry = nodeAt(child);
-        if (!entry) {
-          break;
+        if (prev != 0) {
+          reinterpret_cast<uint16_t*>(buffer_ + prev)[0] = words[0];
+        } else {
+          freeBlocks_[cls] = words[0];
         }
-        if (entry->used) {
-          if (!first) {
-            out.push_back(',');
-          }
-          first = false;
-          if (!writeJsonNode(out, child)) {
-            return false;
-          }
+        freeBlockBytes_ -= size;
+        ++reusedBlocks_;
+        *reinterpret_cast<uint16_t*>(buffer_ + offset + bytes - kTrailerBytes) =
+            static_cast<uint16_t>(bytes | kRawTrailer);
+        if (size > bytes) {
+          releaseBlock(static_cast<uint16_t>(offset + bytes), size - bytes);
         }
-        child = entry->nextSibling;
+        return offset;
       }
-      out.push_back(']');
-      return true;
+      prev = offset;
+      offset = words[0];
     }
-    default:
-      return false;
   }
+  return 0;
 }
 
-void AssocTreeBase::appendEscapedString(
-    std::string& out,
-    const char* data,
-    size_t len) const {
-  out.push_back('\"');
-  for (size_t i = 0; i < len; ++i) {
-    unsigned char c = static_cast<unsigned char>(data[i]);
-    switch (c) {
-      case '\"':
-        out += "\\\"";
-        break;
-      case '\\':
-        out += "\\\\";
-        break;
-      case '\b':
-        out += "\\b";
-        break;
-      case '\f':
-        out += "\\f";
-        break;
-      case '\n':
-        out += "\\n";
-        break;
-      case '\r':
-        out += "\\r";
-        break;
-      case '\t':
-        out += "\\t";
-        break;
-      default:
-        if (c < 0x20) {
-          char buf[7];
-          std::snprintf(buf, sizeof(buf), "\\u%04x", c);
-          out.append(buf);
-        } else {
-          out.push_back(static_cast<char>(c));
-        }
-        break;
-    }
+void AssocTreeBase::clearFreeBlocks() {
+  for (size_t cls = 0; cls < detail::kBlockClasses; ++cls) {
+    freeBlocks_[cls] = 0;
   }
-  out.push_back('\"');
+  freeBlockBytes_ = 0;
 }
 
-void AssocTreeBase::markReachable(uint16_t index) {
-  uint16_t current = index;
-  bool backtracking = false;
-  while (current != detail::kInvalidIndex) {
-    Node* node = nodeAt(current);
-    if (!node || !node->used) {
+uint16_t AssocTreeBase::allocateTable(size_t capacity) {
+  if (!buffer_ || capacity == 0 || capacity >= detail::kInvalidIndex) {
+    return 0;
+  }
+  uint16_t offset = allocateBlock(sizeof(detail::IndexHeader) + capacity * sizeof(uint16_t));
+  if (offset == 0) {
+    return 0;
+  }
+  auto* header = reinterpret_cast<detail::IndexHeader*>(buffer_ + offset);
+  header->capacity = static_cast<uint16_t>(capacity);
+  header->tail = detail::kInvalidIndex;
+  uint16_t* entries = indexEntries(header);
+  for (size_t i = 0; i < capacity; ++i) {
+    entries[i] = detail::kInvalidIndex;
+  }
+  return offset;
+}
+
+const detail::IndexHeader* AssocTreeBase::indexHeader(const Node& node) const {
+  if ((node.type != NodeType::Object && node.type != NodeType::Array) ||
+      node.value.asContainer.table == 0) {
+    return nullptr;
+  }
+  size_t offset = node.value.asContainer.table;
+  if (offset < strTop_ || offset + sizeof(detail::IndexHeader) > totalBytes_) {
+    return nullptr;
+  }
+  auto* header = reinterpret_cast<const detail::IndexHeader*>(buffer_ + offset);
+  if (!tableFits(header, header->capacity)) {
+    return nullptr;
+  }
+  return header;
+}
+
+bool AssocTreeBase::tableFits(const detail::IndexHeader* header, size_t capacity) const {
+  const size_t offset = reinterpret_cast<const uint8_t*>(header) - buffer_;
+  return offset + sizeof(detail::IndexHeader) + capacity * sizeof(uint16_t) <= totalBytes_;
+}
+
+detail::IndexHeader* AssocTreeBase::indexHeader(const Node& node) {
+  return const_cast<detail::IndexHeader*>(
+      static_cast<const AssocTreeBase*>(this)->indexHeader(node));
+}
+
+const uint16_t* AssocTreeBase::indexEntries(const detail::IndexHeader* header) {
+  return reinterpret_cast<const uint16_t*>(header + 1);
+}
+
+uint16_t* AssocTreeBase::indexEntries(detail::IndexHeader* header) {
+  return reinterpret_cast<uint16_t*>(header + 1);
+}
+
+bool AssocTreeBase::buildIndex(uint16_t parentIndex, size_t capacity) {
+  Node* parent = nodeAt(parentIndex);
+  if (!parent || (parent->type != NodeType::Object && parent->type != NodeType::Array)) {
+    return false;
+  }
+  if (const detail::IndexHeader* previous = indexHeader(*parent)) {
+    // Released first so a grown table can reuse the space after the old one.
+    releaseBlock(parent->value.asContainer.table, tableBlockBytes(previous->capacity));
+  }
+  parent->value.asContainer.table = allocateTable(capacity);
+  detail::IndexHeader* header = indexHeader(*parent);
+  if (!header || !fillIndex(*parent, header)) {
+    parent->value.asContainer.table = 0;
+    return false;
+  }
+  return true;
+}
+
+bool AssocTreeBase::fillIndex(const Node& parent, detail::IndexHeader* header) const {
+  // Expects every entry to be kInvalidIndex.
+  uint16_t* entries = indexEntries(header);
+  const bool isArray = parent.type == NodeType::Array;
+  const uint16_t mask = static_cast<uint16_t>(header->capacity - 1);
+  uint16_t position = 0;
+  uint16_t child = parent.firstChild;
+  header->tail = detail::kInvalidIndex;
+  while (child != detail::kInvalidIndex) {
+    const Node* entry = nodeAt(child);
+    if (!entry) {
       break;
     }
-    if (!backtracking && !node->mark) {
-      node->mark = 1;
-      if (node->firstChild != detail::kInvalidIndex) {
-        current = node->firstChild;
-        continue;
+    if (isArray) {
+      if (position >= header->capacity) {
+        return false;
       }
+      entries[position++] = child;
+    } else if (entry->hasKey()) {
+      uint16_t slot = static_cast<uint16_t>(keyHash(*entry) & mask);
+      while (entries[slot] != detail::kInvalidIndex) {
+        slot = static_cast<uint16_t>((slot + 1) & mask);
+      }
+      entries[slot] = child;
     }
-    backtracking = false;
-    if (node->nextSibling != detail::kInvalidIndex) {
-      current = node->nextSibling;
-    } else {
-      current = node->parent;
-      backtracking = true;
-    }
+    header->tail = child;
+    child = entry->nextSibling;
   }
+  return true;
 }
 
-void AssocTreeBase::updateReferences(uint16_t limit, uint16_t from, uint16_t to) {
-  if (from == to) {
+void AssocTreeBase::indexInsert(uint16_t parentIndex, uint16_t childIndex) {
+  if (ASSOCTREE_INDEX_THRESHOLD == 0) {
     return;
   }
-  for (uint16_t i = 0; i < limit; ++i) {
-    Node* node = nodeAt(i);
-    if (!node || !node->used) {
-      continue;
-    }
-    if (node->parent == from) {
-      node->parent = to;
-    }
-    if (node->firstChild == from) {
-      node->firstChild = to;
-    }
-    if (node->nextSibling == from) {
-      node->nextSibling = to;
+  Node* parent = nodeAt(parentIndex);
+  const Node* child = nodeAt(childIndex);
+  if (!parent || !child || parent->type != NodeType::Object || !child->hasKey()) {
+    return;
+  }
+  const size_t count = parent->value.asContainer.count;
+  detail::IndexHeader* header = indexHeader(*parent);
+  if (!header) {
+    if (count > ASSOCTREE_INDEX_THRESHOLD) {
+      buildIndex(parentIndex, indexCapacityFor(count));
     }
+    return;
+  }
+  if (count * 2 > header->capacity) {
+    buildIndex(parentIndex, static_cast<size_t>(header->capacity) * 2);
+    return;
+  }
+  uint16_t* entries = indexEntries(header);
+  const uint16_t mask = static_cast<uint16_t>(header->capacity - 1);
+  uint16_t slot = static_cast<uint16_t>(keyHash(*child) & mask);
+  while (entries[slot] != detail::kInvalidIndex) {
+    slot = static_cast<uint16_t>((slot + 1) & mask);
   }
+  entries[slot] = childIndex;
 }
 
-void AssocTreeBase::compactNodes() {
-  if (!buffer_) {
+void AssocTreeBase::indexAppend(uint16_t parentIndex, uint16_t childIndex) {
+  if (ASSOCTREE_INDEX_THRESHOLD == 0) {
     return;
   }
-  const uint16_t originalCount = nodeCount_;
-  uint16_t write = 0;
-  for (uint16_t read = 0; read < originalCount; ++read) {
-    Node* node = nodeAt(read);
-    if (!node) {
-      continue;
-    }
-    if (!node->used || !node->mark) {
-      node->used = 0;
-      node->mark = 0;
-      continue;
+  Node* parent = nodeAt(parentIndex);
+  if (!parent || parent->type != NodeType::Array) {
+    return;
+  }
+  const size_t count = parent->value.asContainer.count;
+  detail::IndexHeader* header = indexHeader(*parent);
+  if (!header) {
+    if (count > ASSOCTREE_INDEX_THRESHOLD) {
+      buildIndex(parentIndex, arrayCapacityFor(count));
     }
-    if (write != read) {
-      Node* target = nodeAt(write);
-      if (target) {
-        *target = *node;
+    return;
+  }
+  if (count > header->capacity) {
+    buildIndex(parentIndex, static_cast<size_t>(header->capacity) * 2);
+    return;
+  }
+  indexEntries(header)[count - 1] = childIndex;
+}
+
+uint16_t AssocTreeBase::indexErase(uint16_t parentIndex, uint16_t childIndex) {
+  Node* parent = nodeAt(parentIndex);
+  const Node* child = nodeAt(childIndex);
+  if (!parent || !child) {
+    return detail::kInvalidIndex;
+  }
+  detail::IndexHeader* header = indexHeader(*parent);
+  if (!header) {
+    return detail::kInvalidIndex;
+  }
+  uint16_t* entries = indexEntries(header);
+  if (parent->type == NodeType::Array) {
+    // Scan from the back so that popping the last element stays cheap.
+    uint16_t count = parent->value.asContainer.count;
+    for (uint16_t i = count; i > 0; --i) {
+      if (entries[i - 1] == childIndex) {
+        std::memmove(&entries[i - 1], &entries[i], (count - i) * sizeof(uint16_t));
+        entries[count - 1] = detail::kInvalidIndex;
+        return i > 1 ? entries[i - 2] : detail::kInvalidIndex;
       }
-      updateReferences(originalCount, read, write);
     }
-    Node* target = nodeAt(write);
-    if (target) {
-      target->mark = 0;
+    return detail::kInvalidIndex;
+  }
+  if (!child->hasKey()) {
+    return detail::kInvalidIndex;
+  }
+  const uint16_t capacity = header->capacity;
+  const uint16_t mask = static_cast<uint16_t>(capacity - 1);
+  uint16_t hole = static_cast<uint16_t>(keyHash(*child) & mask);
+  uint16_t probes = 0;
+  while (entries[hole] != childIndex) {
+    if (entries[hole] == detail::kInvalidIndex || ++probes >= capacity) {
+      return detail::kInvalidIndex;
+    }
+    hole = static_cast<uint16_t>((hole + 1) & mask);
+  }
+  // Backward-shift deletion keeps probe chains intact without tombstones.
+  uint16_t next = hole;
+  while (true) {
+    next = static_cast<uint16_t>((next + 1) & mask);
+    uint16_t moved = entries[next];
+    if (moved == detail::kInvalidIndex) {
+      break;
+    }
+    const Node* entry = std::as_const(*this).nodeAt(moved);
+    uint16_t home = entry ? static_cast<uint16_t>(keyHash(*entry) & mask) : next;
+    bool between = (hole <= next) ? (hole < home && home <= next)
+                                  : (hole < home || home <= next);
+    if (!between) {
+      entries[hole] = moved;
+      hole = next;
     }
-    ++write;
   }
-  nodeCount_ = write;
-  nodeTop_ = static_cast<size_t>(nodeCount_) * kNodeSize;
+  entries[hole] = detail::kInvalidIndex;
+  // Objects do not know the previous sibling from the hash table.
+  return detail::kInvalidIndex;
 }
 
-void AssocTreeBase::compactStrings() {
-  if (!buffer_) {
-    return;
+uint16_t AssocTreeBase::findChildByKey(
+    uint16_t parentIndex,
+    const char* key,
+    size_t len) const {
+  const Node* parent = nodeAt(parentIndex);
+  if (!parent || !parent->used || parent->type != NodeType::Object) {
+    return detail::kInvalidIndex;
   }
-  strTop_ = totalBytes_;
-  for (uint16_t i = 0; i < nodeCount_; ++i) {
-    Node* node = nodeAt(i);
-    if (!node) {
-      continue;
+  if (const detail::IndexHeader* header = indexHeader(*parent)) {
+    const uint16_t* table = indexEntries(header);
+    // Checked again: an optimistic reader may race a table being rebuilt.
+    const uint16_t capacity = header->capacity;
+    if (!tableFits(header, capacity)) {
+      return detail::kInvalidIndex;
     }
-    if (node->key.valid()) {
-      const char* data = stringAt(node->key);
-      if (data) {
-        node->key = storeString(data, node->key.length);
-      } else {
-        node->key.invalidate();
+    const uint16_t mask = static_cast<uint16_t>(capacity - 1);
+    uint16_t slot = static_cast<uint16_t>(hashKey(key, len) & mask);
+    for (uint16_t probes = 0; probes < capacity; ++probes) {
+      uint16_t candidate = table[slot];
+      if (candidate == detail::kInvalidIndex) {
+        break;
       }
-    }
-    if (node->type == NodeType::String && node->value.asString.valid()) {
-      const char* data = stringAt(node->value.asString);
-      if (data) {
-        node->value.asString = storeString(data, node->value.asString.length);
-      } else {
-        node->value.asString.invalidate();
+      const Node* node = nodeAt(candidate);
+      if (node && keyEquals(*node, key, len)) {
+        return candidate;
       }
+      slot = static_cast<uint16_t>((slot + 1) & mask);
     }
+    return detail::kInvalidIndex;
   }
-  if (strTop_ < nodeTop_) {
-    strTop_ = nodeTop_;
-  }
+  // The step limit stops an optimistic reader on a torn sibling chain.
+  uint16_t child = parent->firstChild;
+  for (size_t steps = 0; child != detail::kInvalidIndex && steps < nodeCount_; ++steps) {
+    const Node* node = nodeAt(child);
+    if (!node) {
+      break;
+    }
+    if (node->used && keyEquals(*node, key, len)) {
+      return child;
+    }
+    child = node->nextSibling;
+  }
+  return detail::kInvalidIndex;
+}
+
+uint16_t AssocTreeBase::findChildByIndex(
+    uint16_t parentIndex,
+    size_t targetIndex) const {
+  const Node* parent = nodeAt(parentIndex);
+  if (!parent || !parent->used || parent->type != NodeType::Array) {
+    return detail::kInvalidIndex;
+  }
+  if (targetIndex >= parent->value.asContainer.count) {
+    return detail::kInvalidIndex;
+  }
+  if (const detail::IndexHeader* header = indexHeader(*parent)) {
+    return tableFits(header, targetIndex + 1) ? indexEntries(header)[targetIndex]
+                                              : detail::kInvalidIndex;
+  }
+  uint16_t child = parent->firstChild;
+  size_t index = 0;
+  for (size_t steps = 0; child != detail::kInvalidIndex && steps < nodeCount_; ++steps) {
+    const Node* node = nodeAt(child);
+    if (!node) {
+      break;
+    }
+    if (node->used) {
+      if (index == targetIndex) {
+        return child;
+      }
+      ++index;
+    }
+    child = node->nextSibling;
+  }
+  return detail::kInvalidIndex;
+}
+
+size_t AssocTreeBase::countChildren(uint16_t parentIndex) const {
+  const Node* parent = nodeAt(parentIndex);
+  if (!parent || !parent->used ||
+      (parent->type != NodeType::Object && parent->type != NodeType::Array)) {
+    return 0;
+  }
+  return parent->value.asContainer.count;
+}
+
+uint16_t AssocTreeBase::lastChild(const Node& parent) const {
+  if (const detail::IndexHeader* header = indexHeader(parent)) {
+    if (parent.type == NodeType::Object) {
+      return header->tail;
+    }
+    uint16_t count = parent.value.asContainer.count;
+    return count > 0 ? indexEntries(header)[count - 1] : detail::kInvalidIndex;
+  }
+  uint16_t cursor = parent.firstChild;
+  const Node* node = nodeAt(cursor);
+  while (node && node->nextSibling != detail::kInvalidIndex) {
+    cursor = node->nextSibling;
+    node = nodeAt(cursor);
+  }
+  return node ? cursor : detail::kInvalidIndex;
+}
+
+uint16_t AssocTreeBase::listedChild(const Node& parent, uint16_t cursor) const {
+  // The first child from `cursor` on that output lists.
+  while (cursor != detail::kInvalidIndex) {
+    const Node* entry = nodeAt(cursor);
+    if (!entry) {
+      return detail::kInvalidIndex;
+    }
+    if (entry->used && (parent.type == NodeType::Array || entry->hasKey())) {
+      return cursor;
+    }
+    cursor = entry->nextSibling;
+  }
+  return detail::kInvalidIndex;
+}
+
+bool AssocTreeBase::writeJsonNode(Sink& out, uint16_t nodeIndex) const {
+  // Walks down through firstChild and back up through the parent links, so
+  // deep trees need no recursion or explicit stack.
+  auto listed = [this](const Node& parent, uint16_t cursor) { return listedChild(parent, cursor); };
+  auto writeKey = [this, &out](const Node& parent, const Node& entry) {
+    return parent.type == NodeType::Array ||
+           (writeEscapedString(out, keyData(entry), keyLength(entry)) && out.write(":", 1));
+  };
+
+  uint16_t current = nodeIndex;
+  for (;;) {
+    const Node* node = nodeAt(current);
+    if (!node) {
+      return false;
+    }
+    if (node->type == NodeType::Object || node->type == NodeType::Array) {
+      const bool isArray = node->type == NodeType::Array;
+      if (!out.write(isArray ? "[" : "{", 1)) {
+        return false;
+      }
+      const uint16_t child = listed(*node, node->firstChild);
+      if (child != detail::kInvalidIndex) {
+        if (!writeKey(*node, *nodeAt(child))) {
+          return false;
+        }
+        current = child;
+        continue;
+      }
+      if (!out.write(isArray ? "]" : "}", 1)) {
+        return false;
+      }
+    } else if (!writeJsonScalar(out, *node)) {
+      return false;
+    }
+
+    // Move to the next sibling, closing every container left on the way up.
+    for (;;) {
+      if (current == nodeIndex) {
+        return true;
+      }
+      const Node* done = nodeAt(current);
+      const Node* parent = done ? nodeAt(done->parent) : nullptr;
+      if (!parent) {
+        return false;
+      }
+      const uint16_t next = listed(*parent, done->nextSibling);
+      if (next != detail::kInvalidIndex) {
+        if (!out.write(",", 1) || !writeKey(*parent, *nodeAt(next))) {
+          return false;
+        }
+        current = next;
+        break;
+      }
+      if (!out.write(parent->type == NodeType::Array ? "]" : "}", 1)) {
+        return false;
+      }
+      current = done->parent;
+    }
+  }
+}
+
+bool AssocTreeBase::writeDiff(Sink& out, const AssocTreeBase& from) const {
+  const Node* root = nodeAt(rootIndex());
+  const Node* old = from.nodeAt(from.rootIndex());
+  if (!root || !root->used) {
+    return false;
+  }
+  if (!old || !old->used || root->type != NodeType::Object || old->type != NodeType::Object) {
+    return writeJsonNode(out, rootIndex());
+  }
+  // Walks this tree like writeJsonNode(), descending only into objects whose
+  // key exists as an object in `from` too; `match` is the node there. Levels
+  // 1..opened have had their key and brace written: a level is opened by its
+  // first change, so unchanged objects write nothing.
+  uint16_t node = rootIndex();
+  uint16_t match = from.rootIndex();
+  size_t depth = 0;
+  size_t opened = 0;
+  bool comma = false;
+  auto member = [&](const char* key, size_t len) {
+    for (size_t level = opened + 1; level <= depth; ++level) {
+      const Node* open = nodeAt(node);
+      for (size_t up = level; up < depth && open; ++up) {
+        open = nodeAt(open->parent);
+      }
+      if (!open || (comma && !out.write(",", 1)) ||
+          !writeEscapedString(out, keyData(*open), keyLength(*open)) || !out.write(":{", 2)) {
+        return false;
+      }
+      comma = false;
+      opened = level;
+    }
+    if ((comma && !out.write(",", 1)) || !writeEscapedString(out, key, len) ||
+        !out.write(":", 1)) {
+      return false;
+    }
+    comma = true;
+    return true;
+  };
+
+  if (!out.write("{", 1)) {
+    return false;
+  }
+  uint16_t child = listedChild(*root, root->firstChild);
+  for (;;) {
+    // Keys of this level: new or changed values, then objects on both sides.
+    while (child != detail::kInvalidIndex) {
+      const Node* entry = nodeAt(child);
+      const uint16_t other = from.findChildByKey(match, keyData(*entry), keyLength(*entry));
+      const Node* previous = from.nodeAt(other);
+      if (previous && entry->type == NodeType::Object && previous->type == NodeType::Object) {
+        node = child;
+        match = other;
+        ++depth;
+        child = listedChild(*entry, entry->firstChild);
+        continue;
+      }
+      if (!previous || !sameValue(child, from, other)) {
+        if (!member(keyData(*entry), keyLength(*entry)) || !writeJsonNode(out, child)) {
+          return false;
+        }
+      }
+      child = listedChild(*nodeAt(node), entry->nextSibling);
+    }
+    // Keys only `from` has.
+    const Node* oldParent = from.nodeAt(match);
+    if (!oldParent) {
+      return false;
+    }
+    for (uint16_t gone = from.listedChild(*oldParent, oldParent->firstChild);
+         gone != detail::kInvalidIndex;) {
+      const Node* entry = from.nodeAt(gone);
+      const char* key = from.keyData(*entry);
+      const size_t len = from.keyLength(*entry);
+      if (findChildByKey(node, key, len) == detail::kInvalidIndex &&
+          (!member(key, len) || !out.write("null", 4))) {
+        return false;
+      }
+      gone = from.listedChild(*oldParent, entry->nextSibling);
+    }
+    if (depth == 0) {
+      return out.write("}", 1);
+    }
+    if (opened == depth) {
+      if (!out.write("}", 1)) {
+        return false;
+      }
+      opened = depth - 1;
+      comma = true;
+    }
+    --depth;
+    const Node* done = nodeAt(node);
+    const Node* parent = done ? nodeAt(done->parent) : nullptr;
+    if (!parent) {
+      return false;
+    }
+    child = listedChild(*parent, done->nextSibling);
+    node = done->parent;
+    match = oldParent->parent;
+  }
+}
+
+bool AssocTreeBase::sameValue(uint16_t index, const AssocTreeBase& other,
+                              uint16_t otherIndex) const {
+  // Walks both subtrees in step, the way writeJsonNode() walks one. Object
+  // members must come in the same order; a reordered object only makes
+  // diff() write it whole.
+  auto sameScalar = [&](const Node& a, const Node& b) {
+    if (a.type != b.type) {
+      return false;
+    }
+    switch (a.type) {
+      case NodeType::Bool:
+        return a.value.asBool == b.value.asBool;
+      case NodeType::Int:
+        return a.value.asInt == b.value.asInt;
+      case NodeType::Double:
+        return a.value.asDouble == b.value.asDouble;
+      case NodeType::String: {
+        const size_t len = stringLength(a);
+        const char* data = stringData(a);
+        const char* otherData = other.stringData(b);
+        return len == other.stringLength(b) &&
+               (len == 0 || (data && otherData && std::memcmp(data, otherData, len) == 0));
+      }
+      default:
+        return true;
+    }
+  };
+  auto sameKey = [&](const Node& parent, const Node& a, const Node& b) {
+    return parent.type == NodeType::Array ||
+           (keyLength(a) == other.keyLength(b) &&
+            std::memcmp(keyData(a), other.keyData(b), keyLength(a)) == 0);
+  };
+
+  uint16_t current = index;
+  uint16_t mirror = otherIndex;
+  for (;;) {
+    const Node* a = nodeAt(current);
+    const Node* b = other.nodeAt(mirror);
+    if (!a || !b || !sameScalar(*a, *b)) {
+      return false;
+    }
+    if (a->type == NodeType::Object || a->type == NodeType::Array) {
+      const uint16_t first = listedChild(*a, a->firstChild);
+      const uint16_t otherFirst = other.listedChild(*b, b->firstChild);
+      if ((first == detail::kInvalidIndex) != (otherFirst == detail::kInvalidIndex)) {
+        return false;
+      }
+      if (first != detail::kInvalidIndex) {
+        if (!sameKey(*a, *nodeAt(first), *other.nodeAt(otherFirst))) {
+          return false;
+        }
+        current = first;
+        mirror = otherFirst;
+        continue;
+      }
+    }
+    for (;;) {
+      if (current == index) {
+        return true;
+      }
+      const Node* done = nodeAt(current);
+      const Node* otherDone = other.nodeAt(mirror);
+      const Node* parent = done ? nodeAt(done->parent) : nullptr;
+      const Node* otherParent = otherDone ? other.nodeAt(otherDone->parent) : nullptr;
+      if (!parent || !otherParent) {
+        return false;
+      }
+      const uint16_t next = listedChild(*parent, done->nextSibling);
+      const uint16_t otherNext = other.listedChild(*otherParent, otherDone->nextSibling);
+      if ((next == detail::kInvalidIndex) != (otherNext == detail::kInvalidIndex)) {
+        return false;
+      }
+      if (next != detail::kInvalidIndex) {
+        if (!sameKey(*parent, *nodeAt(next), *other.nodeAt(otherNext))) {
+          return false;
+        }
+        current = next;
+        mirror = otherNext;
+        break;
+      }
+      current = done->parent;
+      mirror = otherDone->parent;
+    }
+  }
+}
+
+bool AssocTreeBase::writeJsonScalar(Sink& out, const Node& node) const {
+  char buffer[32];
+  switch (node.type) {
+    case NodeType::Null:
+      return out.write("null", 4);
+    case NodeType::Bool:
+      return node.value.asBool ? out.write("true", 4) : out.write("false", 5);
+    case NodeType::Int:
+      return out.write(buffer, formatInt(node.value.asInt, buffer));
+    case NodeType::Double:
+      return out.write(buffer, formatDouble(node.value.asDouble, buffer));
+    case NodeType::String:
+      if (const char* data = stringData(node)) {
+        return writeEscapedString(out, data, stringLength(node));
+      }
+      return out.write("\"\"", 2);
+    default:
+      return false;
+  }
+}
+
+bool AssocTreeBase::writeEscapedString(Sink& out, const char* data, size_t len) {
+  if (!out.write("\"", 1)) {
+    return false;
+  }
+  // Runs of characters that need no escaping are written in one call.
+  size_t plain = 0;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    const char* escaped = nullptr;
+    char buf[7];
+    switch (c) {
+      case '\"':
+        escaped = "\\\"";
+        break;
+      case '\\':
+        escaped = "\\\\";
+        break;
+      case '\b':
+        escaped = "\\b";
+        break;
+      case '\f':
+        escaped = "\\f";
+        break;
+      case '\n':
+        escaped = "\\n";
+        break;
+      case '\r':
+        escaped = "\\r";
+        break;
+      case '\t':
+        escaped = "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+          escaped = buf;
+        }
+        break;
+    }
+    if (!escaped) {
+      continue;
+    }
+    if (!out.write(data + plain, i - plain) || !out.write(escaped, std::strlen(escaped))) {
+      return false;
+    }
+    plain = i + 1;
+  }
+  return out.write(data + plain, len - plain) && out.write("\"", 1);
+}
+
+bool AssocTreeBase::writeMsgPackNode(Sink& out, uint16_t nodeIndex) const {
+  // Same walk as writeJsonNode(). Containers carry their child count up
+  // front, so nothing is written on the way back up.
+  char header[9];
+  uint16_t current = nodeIndex;
+  for (;;) {
+    const Node* node = nodeAt(current);
+    if (!node) {
+      return false;
+    }
+    if (current != nodeIndex) {
+      const Node* parent = nodeAt(node->parent);
+      if (parent && parent->type == NodeType::Object) {
+        const size_t len = keyLength(*node);
+        if (!out.write(header, msgPackLength(header, len, 0xa0, 32, kMsgPackStr8, 0xda)) ||
+            !out.write(keyData(*node), len)) {
+          return false;
+        }
+      }
+    }
+    if (node->type == NodeType::Object || node->type == NodeType::Array) {
+      const size_t count = node->value.asContainer.count;
+      const size_t n = node->type == NodeType::Array
+                           ? msgPackLength(header, count, 0x90, 16, 0, kMsgPackArray16)
+                           : msgPackLength(header, count, 0x80, 16, 0, kMsgPackMap16);
+      if (!out.write(header, n)) {
+        return false;
+      }
+      if (count > 0 && node->firstChild != detail::kInvalidIndex) {
+        current = node->firstChild;
+        continue;
+      }
+    } else if (!writeMsgPackScalar(out, *node)) {
+      return false;
+    }
+
+    for (;;) {
+      if (current == nodeIndex) {
+        return true;
+      }
+      const Node* done = nodeAt(current);
+      if (!done) {
+        return false;
+      }
+      if (done->nextSibling != detail::kInvalidIndex) {
+        current = done->nextSibling;
+        break;
+      }
+      current = done->parent;
+    }
+  }
+}
+
+bool AssocTreeBase::writeMsgPackScalar(Sink& out, const Node& node) const {
+  char buffer[9];
+  switch (node.type) {
+    case NodeType::Null:
+      buffer[0] = static_cast<char>(kMsgPackNil);
+      return out.write(buffer, 1);
+    case NodeType::Bool:
+      buffer[0] = static_cast<char>(node.value.asBool ? kMsgPackTrue : kMsgPackFalse);
+      return out.write(buffer, 1);
+    case NodeType::Int:
+      return out.write(buffer, msgPackInt(buffer, node.value.asInt));
+    case NodeType::Double:
+      return out.write(buffer, msgPackDouble(buffer, node.value.asDouble));
+    case NodeType::String: {
+      const char* data = stringData(node);
+      const size_t len = data ? stringLength(node) : 0;
+      return out.write(buffer, msgPackLength(buffer, len, 0xa0, 32, kMsgPackStr8, 0xda)) &&
+             out.write(data, len);
+    }
+    default:
+      return false;
+  }
+}
+
+bool AssocTreeBase::checkPool() const {
+  // Everything a reader or writer follows must stay inside the pool and every
+  // walk must end, so each child list is checked against its parent and
+  // count. Runs in O(nodes + index entries).
+  auto inStrings = [this](const StringSlot& slot) {
+    return slot.offset >= strTop_ &&
+           static_cast<size_t>(slot.offset) + slot.length + 1 <= totalBytes_;
+  };
+  const Node* root = nodeAt(rootIndex());
+  if (!root || !root->used || root->parent != detail::kInvalidIndex ||
+      (root->type != NodeType::Object && root->type != NodeType::Array)) {
+    return false;
+  }
+  size_t listed = 0;
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    const Node* node = nodeAt(i);
+    if (!node->used) {
+      continue;
+    }
+    if (node->type > NodeType::Array || (!node->keyInline && node->key.valid() &&
+                                         !inStrings(node->key))) {
+      return false;
+    }
+    if (node->type == NodeType::String && !node->valueInline &&
+        node->value.asString.valid() && !inStrings(node->value.asString)) {
+      return false;
+    }
+    if (node->type != NodeType::Object && node->type != NodeType::Array) {
+      continue;
+    }
+    const uint16_t count = node->value.asContainer.count;
+    uint16_t seen = 0;
+    uint16_t last = detail::kInvalidIndex;
+    for (uint16_t cursor = node->firstChild; cursor != detail::kInvalidIndex;) {
+      const Node* child = nodeAt(cursor);
+      if (!child || !child->used || child->parent != i || ++seen > count ||
+          ++listed >= nodeCount_) {
+        return false;
+      }
+      last = cursor;
+      cursor = child->nextSibling;
+    }
+    if (seen != count) {
+      return false;
+    }
+    if (node->value.asContainer.table == 0) {
+      continue;
+    }
+    const detail::IndexHeader* header = indexHeader(*node);
+    if (!header || header->capacity == 0 ||
+        (node->type == NodeType::Object
+             ? (header->capacity & (header->capacity - 1)) != 0 || header->tail != last
+             : header->capacity < count)) {
+      return false;
+    }
+    const uint16_t* entries = indexEntries(header);
+    for (uint16_t e = 0; e < header->capacity; ++e) {
+      const Node* child = nodeAt(entries[e]);
+      if (entries[e] != detail::kInvalidIndex && (!child || child->parent != i)) {
+        return false;
+      }
+    }
+  }
+  uint16_t cursor = freeNode_;
+  for (uint16_t n = 0; n < freeNodeCount_; ++n) {
+    const Node* node = nodeAt(cursor);
+    if (!node || node->used) {
+      return false;
+    }
+    cursor = node->nextSibling;
+  }
+  return cursor == detail::kInvalidIndex;
+}
+
+bool AssocTreeBase::markReachable(uint16_t& current, bool& backtracking, size_t budget) {
+  while (current != detail::kInvalidIndex) {
+    if (budget-- == 0) {
+      return true;
+    }
+    Node* node = nodeAt(current);
+    if (!node || !node->used) {
+      break;
+    }
+    if (!backtracking && !node->mark) {
+      node->mark = 1;
+      if (node->firstChild != detail::kInvalidIndex) {
+        current = node->firstChild;
+        continue;
+      }
+    }
+    backtracking = false;
+    if (node->nextSibling != detail::kInvalidIndex) {
+      current = node->nextSibling;
+    } else {
+      current = node->parent;
+      backtracking = true;
+    }
+  }
+  current = detail::kInvalidIndex;
+  return false;
+}
+
+void AssocTreeBase::compactNodes() {
+  if (!buffer_ || nodeCount_ == 0) {
+    return;
+  }
+  auto live = [this](uint16_t index) {
+    const Node* node = nodeAt(index);
+    return node && node->used && node->mark;
+  };
+  // Two-finger pass: move the highest live node into the lowest hole and
+  // leave its new index in the vacated slot's firstChild. The vacated slot
+  // keeps its mark, so recordRelocation() can tell it from a dead one.
+  uint16_t low = 0;
+  uint16_t high = nodeCount_;
+  while (true) {
+    while (low < high && live(low)) {
+      ++low;
+    }
+    while (high > low && !live(static_cast<uint16_t>(high - 1))) {
+      --high;
+    }
+    if (low >= high) {
+      break;
+    }
+    Node* from = nodeAt(static_cast<uint16_t>(high - 1));
+    Node* to = nodeAt(low);
+    // A generation no reference to the hole holds; references to the moved
+    // node translate theirs through the relocation map.
+    const uint8_t generation = (to->generation + 1) % Node::kGenerations;
+    *to = *from;
+    to->generation = generation;
+    moveWatch(static_cast<uint16_t>(high - 1), low);
+    from->used = 0;
+    from->firstChild = low;
+    ++low;
+    --high;
+  }
+  const uint16_t liveCount = low;
+  // Every live node now sits below liveCount, so any link at or above it
+  // points to a vacated slot holding the forwarding index.
+  auto forward = [this, liveCount](uint16_t& link) {
+    if (link != detail::kInvalidIndex && link >= liveCount) {
+      link = nodeAt(link)->firstChild;
+    }
+  };
+  for (uint16_t i = 0; i < liveCount; ++i) {
+    Node* node = nodeAt(i);
+    forward(node->parent);
+    forward(node->firstChild);
+    forward(node->nextSibling);
+    node->mark = 0;
+  }
+  nodeCount_ = liveCount;
+  nodeTop_ = static_cast<size_t>(nodeCount_) * kNodeSize;
+}
+
+AssocTreeBase::StringSlot* AssocTreeBase::blockSlot(Node& node, uint8_t field) {
+  if (field == 0) {
+    return !node.keyInline && node.key.valid() ? &node.key : nullptr;
+  }
+  if (node.type == NodeType::String && !node.valueInline && node.value.asString.valid()) {
+    return &node.value.asString;
+  }
+  return nullptr;
+}
+
+void AssocTreeBase::compactStrings() {
+  if (!buffer_) {
+    return;
+  }
+  // Thread every reference to a block through that block's trailer
+  // (Jonkers). The displaced trailer ends up in the last reference.
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    Node* node = nodeAt(i);
+    for (uint8_t field = 0; node && field < 2; ++field) {
+      StringSlot* slot = blockSlot(*node, field);
+      if (!slot) {
+        continue;
+      }
+      size_t end = static_cast<size_t>(slot->offset) + stringBlockBytes(slot->length);
+      if (slot->offset < strTop_ || end > totalBytes_) {
+        slot->invalidate();
+        continue;
+      }
+      uint16_t* trailer = reinterpret_cast<uint16_t*>(buffer_ + end - kTrailerBytes);
+      slot->offset = *trailer;
+      *trailer = threadLink(i, field);
+    }
+  }
+  // Walk blocks from the end of the pool: unreferenced blocks are dropped and
+  // referenced ones slide up, each reference is pointed at the new offset.
+  // Shared blocks are threaded like any other, so every reference ends up
+  // on the moved copy. The interning totals are recounted on the way.
+  internRefBytes_ = 0;
+  internBlockBytes_ = 0;
+  size_t read = totalBytes_;
+  size_t write = totalBytes_;
+  while (read > strTop_) {
+    uint16_t link = *reinterpret_cast<const uint16_t*>(buffer_ + read - kTrailerBytes);
+    if (link & kRawTrailer) {
+      size_t size = link & kBlockSizeMask;
+      if (size < kTrailerBytes || size > read - strTop_) {
+        break;
+      }
+      read -= size;
+      continue;
+    }
+    const StringSlot* first = blockSlot(*nodeAt(link >> 2), (link >> 1) & 1);
+    size_t size = stringBlockBytes(first->length);
+    size_t from = read - size;
+    size_t to = write - size;
+    bool shared = false;
+    while (!(link & kRawTrailer)) {
+      Node* owner = nodeAt(link >> 2);
+      const uint8_t field = (link >> 1) & 1;
+      StringSlot* slot = blockSlot(*owner, field);
+      if (field == 0 ? owner->internedKey : owner->internedValue) {
+        internRefBytes_ += size;
+        shared = true;
+      }
+      link = slot->offset;
+      slot->offset = static_cast<uint16_t>(to);
+    }
+    if (shared) {
+      internBlockBytes_ += size;
+    }
+    std::memmove(buffer_ + to, buffer_ + from, size - kTrailerBytes);
+    *reinterpret_cast<uint16_t*>(buffer_ + write - kTrailerBytes) = link;
+    read = from;
+    write = to;
+  }
+  strTop_ = write;
+}
+
+size_t AssocTreeBase::blockRefs(Node& node, uint16_t* refs[3]) {
+  size_t count = 0;
+  if (!node.keyInline && node.key.valid()) {
+    refs[count++] = &node.key.offset;
+  }
+  if (node.type == NodeType::String && !node.valueInline && node.value.asString.valid()) {
+    refs[count++] = &node.value.asString.offset;
+  } else if ((node.type == NodeType::Object || node.type == NodeType::Array) &&
+             node.value.asContainer.table != 0) {
+    refs[count++] = &node.value.asContainer.table;
+  }
+  return count;
+}
+
+void AssocTreeBase::gcRestartMark() {
+  // Unlinking can cut the path the mark cursor would climb back through.
+  if (gcPhase_ == GcPhase::Mark) {
+    gcPhase_ = GcPhase::ClearMarks;
+    gcCursor_ = 0;
+  }
+}
+
+uint16_t AssocTreeBase::rebind(uint16_t index, uint32_t revision, uint8_t* generation) const {
+  if (revision == revision_ || index == rootIndex()) {
+    return index;
+  }
+  if (index == detail::kInvalidIndex || revision < stableRevision_) {
+    return detail::kInvalidIndex;
+  }
+  if (index < stableNodes_) {
+    return index;
+  }
+  if (revision + 1 != revision_) {
+    return detail::kInvalidIndex;
+  }
+  // Bound just before the last gc().
+  if (index < relocBase_) {
+    return index;
+  }
+  const size_t entry = static_cast<size_t>(index - relocBase_);
+  // Optimistic reads may see these fields torn, so stay inside the pool.
+  const size_t generations = relocation_ + static_cast<size_t>(relocCount_) * sizeof(uint16_t);
+  if (relocation_ == 0 || entry >= relocCount_ || generations + entry + 1 > totalBytes_) {
+    return detail::kInvalidIndex;
+  }
+  uint16_t moved;
+  std::memcpy(&moved, buffer_ + relocation_ + entry * sizeof(uint16_t), sizeof(moved));
+  if (generation) {
+    // The moved node took a new generation; only a reference to it, not to
+    // an earlier node in its old slot, gets that one.
+    const Node* node = nodeAt(moved);
+    if (!node || buffer_[generations + entry] != *generation) {
+      return detail::kInvalidIndex;
+    }
+    *generation = node->generation;
+  }
+  return moved;
+}
+
+uint16_t AssocTreeBase::follow(uint16_t index, uint32_t revision, uint8_t generation) const {
+  index = rebind(index, revision, &generation);
+  const Node* node = nodeAt(index);
+  if (!node || !node->used || node->generation != generation) {
+    return detail::kInvalidIndex;
+  }
+  return index;
+}
+
+uint8_t AssocTreeBase::generationOf(uint16_t index) const {
+  const Node* node = nodeAt(index);
+  return node ? node->generation : 0;
+}
+
+void AssocTreeBase::recordRelocation(uint16_t oldCount) {
+  // Slots below the live count kept their nodes; the vacated ones above it
+  // hold forwarding indices until new nodes or strings reach them.
+  stableNodes_ = std::min(stableNodes_, nodeCount_);
+  relocBase_ = nodeCount_;
+  relocCount_ = 0;
+  relocation_ = 0;
+  ++revision_;
+  auto vacated = [this](uint16_t index) {
+    return reinterpret_cast<const Node*>(buffer_ + static_cast<size_t>(index) * kNodeSize);
+  };
+  uint16_t count = static_cast<uint16_t>(oldCount - nodeCount_);
+  while (count != 0 && !vacated(static_cast<uint16_t>(relocBase_ + count - 1))->mark) {
+    --count;
+  }
+  // A new index per vacated slot, then the generation its node had.
+  const size_t dataBytes = count * (sizeof(uint16_t) + 1);
+  const size_t bytes = blockBytes(dataBytes);
+  if (!ASSOCTREE_GC_RELOCATION_MAP || count == 0 ||
+      strTop_ < static_cast<size_t>(oldCount) * kNodeSize + bytes) {
+    return;
+  }
+  // Nothing refers to the block, so the next compaction drops it.
+  const uint16_t block = allocateBlock(dataBytes);
+  if (block == 0) {
+    return;
+  }
+  for (uint16_t i = 0; i < count; ++i) {
+    const Node* slot = vacated(static_cast<uint16_t>(relocBase_ + i));
+    const uint16_t moved = slot->mark ? slot->firstChild : detail::kInvalidIndex;
+    std::memcpy(buffer_ + block + i * sizeof(uint16_t), &moved, sizeof(moved));
+    buffer_[block + count * sizeof(uint16_t) + i] = slot->generation;
+  }
+  relocation_ = block;
+  relocCount_ = count;
+}
+
+void AssocTreeBase::invalidateRefs() {
+  ++revision_;
+  stableRevision_ = revision_;
+  stableNodes_ = detail::kInvalidIndex;
+  relocation_ = 0;
+}
+
+uint16_t AssocTreeBase::indexOf(const Node& node) const {
+  const uintptr_t at = reinterpret_cast<uintptr_t>(&node);
+  const uintptr_t base = reinterpret_cast<uintptr_t>(buffer_);
+  if (!buffer_ || at < base || at >= base + nodeTop_) {
+    return detail::kInvalidIndex;
+  }
+  return static_cast<uint16_t>((at - base) / kNodeSize);
+}
+
+void AssocTreeBase::noteChange(uint16_t index) {
+  if (watchCount_ == 0) {
+    return;
+  }
+  // Stamp every watch on the way to the root. Reads use the const nodeAt(),
+  // so an open transaction journals nothing for them.
+  const uint32_t change = changeSeq_ + 1;
+  bool stamped = false;
+  for (uint16_t steps = 0; index != detail::kInvalidIndex && steps <= nodeCount_; ++steps) {
+    for (Watch& watch : watches_) {
+      if (watch.node == index) {
+        watch.changed = change;
+        stamped = true;
+      }
+    }
+    const Node* node = std::as_const(*this).nodeAt(index);
+    index = node ? node->parent : detail::kInvalidIndex;
+  }
+  if (stamped) {
+    changeSeq_ = change;
+  }
+}
+
+void AssocTreeBase::endWatches(uint16_t top, bool inclusive) {
+  // Called before `top` (or only its children) is unlinked, while the parent
+  // links of the watched nodes still lead through it.
+  if (watchCount_ == 0) {
+    return;
+  }
+  for (Watch& watch : watches_) {
+    if (watch.node == detail::kInvalidIndex) {
+      continue;
+    }
+    uint16_t index = watch.node;
+    for (uint16_t steps = 0; index != detail::kInvalidIndex && steps <= nodeCount_; ++steps) {
+      if (index == top && (inclusive || steps != 0)) {
+        watch.node = detail::kInvalidIndex;
+        watch.changed = ++changeSeq_;
+        --watchCount_;
+        break;
+      }
+      const Node* node = std::as_const(*this).nodeAt(index);
+      index = node ? node->parent : detail::kInvalidIndex;
+    }
+  }
+}
+
+void AssocTreeBase::endWatchesOnLoad() {
+  for (Watch& watch : watches_) {
+    if (watch.node != detail::kInvalidIndex) {
+      watch.node = detail::kInvalidIndex;
+      watch.changed = ++changeSeq_;
+    }
+  }
+  watchCount_ = 0;
+}
+
+void AssocTreeBase::moveWatch(uint16_t from, uint16_t to) {
+  if (watchCount_ == 0) {
+    return;
+  }
+  for (Watch& watch : watches_) {
+    if (watch.node == from) {
+      watch.node = to;
+    }
+  }
+}
+
+bool AssocTreeBase::gcLive(uint16_t index) const {
+  const Node* node = nodeAt(index);
+  return node && node->used && node->mark;
+}
+
+size_t AssocTreeBase::gcAdvance() {
+  switch (gcPhase_) {
+    case GcPhase::ClearMarks: {
+      size_t visited = 0;
+      while (gcCursor_ < nodeCount_ && visited < kGcMarkChunk) {
+        nodeAt(gcCursor_++)->mark = 0;
+        ++visited;
+      }
+      if (gcCursor_ >= nodeCount_) {
+        gcPhase_ = GcPhase::Mark;
+        gcCursor_ = rootIndex();
+        gcBacktracking_ = false;
+      }
+      return visited + 1;
+    }
+    case GcPhase::Mark:
+      if (!markReachable(gcCursor_, gcBacktracking_, kGcMarkChunk)) {
+        gcPhase_ = GcPhase::Nodes;
+        gcCursor_ = 0;
+        freeNode_ = detail::kInvalidIndex;
+        freeNodeCount_ = 0;
+      }
+      return kGcMarkChunk;
+    case GcPhase::Nodes:
+      return gcMoveNodes();
+    case GcPhase::Strings:
+      return gcSlideStrings();
+    case GcPhase::Idle:
+      break;
+  }
+  return 1;
+}
+
+size_t AssocTreeBase::gcMoveNodes() {
+  // Incremental variant of compactNodes(): gcCursor_ is the lowest hole and
+  // every move patches its links immediately, so the tree stays consistent
+  // between steps.
+  size_t cost = 1;
+  while (nodeCount_ > 1 && !gcLive(static_cast<uint16_t>(nodeCount_ - 1))) {
+    --nodeCount_;
+    ++cost;
+  }
+  nodeTop_ = static_cast<size_t>(nodeCount_) * kNodeSize;
+  while (gcCursor_ < nodeCount_ && gcLive(gcCursor_)) {
+    ++gcCursor_;
+    ++cost;
+  }
+  if (gcCursor_ >= nodeCount_) {
+    // Listed and interned blocks are about to be slid over, and so is the
+    // unreferenced relocation map.
+    clearFreeBlocks();
+    clearInterned();
+    relocation_ = 0;
+    gcInternBytes_ = 0;
+    gcPhase_ = GcPhase::Strings;
+    gcRead_ = totalBytes_;
+    gcWrite_ = totalBytes_;
+    return cost;
+  }
+  const uint16_t top = static_cast<uint16_t>(nodeCount_ - 1);
+  Node* node = nodeAt(top);
+  if (!gcRelocateChildren(node->parent, top, cost)) {
+    // Not linked from its parent: left over from an unset() after marking.
+    node->used = 0;
+    node->mark = 0;
+  }
+  invalidateRefs();
+  return cost;
+}
+
+bool AssocTreeBase::gcRelocateChildren(uint16_t parentIndex, uint16_t target, size_t& cost) {
+  // Moves every child of the parent that sits above the lowest hole, so one
+  // walk of the sibling chain serves the whole family.
+  Node* parent = nodeAt(parentIndex);
+  if (!parent || !parent->used || !parent->mark ||
+      (parent->type != NodeType::Object && parent->type != NodeType::Array)) {
+    return false;
+  }
+  detail::IndexHeader* header = indexHeader(*parent);
+  const bool isArray = parent->type == NodeType::Array;
+  bool found = false;
+  uint16_t prev = detail::kInvalidIndex;
+  uint16_t position = 0;
+  uint16_t child = parent->firstChild;
+  while (child != detail::kInvalidIndex) {
+    ++cost;
+    Node* entry = nodeAt(child);
+    if (!entry) {
+      break;
+    }
+    const uint16_t next = entry->nextSibling;
+    found = found || child == target;
+    if (gcCursor_ < child && entry->used) {
+      const uint16_t to = gcCursor_;
+      Node* moved = nodeAt(to);
+      *moved = *entry;
+      moveWatch(child, to);
+      moved->mark = 1;
+      entry->used = 0;
+      entry->mark = 0;
+      if (prev == detail::kInvalidIndex) {
+        parent->firstChild = to;
+      } else {
+        nodeAt(prev)->nextSibling = to;
+      }
+      for (uint16_t grand = moved->firstChild; grand != detail::kInvalidIndex;) {
+        Node* g = nodeAt(grand);
+        if (!g) {
+          break;
+        }
+        g->parent = to;
+        grand = g->nextSibling;
+        ++cost;
+      }
+      if (header) {
+        uint16_t* entries = indexEntries(header);
+        if (isArray) {
+          if (position < header->capacity) {
+            entries[position] = to;
+          }
+        } else if (moved->hasKey()) {
+          const uint16_t mask = static_cast<uint16_t>(header->capacity - 1);
+          uint16_t slot = static_cast<uint16_t>(keyHash(*moved) & mask);
+          for (uint16_t probes = 0; probes < header->capacity; ++probes) {
+            if (entries[slot] == child) {
+              entries[slot] = to;
+              break;
+            }
+            if (entries[slot] == detail::kInvalidIndex) {
+              break;
+            }
+            slot = static_cast<uint16_t>((slot + 1) & mask);
+          }
+        }
+        if (header->tail == child) {
+          header->tail = to;
+        }
+      }
+      child = to;
+      while (gcCursor_ < nodeCount_ && gcLive(gcCursor_)) {
+        ++gcCursor_;
+      }
+    }
+    prev = child;
+    ++position;
+    child = next;
+  }
+  return found;
+}
+
+size_t AssocTreeBase::gcSlideStrings() {
+  // Incremental variant of compactStrings(): take a window of blocks below
+  // gcRead_, find their owners with a node scan and slide the live ones up
+  // to gcWrite_. The gap in between is kept as dead blocks.
+  struct WindowBlock {
+    uint16_t offset;
+    uint16_t size;
+    uint16_t target;
+    bool live;
+    bool shared;
+  };
+  WindowBlock blocks[kGcWindowBlocks];
+  size_t count = 0;
+  size_t low = gcRead_;
+  while (count < kGcWindowBlocks && low > strTop_) {
+    uint16_t trailer = *reinterpret_cast<const uint16_t*>(buffer_ + low - kTrailerBytes);
+    size_t size = trailer & kBlockSizeMask;
+    if (!(trailer & kRawTrailer) || size < kTrailerBytes || size > low - strTop_) {
+      // Unreadable block chain: leave the gap as a dead block for gc().
+      gcPhase_ = GcPhase::Idle;
+      return 1;
+    }
+    low -= size;
+    blocks[count++] = {static_cast<uint16_t>(low), static_cast<uint16_t>(size), 0, false, false};
+  }
+  if (count == 0) {
+    strTop_ = gcWrite_;
+    internBlockBytes_ = gcInternBytes_;
+    gcPhase_ = GcPhase::Idle;
+    return 1;
+  }
+  auto find = [&](uint16_t offset) -> WindowBlock* {
+    if (offset < low || offset >= gcRead_) {
+      return nullptr;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (blocks[i].offset == offset) {
+        return &blocks[i];
+      }
+    }
+    return nullptr;
+  };
+  uint16_t* refs[3];
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    Node* node = nodeAt(i);
+    if (!node->used) {
+      continue;
+    }
+    for (size_t r = 0, n = blockRefs(*node, refs); r < n; ++r) {
+      if (WindowBlock* block = find(*refs[r])) {
+        block->live = true;
+        if (refs[r] == &node->key.offset ? node->internedKey : node->internedValue) {
+          block->shared = true;
+        }
+      }
+    }
+  }
+  size_t write = gcWrite_;
+  for (size_t i = 0; i < count; ++i) {
+    if (!blocks[i].live) {
+      continue;
+    }
+    write -= blocks[i].size;
+    blocks[i].target = static_cast<uint16_t>(write);
+    if (blocks[i].shared) {
+      gcInternBytes_ += blocks[i].size;
+    }
+    std::memmove(buffer_ + write, buffer_ + blocks[i].offset, blocks[i].size);
+  }
+  for (uint16_t i = 0; i < nodeCount_; ++i) {
+    Node* node = nodeAt(i);
+    if (!node->used) {
+      continue;
+    }
+    for (size_t r = 0, n = blockRefs(*node, refs); r < n; ++r) {
+      if (WindowBlock* block = find(*refs[r])) {
+        *refs[r] = block->target;
+      }
+    }
+  }
+  gcRead_ = low;
+  gcWrite_ = write;
+  gcMarkGap();
+  return static_cast<size_t>(nodeCount_) * 2 + count;
+}
+
+void AssocTreeBase::gcMarkGap() {
+  // A trailer holds at most kBlockSizeMask bytes, so a wide gap is written
+  // as a chain of dead blocks for the block walkers.
+  for (size_t top = gcWrite_; top > gcRead_;) {
+    const size_t size = std::min<size_t>(top - gcRead_, kBlockSizeMask);
+    *reinterpret_cast<uint16_t*>(buffer_ + top - kTrailerBytes) =
+        static_cast<uint16_t>(size | kRawTrailer);
+    top -= size;
+  }
+}
+
+bool AssocTreeBase::beginTransaction() {
+  if (!buffer_ || readOnly_) {
+    return false;
+  }
+  if (txnDepth_ != 0) {
+    if (txnDepth_ == std::numeric_limits<uint8_t>::max()) {
+      return false;
+    }
+    ++txnDepth_;
+    return true;
+  }
+  // Moved nodes and strings cannot be moved back.
+  while (gcPhase_ == GcPhase::Nodes || gcPhase_ == GcPhase::Strings) {
+    gcAdvance();
+  }
+  const size_t bitmapBytes = (static_cast<size_t>(nodeCount_) + 7) / 8;
+  reserve(blockBytes(sizeof(Checkpoint) + bitmapBytes));
+  const uint16_t state = allocateBlock(sizeof(Checkpoint) + bitmapBytes);
+  if (state == 0) {
+    return false;
+  }
+  Checkpoint checkpoint;
+  checkpoint.nodeTop = nodeTop_;
+  checkpoint.strTop = strTop_;
+  checkpoint.internRefBytes = internRefBytes_;
+  checkpoint.internBlockBytes = internBlockBytes_;
+  checkpoint.reusedNodes = reusedNodes_;
+  checkpoint.reusedBlocks = reusedBlocks_;
+  checkpoint.inPlaceStrings = inPlaceStrings_;
+  checkpoint.internHits = internHits_;
+  checkpoint.nodeCount = nodeCount_;
+  checkpoint.freeNode = freeNode_;
+  checkpoint.freeNodeCount = freeNodeCount_;
+  checkpoint.gcCursor = gcCursor_;
+  std::copy(freeBlocks_, freeBlocks_ + detail::kBlockClasses, checkpoint.freeBlocks);
+  for (size_t id = 0; id < ASSOCTREE_WATCH_SLOTS; ++id) {
+    checkpoint.watched[id] = watches_[id].node;
+  }
+  checkpoint.gcPhase = gcPhase_;
+  checkpoint.gcBacktracking = gcBacktracking_;
+  // Blocks are only 2-byte aligned.
+  std::memcpy(buffer_ + state, &checkpoint, sizeof(checkpoint));
+  std::memset(buffer_ + state + sizeof(checkpoint), 0, bitmapBytes);
+  txnState_ = state;
+  txnJournal_ = 0;
+  txnNodeCount_ = nodeCount_;
+  txnStrTop_ = strTop_;
+  txnFailed_ = false;
+  txnDepth_ = 1;
+  return true;
+}
+
+bool AssocTreeBase::endTransaction(bool commit) {
+  if (txnDepth_ == 0) {
+    return false;
+  }
+  if (!commit) {
+    txnFailed_ = true;
+  }
+  if (--txnDepth_ != 0) {
+    return !txnFailed_;
+  }
+  const bool keep = !txnFailed_;
+  const size_t stateBytes =
+      blockBytes(sizeof(Checkpoint) + (static_cast<size_t>(txnNodeCount_) + 7) / 8);
+  if (keep) {
+    // Journal records are released newest first, so they mostly just give
+    // strTop_ back.
+    uint16_t record = txnJournal_;
+    while (record != 0) {
+      JournalRecord header;
+      std::memcpy(&header, buffer_ + record, sizeof(header));
+      size_t payload = kNodeSize;
+      if (header.node == kReleaseRecord || header.node == kTakenRecord) {
+        BlockRecord block;
+        std::memcpy(&block, buffer_ + record + sizeof(header), sizeof(block));
+        if (header.node == kReleaseRecord) {
+          releaseBlock(block.offset, block.bytes);
+        }
+        payload = sizeof(block);
+      }
+      releaseBlock(record, blockBytes(sizeof(header) + payload));
+      record = header.previous;
+    }
+  } else {
+    // Put the journaled nodes and reused free blocks back, then the pool
+    // bookkeeping. Blocks taken from the gap since the transaction began lie
+    // below the restored strTop_ and are gone with it.
+    for (uint16_t record = txnJournal_; record != 0;) {
+      JournalRecord header;
+      std::memcpy(&header, buffer_ + record, sizeof(header));
+      if (header.node == kTakenRecord) {
+        BlockRecord block;
+        std::memcpy(&block, buffer_ + record + sizeof(header), sizeof(block));
+        const uint16_t trailer = static_cast<uint16_t>(block.bytes | kRawTrailer | kFreeTrailer);
+        std::memcpy(buffer_ + block.offset + block.bytes - kTrailerBytes, &trailer,
+                    sizeof(trailer));
+      } else if (header.node != kReleaseRecord) {
+        std::memcpy(buffer_ + static_cast<size_t>(header.node) * kNodeSize,
+                    buffer_ + record + sizeof(header), kNodeSize);
+      }
+      record = header.previous;
+    }
+    Checkpoint checkpoint;
+    std::memcpy(&checkpoint, buffer_ + txnState_, sizeof(checkpoint));
+    nodeTop_ = checkpoint.nodeTop;
+    strTop_ = checkpoint.strTop;
+    internRefBytes_ = checkpoint.internRefBytes;
+    internBlockBytes_ = checkpoint.internBlockBytes;
+    reusedNodes_ = checkpoint.reusedNodes;
+    reusedBlocks_ = checkpoint.reusedBlocks;
+    inPlaceStrings_ = checkpoint.inPlaceStrings;
+    internHits_ = checkpoint.internHits;
+    nodeCount_ = checkpoint.nodeCount;
+    freeNode_ = checkpoint.freeNode;
+    freeNodeCount_ = checkpoint.freeNodeCount;
+    gcCursor_ = checkpoint.gcCursor;
+    std::copy(checkpoint.freeBlocks, checkpoint.freeBlocks + detail::kBlockClasses, freeBlocks_);
+    gcPhase_ = checkpoint.gcPhase;
+    gcBacktracking_ = checkpoint.gcBacktracking;
+    // Watches ended by removals come back with their nodes, and are reported
+    // again so their owners see the node is there.
+    watchCount_ = 0;
+    for (size_t id = 0; id < ASSOCTREE_WATCH_SLOTS; ++id) {
+      Watch& watch = watches_[id];
+      if (!watch.used) {
+        continue;
+      }
+      if (watch.node != checkpoint.watched[id]) {
+        watch.node = checkpoint.watched[id];
+        watch.changed = ++changeSeq_;
+      }
+      if (watch.node != detail::kInvalidIndex) {
+        ++watchCount_;
+      }
+    }
+    // Index tables were updated in place; refill those of restored
+    // containers from their restored children.
+    for (uint16_t record = txnJournal_; record != 0;) {
+      JournalRecord header;
+      std::memcpy(&header, buffer_ + record, sizeof(header));
+      const Node* node = nodeAt(header.node);
+      if (node) {
+        if (detail::IndexHeader* table = indexHeader(*node)) {
+          uint16_t* entries = indexEntries(table);
+          std::fill(entries, entries + table->capacity, detail::kInvalidIndex);
+          fillIndex(*node, table);
+        }
+      }
+      record = header.previous;
+    }
+    // Entries may name blocks that are free again.
+    clearInterned();
+    invalidateRefs();
+  }
+  releaseBlock(txnState_, stateBytes);
+  if (!keep) {
+    // Taking blocks off the lists relinked older free blocks, so rebuild
+    // the lists from the trailers.
+    mergeFreeBlocks();
+  }
+  txnState_ = 0;
+  txnJournal_ = 0;
+  txnFailed_ = false;
+  return keep;
+}
+
+bool AssocTreeBase::journalNode(uint16_t index) {
+  uint8_t* journaled = buffer_ + txnState_ + sizeof(Checkpoint) + index / 8;
+  const uint8_t bit = static_cast<uint8_t>(1u << (index % 8));
+  if (*journaled & bit) {
+    return true;
+  }
+  const uint16_t record = takeGap(blockBytes(sizeof(JournalRecord) + kNodeSize));
+  if (record == 0) {
+    txnFailed_ = true;
+    return false;
+  }
+  const JournalRecord header = {txnJournal_, index};
+  std::memcpy(buffer_ + record, &header, sizeof(header));
+  std::memcpy(buffer_ + record + sizeof(header), buffer_ + static_cast<size_t>(index) * kNodeSize,
+              kNodeSize);
+  txnJournal_ = record;
+  *journaled |= bit;
+  return true;
+}
+
+bool AssocTreeBase::journalBlock(uint16_t kind, uint16_t offset, size_t bytes) {
+  // From the gap only: this may run while a free list is being walked.
+  const uint16_t record = takeGap(blockBytes(sizeof(JournalRecord) + sizeof(BlockRecord)));
+  if (record == 0) {
+    return false;
+  }
+  const JournalRecord header = {txnJournal_, kind};
+  const BlockRecord block = {offset, static_cast<uint16_t>(bytes)};
+  std::memcpy(buffer_ + record, &header, sizeof(header));
+  std::memcpy(buffer_ + record + sizeof(header), &block, sizeof(block));
+  txnJournal_ = record;
+  return true;
+}
+
+void AssocTreeBase::failTransaction() {
+  if (txnDepth_ != 0) {
+    txnFailed_ = true;
+  }
+}
+
+Transaction::Transaction(AssocTreeBase& tree) : tree_(&tree), guard_(tree.makeLockGuard()) {
+  open_ = tree.beginTransaction();
+  if (!open_) {
+    failed_ = true;
+    guard_.release();
+  }
+}
+
+Transaction::~Transaction() {
+  rollback();
+}
+
+NodeRef Transaction::operator[](const char* key) {
+  return open_ ? tree_->makeRootRef()[key] : NodeRef();
+}
+
+NodeRef Transaction::operator[](size_t index) {
+  return open_ ? tree_->makeRootRef()[index] : NodeRef();
+}
+
+bool Transaction::commit() {
+  if (!open_) {
+    return false;
+  }
+  open_ = false;
+  failed_ = !tree_->endTransaction(true);
+  guard_.release();
+  return !failed_;
+}
+
+void Transaction::rollback() {
+  if (!open_) {
+    return;
+  }
+  open_ = false;
+  tree_->endTransaction(false);
+  failed_ = true;
+  guard_.release();
+}
+
+bool Transaction::failed() const {
+  return open_ ? tree_->txnFailed_ : failed_;
+}
+
+JsonReader::JsonReader(AssocTreeBase& tree, JsonMode mode)
+    : tree_(&tree), merge_(mode == JsonMode::MergePatch) {
+  auto guard = tree.makeLockGuard();
+  if (merge_) {
+    // A patch is its own transaction, nested in any that is open.
+    txnOpen_ = tree.beginTransaction();
+    revision_ = tree.revision_;
+    if (!txnOpen_) {
+      tree.failTransaction();
+      state_ = State::Failed;
+    }
+    return;
+  }
+  tree.resetPool();
+  revision_ = tree.revision_;
+  if (!tree.buffer_ || tree.readOnly_ || tree.txnDepth_ != 0) {
+    // Replacing the whole tree cannot be part of a transaction.
+    tree.failTransaction();
+    state_ = State::Failed;
+  }
+}
+
+JsonReader::~JsonReader() {
+  if (txnOpen_) {
+    auto guard = tree_->makeLockGuard();
+    tree_->endTransaction(false);
+  }
+}
+
+bool JsonReader::feed(const char* data, size_t length) {
+  auto guard = tree_->makeLockGuard();
+  if (state_ == State::Failed) {
+    return false;
+  }
+  if (tree_->revision_ != revision_ || (length != 0 && !data) ||
+      !consume(data, data + length)) {
+    fail();
+    return false;
+  }
+  return true;
+}
+
+bool JsonReader::finish() {
+  auto guard = tree_->makeLockGuard();
+  if (state_ == State::Done && tree_->revision_ == revision_) {
+    if (txnOpen_) {
+      txnOpen_ = false;
+      if (!tree_->endTransaction(true)) {
+        state_ = State::Failed;
+        return false;
+      }
+    }
+    return true;
+  }
+  if (state_ != State::Failed) {
+    fail();
+  }
+  return false;
+}
+
+bool JsonReader::consume(const char* p, const char* end) {
+  while (p < end) {
+    const char c = *p;
+    switch (state_) {
+      case State::String:
+        if (escape_ != 0) {
+          if (!readEscape(c)) {
+            return false;
+          }
+          ++p;
+        } else if (c == '\\') {
+          escape_ = 1;
+          ++p;
+        } else if (highSurrogate_ != 0) {
+          return false;  // a high surrogate must be followed by its low half
+        } else if (c == '"') {
+          ++p;
+          if (!commitString(reinterpret_cast<const char*>(tree_->buffer_ + scratch_),
+                            scratchLength_)) {
+            return false;
+          }
+        } else {
+          const char* stop = p + 1;
+          while (stop < end && *stop != '"' && *stop != '\\') {
+            ++stop;
+          }
+          if (!appendScratch(p, static_cast<size_t>(stop - p))) {
+            return false;
+          }
+          p = stop;
+        }
+        continue;
+      case State::Number:
+        if (isNumberChar(c)) {
+          if (numberLength_ + 1u >= sizeof(number_)) {
+            return false;
+          }
+          number_[numberLength_++] = c;
+          ++p;
+          continue;
+        }
+        // The terminating character is handled in the Next state.
+        if (!commitNumber()) {
+          return false;
+        }
+        continue;
+      case State::Literal:
+        if (c != literal_[literalPos_]) {
+          return false;
+        }
+        ++p;
+        if (literal_[++literalPos_] == '\0' && !commitLiteral()) {
+          return false;
+        }
+        continue;
+      default:
+        break;
+    }
+
+    if (isJsonSpace(c)) {
+      ++p;
+      continue;
+    }
+    switch (state_) {
+      case State::Value:
+        if (c == ']' && allowClose_) {
+          if (!closeContainer(c)) {
+            return false;
+          }
+          ++p;
+        } else if (!beginValue(c)) {
+          return false;
+        } else if (c == '"') {
+          if (!beginString(p, end, false)) {
+            return false;
+          }
+        } else {
+          ++p;
+        }
+        break;
+      case State::Key:
+        if (c == '"') {
+          if (!beginString(p, end, true)) {
+            return false;
+          }
+        } else if (c == '}' && allowClose_) {
+          if (!closeContainer(c)) {
+            return false;
+          }
+          ++p;
+        } else {
+          return false;
+        }
+        break;
+      case State::Colon:
+        if (c != ':') {
+          return false;
+        }
+        state_ = State::Value;
+        allowClose_ = false;
+        ++p;
+        break;
+      case State::Next:
+        if (c == ',') {
+          state_ = topIsArray() ? State::Value : State::Key;
+          allowClose_ = false;
+        } else if (!closeContainer(c)) {
+          return false;
+        }
+        ++p;
+        break;
+      default:
+        return false;  // Done only allows trailing whitespace
+    }
+  }
+  return true;
+}
+
+bool JsonReader::beginValue(char c) {
+  if (depth_ == 0) {
+    // The root is always a container. A patch whose root is an array
+    // replaces the tree, as any non-object patch does.
+    if (c != '{' && c != '[') {
+      return false;
+    }
+    target_ = tree_->rootIndex();
+  } else if (topIsArray()) {
+    tree_->reserveChildren(stack_[depth_ - 1], 1);
+    target_ = tree_->appendChild(stack_[depth_ - 1]);
+    if (target_ == detail::kInvalidIndex) {
+      return false;
+    }
+  }
+  switch (c) {
+    case '{':
+      return openContainer(detail::NodeType::Object);
+    case '[':
+      return openContainer(detail::NodeType::Array);
+    case '"':
+      return true;
+    case 't':
+      literal_ = "true";
+      break;
+    case 'f':
+      literal_ = "false";
+      break;
+    case 'n':
+      literal_ = "null";
+      break;
+    default:
+      if (c != '-' && (c < '0' || c > '9')) {
+        return false;
+      }
+      number_[0] = c;
+      numberLength_ = 1;
+      state_ = State::Number;
+      return true;
+  }
+  literalPos_ = 1;
+  state_ = State::Literal;
+  return true;
+}
+
+bool JsonReader::beginString(const char*& p, const char* end, bool isKey) {
+  inKey_ = isKey;
+  const char* start = ++p;
+  const char* stop = start;
+  while (stop < end && *stop != '"' && *stop != '\\') {
+    ++stop;
+  }
+  if (stop < end && *stop == '"') {
+    // Complete and unescaped: copy straight from the input.
+    p = stop + 1;
+    return commitString(start, static_cast<size_t>(stop - start));
+  }
+  // Leave room for the node a key still needs.
+  scratch_ = tree_->nodeTop_ + kNodeSize;
+  if (merge_) {
+    // And for the journal records a patch may take from the top of the gap
+    // before the string is copied out.
+    scratch_ += writeJournalBytes();
+  }
+  scratchLength_ = 0;
+  escape_ = 0;
+  highSurrogate_ = 0;
+  state_ = State::String;
+  p = stop;
+  return appendScratch(start, static_cast<size_t>(stop - start));
+}
+
+bool JsonReader::readEscape(char c) {
+  if (escape_ == 1) {
+    if (highSurrogate_ != 0 && c != 'u') {
+      return false;
+    }
+    char decoded;
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        decoded = c;
+        break;
+      case 'b':
+        decoded = '\b';
+        break;
+      case 'f':
+        decoded = '\f';
+        break;
+      case 'n':
+        decoded = '\n';
+        break;
+      case 'r':
+        decoded = '\r';
+        break;
+      case 't':
+        decoded = '\t';
+        break;
+      case 'u':
+        escape_ = 2;
+        code_ = 0;
+        return true;
+      default:
+        return false;
+    }
+    escape_ = 0;
+    return appendScratch(&decoded, 1);
+  }
+  const int digit = hexDigit(c);
+  if (digit < 0) {
+    return false;
+  }
+  code_ = static_cast<uint16_t>((code_ << 4) | digit);
+  if (++escape_ < 6) {
+    return true;
+  }
+  escape_ = 0;
+  return appendCodepoint(code_);
+}
+
+bool JsonReader::appendCodepoint(uint32_t codepoint) {
+  if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+    if (highSurrogate_ != 0) {
+      return false;
+    }
+    highSurrogate_ = static_cast<uint16_t>(codepoint);
+    return true;
+  }
+  if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+    if (highSurrogate_ == 0) {
+      return false;
+    }
+    codepoint = 0x10000 + ((static_cast<uint32_t>(highSurrogate_) - 0xD800) << 10) +
+                (codepoint - 0xDC00);
+    highSurrogate_ = 0;
+  }
+  char utf8[4];
+  size_t length;
+  if (codepoint < 0x80) {
+    utf8[0] = static_cast<char>(codepoint);
+    length = 1;
+  } else if (codepoint < 0x800) {
+    utf8[0] = static_cast<char>(0xC0 | (codepoint >> 6));
+    utf8[1] = static_cast<char>(0x80 | (codepoint & 0x3F));
+    length = 2;
+  } else if (codepoint < 0x10000) {
+    utf8[0] = static_cast<char>(0xE0 | (codepoint >> 12));
+    utf8[1] = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+    utf8[2] = static_cast<char>(0x80 | (codepoint & 0x3F));
+    length = 3;
+  } else {
+    utf8[0] = static_cast<char>(0xF0 | (codepoint >> 18));
+    utf8[1] = static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+    utf8[2] = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+    utf8[3] = static_cast<char>(0x80 | (codepoint & 0x3F));
+    length = 4;
+  }
+  return appendScratch(utf8, length);
+}
+
+bool JsonReader::appendScratch(const char* data, size_t length) {
+  tree_->reserve(scratch_ + scratchLength_ + length - tree_->nodeTop_);
+  const size_t top = tree_->strTop_;
+  if (top < scratch_ || top - scratch_ - scratchLength_ < length) {
+    return false;
+  }
+  std::memcpy(tree_->buffer_ + scratch_ + scratchLength_, data, length);
+  scratchLength_ += length;
+  return true;
+}
+
+bool JsonReader::commitString(const char* data, size_t length) {
+  if (tree_->allocator_) {
+    // Room for the stored copy above a scratch copy, which growing keeps but
+    // moves with the pool.
+    const bool scratched = state_ == State::String;
+    const size_t bytes =
+        stringBlockBytes(length) + (scratched ? scratch_ + length - tree_->nodeTop_ : 0);
+    if (inKey_) {
+      tree_->reserveChildren(stack_[depth_ - 1], 1, bytes);
+    } else {
+      tree_->reserve(bytes);
+    }
+    if (scratched) {
+      data = reinterpret_cast<const char*>(tree_->buffer_ + scratch_);
+    }
+  }
+  if (inKey_) {
+    const uint16_t parent = stack_[depth_ - 1];
+    uint16_t child = tree_->findChildByKey(parent, data, length);
+    if (child != detail::kInvalidIndex) {
+      // A repeated key keeps its position and takes the later value. A
+      // patched key is changed only by its value.
+      if (!topIsMerging()) {
+        detail::Node* node = tree_->nodeAt(child);
+        if (!node) {
+          return false;
+        }
+        tree_->setNodeNull(*node);
+      }
+    } else {
+      child = tree_->appendChild(parent);
+      detail::Node* node = tree_->nodeAt(child);
+      if (!node || !tree_->storeKey(*node, data, length)) {
+        return false;
+      }
+      tree_->indexInsert(parent, child);
+    }
+    target_ = child;
+    state_ = State::Colon;
+    return true;
+  }
+  detail::Node* node = tree_->nodeAt(target_);
+  if (!node) {
+    return false;
+  }
+  tree_->setNodeString(*node, data, length);
+  state_ = State::Next;
+  return node->type == detail::NodeType::String;
+}
+
+bool JsonReader::commitNumber() {
+  tree_->reserve(0);
+  detail::Node* node = tree_->nodeAt(target_);
+  if (!node) {
+    return false;
+  }
+  number_[numberLength_] = '\0';
+  // Integers that fit in int32_t stay exact; anything else is a double.
+  constexpr int64_t kLimit = static_cast<int64_t>(std::numeric_limits<int32_t>::max()) + 1;
+  const bool negative = number_[0] == '-';
+  const char* digits = number_ + (negative ? 1 : 0);
+  int64_t value = 0;
+  const char* q = digits;
+  while (*q >= '0' && *q <= '9') {
+    if (value <= kLimit) {
+      value = value * 10 + (*q - '0');
+    }
+    ++q;
+  }
+  // JSON allows no leading zeros and needs digits after '.' and the exponent.
+  if (q == digits || (*digits == '0' && q - digits > 1)) {
+    return false;
+  }
+  const bool integer = *q == '\0';
+  if (*q == '.') {
+    const char* fraction = ++q;
+    while (*q >= '0' && *q <= '9') {
+      ++q;
+    }
+    if (q == fraction) {
+      return false;
+    }
+  }
+  if (*q == 'e' || *q == 'E') {
+    if (*++q == '+' || *q == '-') {
+      ++q;
+    }
+    const char* exponent = q;
+    while (*q >= '0' && *q <= '9') {
+      ++q;
+    }
+    if (q == exponent) {
+      return false;
+    }
+  }
+  if (*q != '\0') {
+    return false;
+  }
+  if (integer && value <= (negative ? kLimit : kLimit - 1)) {
+    tree_->setNodeInt(*node, static_cast<int32_t>(negative ? -value : value));
+  } else {
+    char* parsed = nullptr;
+    const double number = std::strtod(number_, &parsed);
+    if (parsed != number_ + numberLength_) {
+      return false;
+    }
+    tree_->setNodeDouble(*node, number);
+  }
+  state_ = State::Next;
+  return true;
+}
+
+bool JsonReader::commitLiteral() {
+  tree_->reserve(0);
+  detail::Node* node = tree_->nodeAt(target_);
+  if (!node) {
+    return false;
+  }
+  if (literal_[0] == 'n' && topIsMerging()) {
+    tree_->detachNode(target_);
+    if (tree_->txnFailed_) {
+      return false;
+    }
+  } else if (literal_[0] == 'n') {
+    tree_->setNodeNull(*node);
+  } else {
+    tree_->setNodeBool(*node, literal_[0] == 't');
+  }
+  state_ = State::Next;
+  return true;
+}
+
+bool JsonReader::openContainer(detail::NodeType type) {
+  tree_->reserve(0);
+  detail::Node* node = tree_->nodeAt(target_);
+  if (!node || depth_ == ASSOCTREE_JSON_MAX_DEPTH) {
+    return false;
+  }
+  // A patch object under a patched object (or at the root) merges into an
+  // existing object and replaces anything else.
+  const bool merging =
+      merge_ && type == detail::NodeType::Object && (depth_ == 0 || topIsMerging());
+  if (!merging || node->type != detail::NodeType::Object) {
+    tree_->makeContainer(*node, type);
+  }
+  stack_[depth_] = target_;
+  const uint32_t bit = static_cast<uint32_t>(1) << depth_;
+  if (type == detail::NodeType::Array) {
+    arrayLevels_ |= bit;
+  } else {
+    arrayLevels_ &= ~bit;
+  }
+  if (merging) {
+    mergeLevels_ |= bit;
+  } else {
+    mergeLevels_ &= ~bit;
+  }
+  ++depth_;
+  state_ = type == detail::NodeType::Array ? State::Value : State::Key;
+  allowClose_ = true;
+  return true;
+}
+
+bool JsonReader::closeContainer(char c) {
+  if (depth_ == 0 || c != (topIsArray() ? ']' : '}')) {
+    return false;
+  }
+  --depth_;
+  state_ = depth_ == 0 ? State::Done : State::Next;
+  return true;
+}
+
+void JsonReader::fail() {
+  if (merge_) {
+    if (txnOpen_) {
+      txnOpen_ = false;
+      tree_->endTransaction(false);
+    }
+  } else {
+    tree_->resetPool();
+  }
+  revision_ = tree_->revision_;
+  state_ = State::Failed;
+}
+
+MsgPackReader::MsgPackReader(AssocTreeBase& tree) : tree_(&tree) {
+  auto guard = tree.makeLockGuard();
+  tree.resetPool();
+  revision_ = tree.revision_;
+  if (!tree.buffer_ || tree.readOnly_ || tree.txnDepth_ != 0) {
+    // Replacing the whole tree cannot be part of a transaction.
+    tree.failTransaction();
+    state_ = State::Failed;
+  }
+}
+
+bool MsgPackReader::feed(const uint8_t* data, size_t length) {
+  auto guard = tree_->makeLockGuard();
+  if (state_ == State::Failed) {
+    return false;
+  }
+  if (tree_->revision_ != revision_ || (length != 0 && !data) ||
+      !consume(data, data + length)) {
+    fail();
+    return false;
+  }
+  return true;
+}
+
+bool MsgPackReader::finish() {
+  auto guard = tree_->makeLockGuard();
+  if (state_ == State::Done && tree_->revision_ == revision_) {
+    return true;
+  }
+  if (state_ != State::Failed) {
+    fail();
+  }
+  return false;
+}
+
+bool MsgPackReader::consume(const uint8_t* p, const uint8_t* end) {
+  while (p < end) {
+    const size_t available = static_cast<size_t>(end - p);
+    switch (state_) {
+      case State::Type:
+        if (!beginItem(*p++)) {
+          return false;
+        }
+        break;
+      case State::Payload: {
+        const size_t n = std::min<size_t>(available, payloadLength_ - payloadUsed_);
+        std::memcpy(payload_ + payloadUsed_, p, n);
+        payloadUsed_ = static_cast<uint8_t>(payloadUsed_ + n);
+        p += n;
+        if (payloadUsed_ == payloadLength_ && !commitPayload()) {
+          return false;
+        }
+        break;
+      }
+      case State::String: {
+        if (scratchLength_ == 0 && available >= stringLength_) {
+          // Complete in this chunk: copy straight from the input.
+          const char* data = reinterpret_cast<const char*>(p);
+          p += stringLength_;
+          if (!commitString(data, stringLength_)) {
+            return false;
+          }
+          break;
+        }
+        const size_t n = std::min(available, stringLength_ - scratchLength_);
+        std::memcpy(tree_->buffer_ + scratch_ + scratchLength_, p, n);
+        scratchLength_ += n;
+        p += n;
+        if (scratchLength_ == stringLength_ &&
+            !commitString(reinterpret_cast<const char*>(tree_->buffer_ + scratch_),
+                          stringLength_)) {
+          return false;
+        }
+        break;
+      }
+      default:
+        return false;  // nothing may follow the root
+    }
+  }
+  return true;
+}
+
+bool MsgPackReader::beginItem(uint8_t type) {
+  const bool isString = (type >= 0xa0 && type <= 0xbf) || (type >= 0xd9 && type <= 0xdb);
+  if (depth_ == 0 ? (type & 0xe0) != 0x80 && (type < 0xdc || type > 0xdf)
+                  : expectingKey() && !isString) {
+    return false;  // the root must be a container and keys must be strings
+  }
+  if (type <= 0x7f) {
+    return commitInt(type);
+  }
+  if (type >= 0xe0) {
+    return commitInt(static_cast<int8_t>(type));
+  }
+  if (type <= 0x8f) {
+    return openContainer(detail::NodeType::Object, type & 0x0f);
+  }
+  if (type <= 0x9f) {
+    return openContainer(detail::NodeType::Array, type & 0x0f);
+  }
+  if (type <= 0xbf) {
+    return beginString(type & 0x1f);
+  }
+  switch (type) {
+    case kMsgPackNil:
+      return commitNull();
+    case kMsgPackFalse:
+    case kMsgPackTrue:
+      return commitBool(type == kMsgPackTrue);
+    case kMsgPackFloat32:
+      payloadLength_ = 4;
+      break;
+    case kMsgPackFloat64:
+      payloadLength_ = 8;
+      break;
+    case 0xcc:  // uint 8/16/32/64
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+      payloadLength_ = static_cast<uint8_t>(1 << (type - 0xcc));
+      break;
+    case 0xd0:  // int 8/16/32/64
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+      payloadLength_ = static_cast<uint8_t>(1 << (type - 0xd0));
+      break;
+    case 0xd9:  // str 8/16/32
+    case 0xda:
+    case 0xdb:
+      payloadLength_ = static_cast<uint8_t>(1 << (type - 0xd9));
+      break;
+    case 0xdc:  // array 16/32, map 16/32
+    case 0xde:
+      payloadLength_ = 2;
+      break;
+    case 0xdd:
+    case 0xdf:
+      payloadLength_ = 4;
+      break;
+    default:
+      return false;  // bin, ext and the unused 0xc1
+  }
+  type_ = type;
+  payloadUsed_ = 0;
+  state_ = State::Payload;
+  return true;
+}
+
+bool MsgPackReader::commitPayload() {
+  uint64_t raw = 0;
+  for (uint8_t i = 0; i < payloadLength_; ++i) {
+    raw = (raw << 8) | payload_[i];
+  }
+  switch (type_) {
+    case kMsgPackFloat32: {
+      const uint32_t bits = static_cast<uint32_t>(raw);
+      float value;
+      std::memcpy(&value, &bits, sizeof(value));
+      return commitDouble(value);
+    }
+    case kMsgPackFloat64: {
+      double value;
+      std::memcpy(&value, &raw, sizeof(value));
+      return commitDouble(value);
+    }
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3: {
+      // Sign-extend from the field width.
+      const unsigned shift = 64 - 8 * payloadLength_;
+      const int64_t value = static_cast<int64_t>(raw << shift) >> shift;
+      return commitInt(value);
+    }
+    case 0xd9:
+    case 0xda:
+    case 0xdb:
+      return beginString(raw);
+    case 0xdc:
+    case 0xdd:
+      return openContainer(detail::NodeType::Array, raw);
+    case 0xde:
+    case 0xdf:
+      return openContainer(detail::NodeType::Object, raw);
+    default:  // uint
+      if (raw > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+        return commitDouble(static_cast<double>(raw));
+      }
+      return commitInt(static_cast<int64_t>(raw));
+  }
+}
+
+bool MsgPackReader::beginString(uint64_t length) {
+  if (!expectingKey() && !valueTarget()) {
+    return false;
+  }
+  if (length < std::numeric_limits<uint16_t>::max()) {
+    // Room for the scratch copy, the stored copy and a key's node at once,
+    // so nothing grows the pool while the scratch copy is in use.
+    const size_t bytes = kNodeSize + static_cast<size_t>(length) +
+                         stringBlockBytes(static_cast<size_t>(length));
+    if (expectingKey()) {
+      tree_->reserveChildren(stack_[depth_ - 1], 1, bytes);
+    } else {
+      tree_->reserve(bytes);
+    }
+  }
+  if (length == 0) {
+    // No bytes will follow to complete it, so it may be the input's last item.
+    return commitString("", 0);
+  }
+  // Leave room for the node a key still needs.
+  scratch_ = tree_->nodeTop_ + kNodeSize;
+  scratchLength_ = 0;
+  if (tree_->strTop_ < scratch_ || tree_->strTop_ - scratch_ < length) {
+    return false;
+  }
+  stringLength_ = static_cast<size_t>(length);
+  state_ = State::String;
+  return true;
+}
+
+bool MsgPackReader::commitString(const char* data, size_t length) {
+  if (expectingKey()) {
+    const uint16_t parent = stack_[depth_ - 1];
+    uint16_t child = tree_->findChildByKey(parent, data, length);
+    if (child != detail::kInvalidIndex) {
+      // A repeated key keeps its position and takes the later value.
+      tree_->setNodeNull(*tree_->nodeAt(child));
+    } else {
+      child = tree_->appendChild(parent);
+      detail::Node* node = tree_->nodeAt(child);
+      if (!node || !tree_->storeKey(*node, data, length)) {
+        return false;
+      }
+      tree_->indexInsert(parent, child);
+    }
+    target_ = child;
+    completeItem();
+    return true;
+  }
+  detail::Node* node = tree_->nodeAt(target_);
+  if (!node) {
+    return false;
+  }
+  tree_->setNodeString(*node, data, length);
+  completeItem();
+  return node->type == detail::NodeType::String;
+}
+
+bool MsgPackReader::commitInt(int64_t value) {
+  if (value < std::numeric_limits<int32_t>::min() || value > std::numeric_limits<int32_t>::max()) {
+    return commitDouble(static_cast<double>(value));
+  }
+  detail::Node* node = valueTarget();
+  if (!node) {
+    return false;
+  }
+  tree_->setNodeInt(*node, static_cast<int32_t>(value));
+  completeItem();
+  return true;
+}
+
+bool MsgPackReader::commitDouble(double value) {
+  detail::Node* node = valueTarget();
+  if (!node) {
+    return false;
+  }
+  tree_->setNodeDouble(*node, value);
+  completeItem();
+  return true;
+}
+
+bool MsgPackReader::commitNull() {
+  detail::Node* node = valueTarget();
+  if (!node) {
+    return false;
+  }
+  tree_->setNodeNull(*node);
+  completeItem();
+  return true;
+}
+
+bool MsgPackReader::commitBool(bool value) {
+  detail::Node* node = valueTarget();
+  if (!node) {
+    return false;
+  }
+  tree_->setNodeBool(*node, value);
+  completeItem();
+  return true;
+}
+
+bool MsgPackReader::openContainer(detail::NodeType type, uint64_t count) {
+  // A pool never holds more than 65535 nodes, so larger counts cannot fit.
+  if (depth_ == ASSOCTREE_JSON_MAX_DEPTH || count > 0xFFFF) {
+    return false;
+  }
+  detail::Node* node = valueTarget();
+  if (!node) {
+    return false;
+  }
+  tree_->makeContainer(*node, type);
+  // The container is one item of its parent; its own items follow.
+  if (depth_ > 0) {
+    --remaining_[depth_ - 1];
+  }
+  stack_[depth_] = target_;
+  remaining_[depth_] = static_cast<uint32_t>(type == detail::NodeType::Object ? count * 2 : count);
+  ++depth_;
+  closeContainers();
+  return true;
+}
+
+bool MsgPackReader::expectingKey() const {
+  if (depth_ == 0) {
+    return false;
+  }
+  const detail::Node* top = tree_->nodeAt(stack_[depth_ - 1]);
+  return top && top->type == detail::NodeType::Object && remaining_[depth_ - 1] % 2 == 0;
+}
+
+detail::Node* MsgPackReader::valueTarget() {
+  if (depth_ == 0) {
+    target_ = tree_->rootIndex();
+  } else if (tree_->nodeAt(stack_[depth_ - 1])->type == detail::NodeType::Array) {
+    tree_->reserveChildren(stack_[depth_ - 1], 1);
+    target_ = tree_->appendChild(stack_[depth_ - 1]);
+  }
+  return tree_->nodeAt(target_);
+}
+
+void MsgPackReader::completeItem() {
+  --remaining_[depth_ - 1];
+  closeContainers();
+}
+
+void MsgPackReader::closeContainers() {
+  while (depth_ > 0 && remaining_[depth_ - 1] == 0) {
+    --depth_;
+  }
+  state_ = depth_ == 0 ? State::Done : State::Type;
+}
+
+void MsgPackReader::fail() {
+  tree_->resetPool();
+  revision_ = tree_->revision_;
+  state_ = State::Failed;
 }
 
 }  // namespace assoc_tree
@@ -2,17 +2,80 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <string>
 #include <type_traits>
 #include <utility>
 #include <iterator>
 
+// Limits for the path a NodeRef keeps from its base. operator[] binds
+// segments that exist but still keeps them, so a ref whose node was unset
+// can resolve its path again. A full path drops the segments that exist
+// and keeps only the missing suffix, so the limits apply to that suffix.
 #ifndef ASSOCTREE_MAX_LAZY_SEGMENTS
-#define ASSOCTREE_MAX_LAZY_SEGMENTS 16
+#define ASSOCTREE_MAX_LAZY_SEGMENTS 8
 #endif
 
 #ifndef ASSOCTREE_LAZY_KEY_BYTES
-#define ASSOCTREE_LAZY_KEY_BYTES 256
+#define ASSOCTREE_LAZY_KEY_BYTES 64
+#endif
+
+// Objects with more children than this get a hash index in the string
+// region. Set to 0 to always use the linear sibling walk.
+#ifndef ASSOCTREE_INDEX_THRESHOLD
+#define ASSOCTREE_INDEX_THRESHOLD 8
+#endif
+
+// Default work budget for gcStep(), roughly the number of nodes visited.
+#ifndef ASSOCTREE_GC_STEP_BUDGET
+#define ASSOCTREE_GC_STEP_BUDGET 64
+#endif
+
+// Default upper bound in microseconds for a single gcStep() (0 = no limit).
+#ifndef ASSOCTREE_GC_MAX_PAUSE_US
+#define ASSOCTREE_GC_MAX_PAUSE_US 0
+#endif
+
+// Set to 0 to drop the table gc() keeps so references to the nodes it moved
+// can follow them. It takes 3 pool bytes per node slot the collection
+// vacated, until the next collection.
+#ifndef ASSOCTREE_GC_RELOCATION_MAP
+#define ASSOCTREE_GC_RELOCATION_MAP 1
+#endif
+
+// Entries in the direct-mapped table used to find strings to share when
+// interning is enabled. Must be a power of two (1 or more).
+#ifndef ASSOCTREE_INTERN_SLOTS
+#define ASSOCTREE_INTERN_SLOTS 32
+#endif
+#if ASSOCTREE_INTERN_SLOTS < 1 || (ASSOCTREE_INTERN_SLOTS & (ASSOCTREE_INTERN_SLOTS - 1)) != 0
+#error "ASSOCTREE_INTERN_SLOTS must be a power of two (at least 1)"
+#endif
+
+// Subtrees AssocTreeBase::watch() can track at once, per tree (at least 1).
+// Each slot takes 8 bytes of the tree object.
+#ifndef ASSOCTREE_WATCH_SLOTS
+#define ASSOCTREE_WATCH_SLOTS 4
+#endif
+#if ASSOCTREE_WATCH_SLOTS < 1
+#error "ASSOCTREE_WATCH_SLOTS must be at least 1"
+#endif
+
+// Set to 1 for 16-byte nodes: doubles are stored as 32-bit floats. Must be
+// the same for the library and the sketch (use a global build flag).
+#ifndef ASSOCTREE_COMPACT_NODES
+#define ASSOCTREE_COMPACT_NODES 0
+#endif
+
+// Bytes writeJson() collects on the stack before each Sink::write() call.
+#ifndef ASSOCTREE_JSON_CHUNK_BYTES
+#define ASSOCTREE_JSON_CHUNK_BYTES 64
+#endif
+
+// Deepest object/array nesting JsonReader and MsgPackReader accept (at most
+// 32).
+#ifndef ASSOCTREE_JSON_MAX_DEPTH
+#define ASSOCTREE_JSON_MAX_DEPTH 16
 #endif
 
 #ifdef ARDUINO
@@ -27,10 +90,38 @@
 #endif
 #endif
 
+// How thread-safe host builds lock a tree. ASSOCTREE_LOCK_EXCLUSIVE runs
+// every call under one recursive mutex. ASSOCTREE_LOCK_SHARED uses the
+// reader-writer lock in detail::Lock: readers count themselves in an atomic
+// state word, writes, gc() and loading serialize on a mutex and wait for the
+// readers to drain, and a waiting writer holds back new readers. The writing
+// thread may lock again. ESP32 builds always use the critical section.
+#define ASSOCTREE_LOCK_EXCLUSIVE 0
+#define ASSOCTREE_LOCK_SHARED 1
+#ifndef ASSOCTREE_LOCK_POLICY
+#define ASSOCTREE_LOCK_POLICY ASSOCTREE_LOCK_EXCLUSIVE
+#endif
+
+// Attempts thread-safe builds make at a read without the lock before taking
+// it. Such a read checks a sequence count that writers bump and is retried
+// if a write overlapped it. 0 always takes the lock.
+#ifndef ASSOCTREE_OPTIMISTIC_READS
+#define ASSOCTREE_OPTIMISTIC_READS 4
+#endif
+
+#if defined(ESP_PLATFORM) || defined(ESP32)
+#include "esp_heap_caps.h"
+#endif
+
 #if ASSOCTREE_ENABLE_THREAD_SAFETY
+#include <atomic>
 #if defined(ESP_PLATFORM) || defined(ESP32)
 #include "freertos/FreeRTOS.h"
 #include "freertos/portmacro.h"
+#elif ASSOCTREE_LOCK_POLICY == ASSOCTREE_LOCK_SHARED
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #else
 #include <mutex>
 #endif
@@ -43,10 +134,22 @@ class NodeRef;
 class NodeIterator;
 class NodeRange;
 class NodeEntry;
+class JsonReader;
+class MsgPackReader;
+class AssocTreeView;
+class Transaction;
 
 namespace detail {
 
 constexpr uint16_t kInvalidIndex = 0xFFFF;
+// Size classes of the string-region free lists (4-7, 8-15, ... 512+ bytes).
+constexpr size_t kBlockClasses = 8;
+
+#if ASSOCTREE_COMPACT_NODES
+using StoredDouble = float;
+#else
+using StoredDouble = double;
+#endif
 
 enum class NodeType : uint8_t {
   Null = 0,
@@ -69,8 +172,38 @@ struct StringSlot {
   }
 };
 
+// Bookkeeping for Object/Array nodes. `table` is the offset of the child
+// index block in the string region (0 when the node has none).
+struct ContainerInfo {
+  uint16_t table;
+  uint16_t count;
+};
+
+// Header of a child index block. Objects store an open-addressing hash table
+// of child indexes plus their last child; arrays store children in order.
+struct IndexHeader {
+  uint16_t capacity;
+  uint16_t tail;
+};
+
+// Fields are ordered so the flags share the type's 16-bit word and the value
+// union needs no padding: 24 bytes where double is 8-byte aligned, 16 with
+// ASSOCTREE_COMPACT_NODES or 4-byte doubles.
 struct Node {
-  NodeType type = NodeType::Null;
+  NodeType type : 3;
+  // Bumped each time the slot is freed, so a NodeRef can tell its node from
+  // a later one that reused the slot (modulo kGenerations).
+  uint8_t generation : 5;
+  uint8_t used : 1;
+  uint8_t mark : 1;
+  // The key / string value block may be shared with other nodes.
+  uint8_t internedKey : 1;
+  uint8_t internedValue : 1;
+  // Short keys and string values are stored in the node itself: the key's
+  // characters overlay `key` and the value's overlay `value`.
+  uint8_t keyInline : 1;
+  uint8_t valueInline : 1;
+  uint8_t inlineKeyLength : 2;
   uint16_t parent = kInvalidIndex;
   uint16_t firstChild = kInvalidIndex;
   uint16_t nextSibling = kInvalidIndex;
@@ -79,26 +212,48 @@ struct Node {
   union Value {
     bool asBool;
     int32_t asInt;
-    double asDouble;
+    StoredDouble asDouble;
     StringSlot asString;
+    ContainerInfo asContainer;
 
     constexpr Value() : asInt(0) {}
   } value;
 
-  uint8_t used : 1;
-  uint8_t mark : 1;
-  uint8_t reserved : 6;
-
-  Node() : value(), used(0), mark(0), reserved(0) {}
+  Node()
+      : type(NodeType::Null),
+        generation(0),
+        used(0),
+        mark(0),
+        internedKey(0),
+        internedValue(0),
+        keyInline(0),
+        valueInline(0),
+        inlineKeyLength(0),
+        value() {}
+
+  static constexpr uint8_t kGenerations = 32;
+  // Longest key / string value that fits inline with its NUL.
+  static constexpr size_t kInlineKeyChars = sizeof(StringSlot) - 1;
+  static constexpr size_t kInlineStringChars = sizeof(Value) - 1;
+
+  bool hasKey() const { return keyInline || key.valid(); }
+  char* inlineKey() { return reinterpret_cast<char*>(&key); }
+  const char* inlineKey() const { return reinterpret_cast<const char*>(&key); }
+  char* inlineString() { return reinterpret_cast<char*>(&value); }
+  const char* inlineString() const { return reinterpret_cast<const char*>(&value); }
 };
 
+static_assert(!ASSOCTREE_COMPACT_NODES || sizeof(Node) <= 16,
+              "compact nodes are expected to fit in 16 bytes");
+
+// Left uninitialized so building a NodeRef does not clear the whole buffer.
 struct LazySegment {
   enum class Kind : uint8_t { Key, Index };
 
-  Kind kind = Kind::Key;
-  uint16_t keyOffset = 0;
-  uint16_t keyLength = 0;
-  size_t index = 0;
+  Kind kind;
+  uint16_t keyOffset;
+  uint16_t keyLength;
+  uint16_t index;
 };
 
 struct LazyPathRef {
@@ -117,35 +272,157 @@ struct Lock {
   portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
   void lock() { portENTER_CRITICAL(&mux); }
   void unlock() { portEXIT_CRITICAL(&mux); }
+  void lockShared() { lock(); }
+  void unlockShared() { unlock(); }
+#elif ASSOCTREE_LOCK_POLICY == ASSOCTREE_LOCK_SHARED
+  // Readers only touch `state` unless a writer holds or waits for the lock;
+  // a waiting writer holds back new readers, so reads cannot starve it. The
+  // writing thread may lock again, exclusively or shared (append() assigns
+  // through operator=), but reads never nest.
+  static constexpr uint32_t kWriter = 0x80000000u;
+  std::atomic<uint32_t> state{0};  // kWriter | number of readers
+  std::atomic<std::thread::id> owner{};
+  uint32_t depth = 0;              // owner only
+  std::mutex writers;
+  std::mutex waitMux;
+  std::condition_variable changed;
+  bool ownedHere() const {
+    return owner.load(std::memory_order_relaxed) == std::this_thread::get_id();
+  }
+  void wake() {
+    { std::lock_guard<std::mutex> hold(waitMux); }
+    changed.notify_all();
+  }
+  void lock() {
+    if (ownedHere()) {
+      ++depth;
+      return;
+    }
+    writers.lock();
+    if (state.fetch_or(kWriter, std::memory_order_acquire) != 0) {
+      std::unique_lock<std::mutex> hold(waitMux);
+      changed.wait(hold, [this] { return state.load(std::memory_order_acquire) == kWriter; });
+    }
+    owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    depth = 1;
+  }
+  void unlock() {
+    if (--depth > 0) {
+      return;
+    }
+    owner.store(std::thread::id(), std::memory_order_relaxed);
+    state.fetch_and(~kWriter, std::memory_order_release);
+    writers.unlock();
+    wake();
+  }
+  void lockShared() {
+    if (ownedHere()) {
+      ++depth;
+      return;
+    }
+    uint32_t current = state.load(std::memory_order_relaxed);
+    for (;;) {
+      if ((current & kWriter) == 0) {
+        if (state.compare_exchange_weak(current, current + 1, std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+          return;
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> hold(waitMux);
+      changed.wait(hold, [this] { return (state.load(std::memory_order_relaxed) & kWriter) == 0; });
+      current = state.load(std::memory_order_relaxed);
+    }
+  }
+  void unlockShared() {
+    if (ownedHere()) {
+      --depth;
+      return;
+    }
+    if (state.fetch_sub(1, std::memory_order_release) == kWriter + 1) {
+      wake();
+    }
+  }
 #else
   std::recursive_mutex mux;
   void lock() { mux.lock(); }
   void unlock() { mux.unlock(); }
+  void lockShared() { lock(); }
+  void unlockShared() { unlock(); }
 #endif
 #else
   void lock() {}
   void unlock() {}
+  void lockShared() {}
+  void unlockShared() {}
+#endif
+
+#if ASSOCTREE_ENABLE_THREAD_SAFETY
+  // Seqlock for optimistic reads: odd while a writer holds the lock. Only
+  // the thread holding the lock exclusively touches writeDepth.
+  std::atomic<uint32_t> sequence{0};
+  uint32_t writeDepth = 0;
+  void beginWrite() {
+    if (writeDepth++ == 0) {
+      sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+  }
+  void endWrite() {
+    if (--writeDepth == 0) {
+      sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+  }
+  bool readBegin(uint32_t& snapshot) const {
+    snapshot = sequence.load(std::memory_order_acquire);
+    return (snapshot & 1) == 0;
+  }
+  bool readValidate(uint32_t snapshot) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sequence.load(std::memory_order_relaxed) == snapshot;
+  }
+#else
+  void beginWrite() {}
+  void endWrite() {}
 #endif
 };
 
+// Holds `lock` exclusively, or shared for read-only calls.
 struct LockGuard {
   Lock* lock = nullptr;
-  explicit LockGuard(Lock* lk) : lock(lk) {
+  bool shared = false;
+  explicit LockGuard(Lock* lk, bool sharedMode = false) : lock(lk), shared(sharedMode) {
     if (lock) {
-      lock->lock();
+      if (shared) {
+        lock->lockShared();
+      } else {
+        lock->lock();
+        lock->beginWrite();
+      }
     }
   }
-  ~LockGuard() {
+  ~LockGuard() { release(); }
+  // Unlocks before the guard goes out of scope.
+  void release() {
     if (lock) {
-      lock->unlock();
+      if (shared) {
+        lock->unlockShared();
+      } else {
+        lock->endWrite();
+        lock->unlock();
+      }
+      lock = nullptr;
     }
   }
   LockGuard(const LockGuard&) = delete;
   LockGuard& operator=(const LockGuard&) = delete;
-  LockGuard(LockGuard&& other) noexcept : lock(other.lock) { other.lock = nullptr; }
+  LockGuard(LockGuard&& other) noexcept : lock(other.lock), shared(other.shared) {
+    other.lock = nullptr;
+  }
   LockGuard& operator=(LockGuard&& other) noexcept {
     if (this != &other) {
       lock = other.lock;
+      shared = other.shared;
       other.lock = nullptr;
     }
     return *this;
@@ -157,8 +434,8 @@ struct LockGuard {
 class NodeRef {
  public:
   NodeRef() = default;
-  NodeRef(const NodeRef&) = default;
-  NodeRef& operator=(const NodeRef&) = default;
+  NodeRef(const NodeRef& other);
+  NodeRef& operator=(const NodeRef& other);
 
   NodeRef operator[](const char* key) const;
   NodeRef operator[](size_t index) const;
@@ -244,22 +521,37 @@ class NodeRef {
   uint16_t baseIndex_ = detail::kInvalidIndex;
   uint16_t attachedIndex_ = detail::kInvalidIndex;
   uint32_t revision_ = 0;
+  // Slot generations of attachedIndex_ and baseIndex_ when they were bound.
+  uint8_t generation_ = 0;
+  uint8_t baseGeneration_ = 0;
   uint8_t pendingCount_ = 0;
   uint16_t keyBytesUsed_ = 0;
-  detail::LazySegment pending_[ASSOCTREE_MAX_LAZY_SEGMENTS];
-  uint8_t keyStorage_[ASSOCTREE_LAZY_KEY_BYTES]{};
   bool overflow_ = false;
+  // Only the first pendingCount_ segments and keyBytesUsed_ key bytes are
+  // meaningful; copies skip the rest.
+  detail::LazySegment pending_[ASSOCTREE_MAX_LAZY_SEGMENTS];
+  uint8_t keyStorage_[ASSOCTREE_LAZY_KEY_BYTES];
 
-  uint16_t ensureAttached();
+  // Creates the pending path and makes room for `valueBytes` of value.
+  uint16_t ensureAttached(size_t valueBytes = 0);
+  uint16_t boundIndex() const;
   uint16_t resolveExisting() const;
   void touchRevision();
   NodeRef withKeySegment(const char* key, size_t len) const;
   NodeRef withIndexSegment(size_t index) const;
   bool prepareForSegment(NodeRef& ref) const;
+  bool dropExistingPrefix(NodeRef& ref) const;
+  void bindSegment(NodeRef& ref, uint16_t child) const;
   bool appendKey(NodeRef& ref, const char* key, size_t len) const;
   detail::LazyPathRef pendingPath() const;
 
   detail::LockGuard makeGuard() const;
+  detail::LockGuard makeReadGuard() const;
+  template <typename Read>
+  auto readConsistent(Read&& read) const -> decltype(read());
+  template <typename T>
+  T readAs(const T& defaultValue) const;
+  bool readTruthy() const;
 
   template <typename Writer>
   bool appendWithWriter(Writer&& writer);
@@ -274,11 +566,12 @@ class NodeEntry {
 
  private:
   friend class NodeIterator;
-  NodeEntry(AssocTreeBase* tree, uint16_t nodeIndex, bool isArray, size_t arrayIndex);
+  NodeEntry(AssocTreeBase* tree, uint16_t nodeIndex, bool isArray, uint32_t revision, size_t arrayIndex);
 
   AssocTreeBase* tree_ = nullptr;
   uint16_t nodeIndex_ = detail::kInvalidIndex;
   bool isArray_ = false;
+  uint32_t revision_ = 0;
   size_t arrayIndex_ = 0;
 };
 
@@ -335,35 +628,173 @@ class NodeRange {
   uint32_t revision_ = 0;
 };
 
+// Destination for streamed output. Returning false from write() stops the
+// writer.
+class Sink {
+ public:
+  virtual ~Sink() = default;
+  virtual bool write(const char* data, size_t length) = 0;
+};
+
+#ifdef ARDUINO
+// Streams to any Print, such as Serial, a WiFiClient or a File.
+class PrintSink : public Sink {
+ public:
+  explicit PrintSink(Print& out) : out_(out) {}
+  bool write(const char* data, size_t length) override {
+    return out_.write(reinterpret_cast<const uint8_t*>(data), length) == length;
+  }
+
+ private:
+  Print& out_;
+};
+#endif
+
+// Which strings setInterning() shares between nodes.
+enum class InternMode : uint8_t {
+  Off,
+  Keys,
+  KeysAndValues,
+};
+
+// Pool usage counters returned by AssocTreeBase::poolStats().
+struct PoolStats {
+  size_t nodeSlots = 0;        // slots between the pool head and nodeTop
+  size_t freeNodeSlots = 0;    // unset slots waiting on the free list
+  uint32_t reusedNodeSlots = 0;  // slots handed out again since construction
+  size_t freeBlockBytes = 0;   // released string-region bytes on the free lists
+  uint32_t reusedBlocks = 0;   // string-region blocks handed out again
+  uint32_t inPlaceStrings = 0;  // string assignments that reused the old block
+  uint32_t internHits = 0;     // keys/values that shared an existing block
+  size_t internSavedBytes = 0;  // bytes private copies of shared strings would take
+  size_t poolBytes = 0;        // pool size, which a growable tree raises
+  uint32_t poolGrowths = 0;    // times a growable tree has grown its pool
+};
+
+// Memory for a growable AssocTree<0>. reallocate() works like realloc(): it
+// returns a block of at least `bytes` that starts with the old block's
+// contents (a new block when `block` is nullptr), or nullptr and leaves the
+// old block as it was. The tree calls it with its lock held.
+class PoolAllocator {
+ public:
+  virtual ~PoolAllocator() = default;
+  virtual void* reallocate(void* block, size_t bytes) = 0;
+  virtual void release(void* block) = 0;
+};
+
+// The C heap.
+class HeapAllocator : public PoolAllocator {
+ public:
+  void* reallocate(void* block, size_t bytes) override { return std::realloc(block, bytes); }
+  void release(void* block) override { std::free(block); }
+};
+
+#if defined(ESP_PLATFORM) || defined(ESP32)
+// External PSRAM, leaving internal RAM to the rest of the program. Boards
+// without PSRAM get no block, so the tree is empty and cannot grow.
+class PsramAllocator : public PoolAllocator {
+ public:
+  void* reallocate(void* block, size_t bytes) override {
+    return heap_caps_realloc(block, bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+  void release(void* block) override { heap_caps_free(block); }
+};
+#endif
+
 class AssocTreeBase {
  public:
+  // Pool bytes taken by one node with the configured layout.
+  static constexpr size_t kNodeBytes = sizeof(detail::Node);
+
   AssocTreeBase(uint8_t* buffer, size_t totalBytes);
 
   NodeRef operator[](const char* key);
   NodeRef operator[](size_t index);
 
   size_t freeBytes() const;
+  PoolStats poolStats() const;
   void gc();
+  bool gcStep(size_t budget = ASSOCTREE_GC_STEP_BUDGET);
+  bool gcInProgress() const;
+  void setGcMaxPause(uint32_t micros);
+  void setInterning(InternMode mode);
+  // Streams the tree as JSON in chunks of ASSOCTREE_JSON_CHUNK_BYTES. The
+  // sink is called with the tree locked and must not use the tree.
+  bool writeJson(Sink& sink) const;
   bool toJson(std::string& out) const;
 #ifdef ARDUINO
   bool toJson(String& out) const;
 #endif
+  // Replaces the whole tree with the JSON object or array in `json`.
+  bool fromJson(const char* json, size_t length);
+  // Merges the JSON Merge Patch (RFC 7396) in `json` into the tree as one
+  // transaction: objects merge key by key, null removes a key and anything
+  // else replaces the value. A patch whose root is an array replaces the
+  // tree. On failure the tree is left as it was. diff() writes such patches.
+  bool applyPatch(const char* json, size_t length);
+  // MessagePack counterparts, with the same chunking and locking rules.
+  bool writeMsgPack(Sink& sink) const;
+  bool toMsgPack(std::string& out) const;
+  bool fromMsgPack(const uint8_t* data, size_t length);
+  // Pool images: a versioned, checksummed header followed by the node and
+  // string regions without the free gap between them. Loading copies the
+  // regions into place, so any pool large enough for the used bytes works.
+  size_t imageBytes() const;
+  bool writeImage(Sink& sink) const;
+  bool loadImage(const uint8_t* image, size_t length);
+  // Copies the used node and string bytes (imageBytes() of them) into
+  // `buffer` and returns a read-only view of the copy: a point-in-time tree
+  // that any thread reads without locking while this one keeps changing. The
+  // copy is taken like an optimistic read, so a writer is held up for at most
+  // the fallback. `buffer` must be aligned for a node and outlive the view;
+  // if it is too small the view is empty and not valid().
+  AssocTreeView snapshot(uint8_t* buffer, size_t bytes) const;
+  // Change tracking. watch() registers the existing node `ref` names and
+  // returns its id, or kNoWatch if the node is missing, every slot is taken
+  // or a transaction is open. Any write to the node or below it stamps the
+  // watch with a new change number. forEachChangedSince() calls
+  // fn(size_t id, NodeRef node) for each watch stamped after `token`, without
+  // the lock held, and returns the token for the next call. A watch whose node
+  // is removed, or replaced by loading a new tree, is reported once more with
+  // an empty NodeRef and keeps its slot until unwatch().
+  static constexpr size_t kNoWatch = static_cast<size_t>(-1);
+  size_t watch(const NodeRef& ref);
+  void unwatch(size_t id);
+  uint32_t changeToken() const;
+  template <typename Fn>
+  uint32_t forEachChangedSince(uint32_t token, Fn&& fn);
 
  protected:
   friend class NodeRef;
   friend class NodeEntry;
   friend class NodeIterator;
   friend class NodeRange;
+  friend class JsonReader;
+  friend class MsgPackReader;
+  friend class Transaction;
+  friend bool diff(const AssocTreeBase& from, const AssocTreeBase& to, Sink& sink);
   using Node = detail::Node;
   using NodeType = detail::NodeType;
   using StringSlot = detail::StringSlot;
 
+  // Leaves the pool untouched when `reset` is false, for adoptImage().
+  AssocTreeBase(uint8_t* buffer, size_t totalBytes, bool reset);
+  // A pool of `initialBytes` from `allocator` that grows on demand.
+  AssocTreeBase(PoolAllocator& allocator, size_t initialBytes);
+  void releasePool();
+
   NodeRef makeRootRef();
   uint16_t rootIndex() const { return 0; }
 
   Node* nodeAt(uint16_t index);
   const Node* nodeAt(uint16_t index) const;
   const char* stringAt(const StringSlot& slot) const;
+  const char* keyData(const Node& node) const;
+  size_t keyLength(const Node& node) const;
+  bool keyEquals(const Node& node, const char* key, size_t len) const;
+  uint32_t keyHash(const Node& node) const;
+  const char* stringData(const Node& node) const;
+  size_t stringLength(const Node& node) const;
 
   void setNodeNull(Node& node);
   void setNodeBool(Node& node, bool value);
@@ -376,30 +807,222 @@ class AssocTreeBase {
 
   void detachNode(uint16_t nodeIndex);
   detail::LockGuard makeLockGuard() const;
+  detail::LockGuard makeReadGuard() const;
+  // Runs `read`, which must only read the tree and return a copy, without the
+  // lock while no write overlaps it (see ASSOCTREE_OPTIMISTIC_READS), and
+  // otherwise under the read lock. Everything `read` reaches is bounds
+  // checked, so a torn read is thrown away rather than followed.
+  template <typename Read>
+  auto readConsistent(Read&& read) const -> decltype(read());
+  bool adoptImage(const uint8_t* image, size_t length);
+  bool mapImage(const uint8_t* image, size_t length, bool verify = true);
+  // Growable pools only: makes sure the free gap holds `bytes` more (and the
+  // journal records of one write while a transaction is open), growing the
+  // pool if it does not. Growing moves the pool, so these are called before
+  // a write takes node pointers.
+  void reserve(size_t bytes) {
+    if (allocator_) {
+      reserveGap(bytes);
+    }
+  }
+  // Room for `added` children of the node at `parentIndex` and their index
+  // table, plus `extra` bytes.
+  void reserveChildren(uint16_t parentIndex, size_t added, size_t extra = 0) {
+    if (allocator_) {
+      reserveGap(childBytes(parentIndex, added) + extra);
+    }
+  }
 
  private:
+  bool attachBuffer();
+  void reserveGap(size_t bytes);
+  size_t childBytes(uint16_t parentIndex, size_t added) const;
+  bool growPool(size_t gap);
+  void rebasePool(size_t delta);
+  void resetPool();
+  bool checkPool() const;
+  bool writeImageBody(Sink& out) const;
+  size_t copySnapshot(uint8_t* buffer, size_t bytes) const;
   uint16_t appendChild(uint16_t parentIndex);
   uint16_t createNode();
+  void freeNodes(uint16_t first);
+  uint16_t allocateBlock(size_t dataBytes);
+  uint16_t takeGap(size_t bytes);
   StringSlot storeString(const char* data, size_t len);
+  bool storeKey(Node& node, const char* key, size_t len);
+  StringSlot storeShared(const char* data, size_t len, bool& interned);
+  void releaseString(const StringSlot& slot, bool interned);
+  void clearInterned();
+  void makeContainer(Node& node, NodeType type);
+  void releaseChildren(Node& node);
+  void releaseValue(Node& node);
+  void releaseBlock(uint16_t offset, size_t bytes);
+  uint16_t takeFreeBlock(size_t bytes);
+  void clearFreeBlocks();
+  void mergeFreeBlocks();
+  uint16_t allocateTable(size_t capacity);
+  const detail::IndexHeader* indexHeader(const Node& node) const;
+  bool tableFits(const detail::IndexHeader* header, size_t capacity) const;
+  detail::IndexHeader* indexHeader(const Node& node);
+  static const uint16_t* indexEntries(const detail::IndexHeader* header);
+  static uint16_t* indexEntries(detail::IndexHeader* header);
+  bool buildIndex(uint16_t parentIndex, size_t capacity);
+  bool fillIndex(const Node& parent, detail::IndexHeader* header) const;
+  void indexInsert(uint16_t parentIndex, uint16_t childIndex);
+  void indexAppend(uint16_t parentIndex, uint16_t childIndex);
+  uint16_t indexErase(uint16_t parentIndex, uint16_t childIndex);
+  uint16_t lastChild(const Node& parent) const;
   uint16_t findChildByKey(uint16_t parentIndex, const char* key, size_t len) const;
   uint16_t findChildByIndex(uint16_t parentIndex, size_t targetIndex) const;
   size_t countChildren(uint16_t parentIndex) const;
-  bool writeJsonNode(std::string& out, uint16_t nodeIndex) const;
-  void appendEscapedString(std::string& out, const char* data, size_t len) const;
-  void markReachable(uint16_t index);
-  void updateReferences(uint16_t limit, uint16_t from, uint16_t to);
+  uint16_t listedChild(const Node& parent, uint16_t cursor) const;
+  bool writeJsonNode(Sink& out, uint16_t nodeIndex) const;
+  bool writeDiff(Sink& out, const AssocTreeBase& from) const;
+  bool sameValue(uint16_t index, const AssocTreeBase& other, uint16_t otherIndex) const;
+  bool writeJsonScalar(Sink& out, const Node& node) const;
+  static bool writeEscapedString(Sink& out, const char* data, size_t len);
+  bool writeMsgPackNode(Sink& out, uint16_t nodeIndex) const;
+  bool writeMsgPackScalar(Sink& out, const Node& node) const;
+  bool markReachable(uint16_t& current, bool& backtracking, size_t budget);
   void compactNodes();
+  static StringSlot* blockSlot(Node& node, uint8_t field);
+  static size_t blockRefs(Node& node, uint16_t* refs[3]);
   void compactStrings();
+  size_t gcAdvance();
+  bool gcLive(uint16_t index) const;
+  size_t gcMoveNodes();
+  bool gcRelocateChildren(uint16_t parentIndex, uint16_t target, size_t& cost);
+  size_t gcSlideStrings();
+  void gcMarkGap();
+  void gcRestartMark();
+  uint16_t rebind(uint16_t index, uint32_t revision, uint8_t* generation = nullptr) const;
+  uint16_t follow(uint16_t index, uint32_t revision, uint8_t generation) const;
+  uint8_t generationOf(uint16_t index) const;
+  void recordRelocation(uint16_t oldCount);
+  void invalidateRefs();
+  uint16_t indexOf(const Node& node) const;
+  void noteChange(uint16_t index);
+  void endWatches(uint16_t top, bool inclusive);
+  void endWatchesOnLoad();
+  void moveWatch(uint16_t from, uint16_t to);
+  bool beginTransaction();
+  bool endTransaction(bool commit);
+  bool journalNode(uint16_t index);
+  bool journalBlock(uint16_t kind, uint16_t offset, size_t bytes);
+  void failTransaction();
+
+  enum class GcPhase : uint8_t {
+    Idle,
+    ClearMarks,
+    Mark,
+    Nodes,
+    Strings,
+  };
+
+  // Pool state a transaction rolls back to. It is kept at the start of the
+  // transaction's state block, followed by one bit per node that says
+  // whether the node has been journaled.
+  struct Checkpoint {
+    size_t nodeTop;
+    size_t strTop;
+    size_t internRefBytes;
+    size_t internBlockBytes;
+    uint32_t reusedNodes;
+    uint32_t reusedBlocks;
+    uint32_t inPlaceStrings;
+    uint32_t internHits;
+    uint16_t nodeCount;
+    uint16_t freeNode;
+    uint16_t freeNodeCount;
+    uint16_t gcCursor;
+    uint16_t freeBlocks[detail::kBlockClasses];
+    uint16_t watched[ASSOCTREE_WATCH_SLOTS];
+    GcPhase gcPhase;
+    bool gcBacktracking;
+  };
 
   uint8_t* buffer_;
   size_t totalBytes_;
+  // Growable pools: where buffer_ lies, node-aligned, in the block from
+  // allocator_.
+  PoolAllocator* allocator_ = nullptr;
+  uint8_t* block_ = nullptr;
+  uint32_t poolGrowths_ = 0;
   size_t nodeTop_;
   size_t strTop_;
   uint16_t nodeCount_;
+  // Bumped whenever node indices change meaning. References bound since
+  // stableRevision_ still name their node below stableNodes_, as only gc()
+  // has run since; the last gc() moved the nodes at and above relocBase_,
+  // and the block at relocation_ (0 if none) holds relocCount_ of their new
+  // indices followed by their generations before the move.
   uint32_t revision_;
+  uint32_t stableRevision_;
+  uint16_t stableNodes_ = detail::kInvalidIndex;
+  uint16_t relocBase_ = 0;
+  uint16_t relocCount_ = 0;
+  uint16_t relocation_ = 0;
+  // Unset node slots, linked through nextSibling.
+  uint16_t freeNode_ = detail::kInvalidIndex;
+  uint16_t freeNodeCount_ = 0;
+  uint32_t reusedNodes_ = 0;
+  // Released string-region blocks by size class (offset 0 = empty).
+  uint16_t freeBlocks_[detail::kBlockClasses] = {};
+  size_t freeBlockBytes_ = 0;
+  uint32_t reusedBlocks_ = 0;
+  uint32_t inPlaceStrings_ = 0;
+  // Recently stored shareable strings, indexed by key hash. Shared blocks are
+  // never released or overwritten in place, so entries stay valid until the
+  // next compaction.
+  StringSlot internSlots_[ASSOCTREE_INTERN_SLOTS];
+  InternMode internMode_ = InternMode::Off;
+  uint32_t internHits_ = 0;
+  // Bytes referenced through shared slots, and bytes of the shared blocks.
+  size_t internRefBytes_ = 0;
+  size_t internBlockBytes_ = 0;
+  // Incremental gc state. During the Strings phase [gcRead_, gcWrite_) is a
+  // free gap inside the string region.
+  GcPhase gcPhase_ = GcPhase::Idle;
+  bool gcBacktracking_ = false;
+  uint16_t gcCursor_ = 0;
+  uint32_t gcMaxPauseUs_ = ASSOCTREE_GC_MAX_PAUSE_US;
+  size_t gcRead_ = 0;
+  size_t gcWrite_ = 0;
+  size_t gcInternBytes_ = 0;
+  // Open transaction: nesting depth, whether a write in it failed, the node
+  // count and strTop_ when it began, and the offsets of its state block and
+  // newest journal record. Older nodes are journaled before their first
+  // change, older blocks are released only on commit, and reused free blocks
+  // are recorded so a rollback can free them again.
+  uint8_t txnDepth_ = 0;
+  bool txnFailed_ = false;
+  uint16_t txnNodeCount_ = 0;
+  uint16_t txnState_ = 0;
+  uint16_t txnJournal_ = 0;
+  size_t txnStrTop_ = 0;
+  // Watched nodes (kInvalidIndex once removed) and the change number of
+  // their last write. watchCount_ counts the ones still attached, so writes
+  // skip the parent walk while nothing is watched.
+  struct Watch {
+    uint16_t node = detail::kInvalidIndex;
+    bool used = false;
+    uint32_t changed = 0;
+  };
+  Watch watches_[ASSOCTREE_WATCH_SLOTS];
+  uint16_t watchCount_ = 0;
+  uint32_t changeSeq_ = 0;
+  // Set by mapImage(): every write fails and nothing is locked.
+  bool readOnly_ = false;
   mutable detail::Lock lock_;
 };
 
+// Writes the JSON Merge Patch that turns `from` into `to`, walking both
+// trees once and descending only into objects present on both sides.
+// Changed scalars and arrays are written whole, keys missing from `to` as
+// null. A null value in `to` cannot be told apart from a removal, so it is
+// written as one. Both trees are read-locked while the sink is called.
+bool diff(const AssocTreeBase& from, const AssocTreeBase& to, Sink& sink);
+
 template <size_t TOTAL_BYTES>
 class AssocTree : public AssocTreeBase {
  public:
@@ -413,6 +1036,238 @@ template <>
 class AssocTree<0> : public AssocTreeBase {
  public:
   AssocTree(uint8_t* buffer, size_t bytes);
+  // Adopts the image (see writeImage()) that `buffer` starts with, such as a
+  // file read into RAM or mapped copy-on-write. The regions are moved into
+  // place and the rest of `bytes` becomes free space; if the image is invalid
+  // the tree starts empty and adopted() is false.
+  AssocTree(uint8_t* buffer, size_t bytes, size_t imageLength);
+  // Takes the pool from `allocator` and grows it when a write needs more
+  // room, doubling it each time up to 64 KB (node and string offsets are 16
+  // bits). Growing reallocates the pool and moves the string region to the
+  // new end with one memmove; NodeRefs stay bound, but pointers returned by
+  // asCString() only last until the next write. Optimistic reads are off for
+  // such trees, as a read without the lock could follow a freed pool.
+  explicit AssocTree(PoolAllocator& allocator, size_t initialBytes = 1024);
+  ~AssocTree();
+  AssocTree(const AssocTree&) = delete;
+  AssocTree& operator=(const AssocTree&) = delete;
+
+  bool adopted() const { return adopted_; }
+
+ private:
+  bool adopted_ = false;
+};
+
+// Read-only tree over an image written by writeImage(), used where it lies,
+// such as flash or a read-only mmap. Reads work as on any tree; writes, gc()
+// and loading fail without touching the image, and nothing is locked. The
+// image must start at an address aligned for a node and stay mapped and
+// unchanged while the view exists. If it is invalid the view is empty and
+// valid() is false.
+class AssocTreeView : public AssocTreeBase {
+ public:
+  AssocTreeView(const uint8_t* image, size_t length);
+
+  // Lookups work on a const view; the references they return cannot write.
+  NodeRef operator[](const char* key) const;
+  NodeRef operator[](size_t index) const;
+  // The root object or array, for children(), size() and contains().
+  NodeRef root() const;
+  bool valid() const { return valid_; }
+
+ private:
+  friend class AssocTreeBase;
+  // Maps a snapshot() copy, which needs no checksum or structure pass.
+  AssocTreeView(const uint8_t* image, size_t length, bool verify);
+
+  bool valid_ = false;
+};
+
+// Applies a group of writes to a tree as a whole: commit() keeps all of them
+// only if every one succeeded, and otherwise puts the tree back the way it
+// was, as does rollback() or destroying an open transaction. The tree stays
+// locked from construction until the transaction ends, so other threads,
+// optimistic reads and snapshot() see the writes all at once or not at all,
+// and each write inside takes the lock without contention.
+//
+// Every write to the tree while a transaction is open belongs to it, through
+// its references or not. gc() and gcStep() wait until it ends (an unfinished
+// gcStep() cycle that is moving nodes or strings is finished when it
+// begins), so references stay bound: `NodeRef motor = txn["motor"];` looks
+// an existing object up once, and `motor["kp"] = ...` starts from it. Undo
+// information takes free pool space: a node's size plus 6 bytes for each
+// existing node changed, so a transaction can fail for space where the same
+// writes alone would not. Older strings and tables released inside are
+// reused only after commit. Once a write has failed, later writes in the
+// transaction fail without changing anything, and a rollback invalidates
+// bound references to the tree. Keep transactions short on ESP32, where the
+// lock is a critical section.
+// Transactions on the same thread nest; an inner one that fails or rolls
+// back makes the outer one roll back.
+class Transaction {
+ public:
+  explicit Transaction(AssocTreeBase& tree);
+  ~Transaction();
+  Transaction(const Transaction&) = delete;
+  Transaction& operator=(const Transaction&) = delete;
+
+  NodeRef operator[](const char* key);
+  NodeRef operator[](size_t index);
+  // Ends the transaction; returns true if the writes were kept.
+  bool commit();
+  void rollback();
+  // True once a write failed or the transaction could not begin for lack of
+  // pool space, so commit() will roll back; once ended, true if the writes
+  // were discarded.
+  bool failed() const;
+
+ private:
+  AssocTreeBase* tree_;
+  detail::LockGuard guard_;
+  bool open_ = false;
+  bool failed_ = false;
+};
+
+// What JsonReader does with the tree it reads into.
+enum class JsonMode : uint8_t {
+  Replace,     // empty the tree and build the document
+  MergePatch,  // merge a JSON Merge Patch into the tree, as applyPatch()
+};
+
+// Builds a tree from JSON text delivered in chunks of any size. Creating a
+// reader empties the tree; feed() consumes the next chunk and finish() checks
+// that one complete object or array was read. Strings are decoded into the
+// free space between the node and string regions, so no other buffer is
+// needed. The tree must not be modified or collected until finish() returns,
+// and on any error it is left empty.
+//
+// With JsonMode::MergePatch the tree is kept and the patch is applied inside
+// a transaction that finish() commits; on any error, or if the reader is
+// destroyed first, the tree is rolled back instead of emptied.
+class JsonReader {
+ public:
+  explicit JsonReader(AssocTreeBase& tree, JsonMode mode = JsonMode::Replace);
+  ~JsonReader();
+  JsonReader(const JsonReader&) = delete;
+  JsonReader& operator=(const JsonReader&) = delete;
+
+  bool feed(const char* data, size_t length);
+  bool finish();
+  bool failed() const { return state_ == State::Failed; }
+
+ private:
+  static_assert(ASSOCTREE_JSON_MAX_DEPTH > 0 && ASSOCTREE_JSON_MAX_DEPTH <= 32,
+                "ASSOCTREE_JSON_MAX_DEPTH must be between 1 and 32");
+
+  enum class State : uint8_t {
+    Value,    // expecting a value (or ']' right after '[')
+    Key,      // expecting a key (or '}' right after '{')
+    Colon,
+    Next,     // expecting ',' or the closing bracket
+    String,
+    Number,
+    Literal,
+    Done,
+    Failed,
+  };
+
+  bool consume(const char* data, const char* end);
+  bool beginValue(char c);
+  bool beginString(const char*& p, const char* end, bool isKey);
+  bool readEscape(char c);
+  bool appendCodepoint(uint32_t codepoint);
+  bool appendScratch(const char* data, size_t length);
+  bool commitString(const char* data, size_t length);
+  bool commitNumber();
+  bool commitLiteral();
+  bool openContainer(detail::NodeType type);
+  bool closeContainer(char c);
+  bool topIsArray() const { return (arrayLevels_ >> (depth_ - 1)) & 1; }
+  bool topIsMerging() const { return depth_ != 0 && ((mergeLevels_ >> (depth_ - 1)) & 1); }
+  void fail();
+
+  AssocTreeBase* tree_;
+  uint32_t revision_ = 0;
+  State state_ = State::Value;
+  bool merge_ = false;
+  bool txnOpen_ = false;
+  bool allowClose_ = false;
+  bool inKey_ = false;
+  uint8_t depth_ = 0;
+  // 0 outside an escape, 1 after the backslash, 2-5 while reading the hex
+  // digits of a 'u' escape.
+  uint8_t escape_ = 0;
+  uint8_t literalPos_ = 0;
+  uint8_t numberLength_ = 0;
+  const char* literal_ = nullptr;
+  uint16_t target_ = detail::kInvalidIndex;
+  uint16_t code_ = 0;
+  uint16_t highSurrogate_ = 0;
+  // Bit n is set when stack_[n] is an array, and in mergeLevels_ when
+  // stack_[n] is a patched object that keeps its other keys.
+  uint32_t arrayLevels_ = 0;
+  uint32_t mergeLevels_ = 0;
+  // Pool offset and length of a string that spans chunks or has escapes.
+  size_t scratch_ = 0;
+  size_t scratchLength_ = 0;
+  uint16_t stack_[ASSOCTREE_JSON_MAX_DEPTH];
+  char number_[32];
+};
+
+// Builds a tree from MessagePack delivered in chunks of any size, following
+// the same rules as JsonReader. The root must be a map or an array and map
+// keys must be strings; bin and ext types are rejected. Integers that do not
+// fit in int32_t become doubles.
+class MsgPackReader {
+ public:
+  explicit MsgPackReader(AssocTreeBase& tree);
+
+  bool feed(const uint8_t* data, size_t length);
+  bool finish();
+  bool failed() const { return state_ == State::Failed; }
+
+ private:
+  enum class State : uint8_t {
+    Type,     // expecting the type byte of the next item
+    Payload,  // reading the fixed-size field after the type byte
+    String,
+    Done,
+    Failed,
+  };
+
+  bool consume(const uint8_t* p, const uint8_t* end);
+  bool beginItem(uint8_t type);
+  bool commitPayload();
+  bool beginString(uint64_t length);
+  bool commitString(const char* data, size_t length);
+  bool commitInt(int64_t value);
+  bool commitDouble(double value);
+  bool commitNull();
+  bool commitBool(bool value);
+  bool openContainer(detail::NodeType type, uint64_t count);
+  bool expectingKey() const;
+  detail::Node* valueTarget();
+  void completeItem();
+  void closeContainers();
+  void fail();
+
+  AssocTreeBase* tree_;
+  uint32_t revision_ = 0;
+  State state_ = State::Type;
+  uint8_t type_ = 0;
+  uint8_t payloadLength_ = 0;
+  uint8_t payloadUsed_ = 0;
+  uint8_t depth_ = 0;
+  uint16_t target_ = detail::kInvalidIndex;
+  // Pool offset of a string that spans chunks, bytes copied so far, and its
+  // full length.
+  size_t scratch_ = 0;
+  size_t scratchLength_ = 0;
+  size_t stringLength_ = 0;
+  uint16_t stack_[ASSOCTREE_JSON_MAX_DEPTH];
+  // Items still to read at each level; a map counts its keys and values.
+  uint32_t remaining_[ASSOCTREE_JSON_MAX_DEPTH];
+  uint8_t payload_[8];
 };
 
 template <typename Writer>
@@ -425,18 +1280,24 @@ inline bool NodeRef::appendWithWriter(Writer&& writer) {
   if (idx == detail::kInvalidIndex) {
     return false;
   }
+  tree_->reserveChildren(idx, 1);
   detail::Node* node = tree_->nodeAt(idx);
   if (!node) {
     return false;
   }
   if (node->type == detail::NodeType::Null) {
-    node->type = detail::NodeType::Array;
+    tree_->makeContainer(*node, detail::NodeType::Array);
   }
   if (node->type != detail::NodeType::Array) {
+    tree_->failTransaction();
+    return false;
+  }
+  uint16_t child = tree_->appendChild(idx);
+  if (child == detail::kInvalidIndex) {
+    tree_->failTransaction();
     return false;
   }
-  size_t currentSize = tree_->countChildren(idx);
-  NodeRef slot = (*this)[currentSize];
+  NodeRef slot(tree_, child, child);
   writer(slot);
   return true;
 }
@@ -444,6 +1305,22 @@ inline bool NodeRef::appendWithWriter(Writer&& writer) {
 }  // namespace assoc_tree
 
 using assoc_tree::AssocTree;
+using assoc_tree::AssocTreeView;
+using assoc_tree::HeapAllocator;
+using assoc_tree::InternMode;
+using assoc_tree::JsonMode;
+using assoc_tree::JsonReader;
+using assoc_tree::MsgPackReader;
 using assoc_tree::NodeRef;
+using assoc_tree::PoolAllocator;
+using assoc_tree::PoolStats;
+using assoc_tree::Sink;
+using assoc_tree::Transaction;
+#ifdef ARDUINO
+using assoc_tree::PrintSink;
+#endif
+#if defined(ESP_PLATFORM) || defined(ESP32)
+using assoc_tree::PsramAllocator;
+#endif
 
 #include "AssocTree.tpp"
@@ -2,18 +2,83 @@
 
 namespace assoc_tree {
 
+template <typename Read>
+auto AssocTreeBase::readConsistent(Read&& read) const -> decltype(read()) {
+#if ASSOCTREE_ENABLE_THREAD_SAFETY && ASSOCTREE_OPTIMISTIC_READS > 0
+  // A growable pool may be reallocated under a read without the lock.
+  if (!readOnly_ && !allocator_) {
+    for (int attempt = 0; attempt < ASSOCTREE_OPTIMISTIC_READS; ++attempt) {
+      uint32_t sequence;
+      if (lock_.readBegin(sequence)) {
+        auto result = read();
+        if (lock_.readValidate(sequence)) {
+          return result;
+        }
+      }
+    }
+  }
+#endif
+  auto guard = makeReadGuard();
+  return read();
+}
+
+template <typename Read>
+auto NodeRef::readConsistent(Read&& read) const -> decltype(read()) {
+  if (!tree_) {
+    return read();
+  }
+  return tree_->readConsistent(read);
+}
+
+template <typename Fn>
+uint32_t AssocTreeBase::forEachChangedSince(uint32_t token, Fn&& fn) {
+  // Collected under the lock and reported without it, so `fn` may read and
+  // write the tree.
+  size_t ids[ASSOCTREE_WATCH_SLOTS];
+  NodeRef nodes[ASSOCTREE_WATCH_SLOTS];
+  size_t count = 0;
+  uint32_t current;
+  {
+    auto guard = makeReadGuard();
+    current = changeSeq_;
+    for (size_t id = 0; id < ASSOCTREE_WATCH_SLOTS; ++id) {
+      const Watch& watch = watches_[id];
+      // Compared as a difference, so tokens survive the counter wrapping.
+      if (!watch.used || static_cast<int32_t>(watch.changed - token) <= 0) {
+        continue;
+      }
+      ids[count] = id;
+      if (watch.node != detail::kInvalidIndex) {
+        nodes[count] = NodeRef(this, watch.node, watch.node);
+      }
+      ++count;
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    fn(ids[i], nodes[i]);
+  }
+  return current;
+}
+
 template <typename T>
 T NodeRef::as(const T& defaultValue) const {
-  auto guard = makeGuard();
+  return readConsistent([&] { return readAs(defaultValue); });
+}
+
+template <typename T>
+T NodeRef::readAs(const T& defaultValue) const {
   uint16_t idx = resolveExisting();
   const AssocTreeBase* tree = tree_;
   if (!tree || idx == detail::kInvalidIndex) {
     return defaultValue;
   }
-  const detail::Node* node = tree->nodeAt(idx);
-  if (!node) {
+  const detail::Node* live = tree->nodeAt(idx);
+  if (!live) {
     return defaultValue;
   }
+  // One copy of the node keeps the string offset and length consistent.
+  const detail::Node snapshot = *live;
+  const detail::Node* node = &snapshot;
 
   if constexpr (std::is_same<T, bool>::value) {
     switch (node->type) {
@@ -24,7 +89,7 @@ T NodeRef::as(const T& defaultValue) const {
       case detail::NodeType::Double:
         return node->value.asDouble != 0.0;
       case detail::NodeType::String:
-        return node->value.asString.valid() && node->value.asString.length > 0;
+        return tree->stringLength(*node) > 0;
       default:
         return defaultValue;
     }
@@ -52,17 +117,14 @@ T NodeRef::as(const T& defaultValue) const {
         return defaultValue;
     }
   } else if constexpr (std::is_same<T, std::string>::value) {
-    if (node->type == detail::NodeType::String &&
-        node->value.asString.valid()) {
-      const char* data = tree->stringAt(node->value.asString);
-      return std::string(data, node->value.asString.length);
+    if (const char* data = tree->stringData(*node)) {
+      return std::string(data, tree->stringLength(*node));
     }
     return defaultValue;
 #ifdef ARDUINO
   } else if constexpr (std::is_same<T, String>::value) {
-    if (node->type == detail::NodeType::String &&
-        node->value.asString.valid()) {
-      const char* data = tree->stringAt(node->value.asString);
+    const char* data = tree->stringData(*node);
+    if (data && data[tree->stringLength(*node)] == '\0') {
       return String(data);
     }
     return defaultValue;
@@ -81,4 +143,24 @@ AssocTree<TOTAL_BYTES>::AssocTree() : AssocTreeBase(storage_, TOTAL_BYTES) {}
 inline AssocTree<0>::AssocTree(uint8_t* buffer, size_t bytes)
     : AssocTreeBase(buffer, bytes) {}
 
+inline AssocTree<0>::AssocTree(uint8_t* buffer, size_t bytes, size_t imageLength)
+    : AssocTreeBase(buffer, bytes, false) {
+  adopted_ = adoptImage(buffer, imageLength);
+}
+
+inline AssocTree<0>::AssocTree(PoolAllocator& allocator, size_t initialBytes)
+    : AssocTreeBase(allocator, initialBytes) {}
+
+inline AssocTree<0>::~AssocTree() {
+  releasePool();
+}
+
+inline AssocTreeView::AssocTreeView(const uint8_t* image, size_t length)
+    : AssocTreeView(image, length, true) {}
+
+inline AssocTreeView::AssocTreeView(const uint8_t* image, size_t length, bool verify)
+    : AssocTreeBase(nullptr, 0, false) {
+  valid_ = mapImage(image, length, verify);
+}
+
 }  // namespace assoc_tree
@@ -0,0 +1,204 @@
+// Compiles a JSON document into an AssocTree pool image on the host, so a
+// device can load it with loadImage() or read it in place with AssocTreeView
+// instead of parsing JSON at boot.
+//
+// Build it with the same configuration macros as the firmware (for example
+// -DASSOCTREE_COMPACT_NODES=1 or -DASSOCTREE_INDEX_THRESHOLD=...), because an
+// image is only accepted by a build with the same node layout and byte order:
+//
+//   g++ -std=c++17 -O2 -I src tools/build_image.cpp src/AssocTree.cpp -o build_image
+//
+// Usage:
+//
+//   build_image [--intern off|keys|values] [--pool BYTES] [--array NAME]
+//               [--quiet] input.json output
+//
+// The output is the raw image, or with --array NAME a C++ header defining an
+// aligned `const uint8_t NAME[]` and `NAME_length` ready for AssocTreeView.
+// --pool is the pool size on the device and only affects the free-byte
+// report. Statistics go to stderr.
+
+#include "AssocTree.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr size_t kMaxPoolBytes = 65535;
+
+struct Options {
+  assoc_tree::InternMode intern = assoc_tree::InternMode::Keys;
+  size_t poolBytes = kMaxPoolBytes;
+  std::string arrayName;
+  bool quiet = false;
+  std::string input;
+  std::string output;
+};
+
+class VectorSink : public assoc_tree::Sink {
+ public:
+  bool write(const char* data, size_t length) override {
+    bytes.insert(bytes.end(), data, data + length);
+    return true;
+  }
+
+  std::vector<uint8_t> bytes;
+};
+
+void printUsage() {
+  std::fprintf(stderr,
+               "usage: build_image [--intern off|keys|values] [--pool BYTES] "
+               "[--array NAME] [--quiet] input.json output\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--intern" && hasValue) {
+      const std::string mode = argv[++i];
+      if (mode == "off") {
+        options.intern = assoc_tree::InternMode::Off;
+      } else if (mode == "keys") {
+        options.intern = assoc_tree::InternMode::Keys;
+      } else if (mode == "values") {
+        options.intern = assoc_tree::InternMode::KeysAndValues;
+      } else {
+        return false;
+      }
+    } else if (arg == "--pool" && hasValue) {
+      char* end = nullptr;
+      const unsigned long bytes = std::strtoul(argv[++i], &end, 10);
+      if (*end != '\0' || bytes == 0 || bytes > kMaxPoolBytes) {
+        return false;
+      }
+      options.poolBytes = bytes;
+    } else if (arg == "--array" && hasValue) {
+      options.arrayName = argv[++i];
+    } else if (arg == "--quiet") {
+      options.quiet = true;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      return false;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (positional.size() != 2) {
+    return false;
+  }
+  options.input = positional[0];
+  options.output = positional[1];
+  return true;
+}
+
+bool readFile(const std::string& path, std::string& out) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return !file.bad();
+}
+
+bool writeOutput(const Options& options, const std::vector<uint8_t>& image) {
+  std::ofstream file(options.output, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  if (options.arrayName.empty()) {
+    file.write(reinterpret_cast<const char*>(image.data()), image.size());
+    return static_cast<bool>(file);
+  }
+  // Node alignment lets AssocTreeView read the array straight from flash.
+  file << "// Generated by tools/build_image from " << options.input << ". Do not edit.\n"
+       << "#pragma once\n\n"
+       << "#include <stddef.h>\n#include <stdint.h>\n\n"
+       << "alignas(8) static const uint8_t " << options.arrayName << "[] = {";
+  char hex[8];
+  for (size_t i = 0; i < image.size(); ++i) {
+    std::snprintf(hex, sizeof(hex), "0x%02x,", image[i]);
+    file << (i % 12 == 0 ? "\n   " : "") << ' ' << hex;
+  }
+  file << "\n};\n"
+       << "static const size_t " << options.arrayName << "_length = " << image.size() << ";\n";
+  return static_cast<bool>(file);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage();
+    return 2;
+  }
+  std::string json;
+  if (!readFile(options.input, json)) {
+    std::fprintf(stderr, "build_image: cannot read %s\n", options.input.c_str());
+    return 1;
+  }
+
+  // Build in the largest pool a tree supports; the device pool only has to
+  // hold the bytes in use.
+  alignas(std::max_align_t) static uint8_t pool[kMaxPoolBytes];
+  AssocTree<0> tree(pool, sizeof(pool));
+  tree.setInterning(options.intern);
+  if (!tree.fromJson(json.data(), json.size())) {
+    std::fprintf(stderr, "build_image: %s is not valid JSON or does not fit in %zu bytes\n",
+                 options.input.c_str(), sizeof(pool));
+    return 1;
+  }
+  // Parsing leaves outgrown index tables on the free lists. Collecting packs
+  // both regions and rebuilds every table at the smallest capacity.
+  tree.gc();
+
+  VectorSink image;
+  if (!tree.writeImage(image)) {
+    std::fprintf(stderr, "build_image: cannot write the image\n");
+    return 1;
+  }
+  // Read the result back the way a device would before handing it out.
+  std::vector<uint8_t> check(image.bytes.size() + 8);
+  uint8_t* aligned = check.data() + (8 - reinterpret_cast<uintptr_t>(check.data()) % 8) % 8;
+  std::memcpy(aligned, image.bytes.data(), image.bytes.size());
+  const AssocTreeView view(aligned, image.bytes.size());
+  std::string expected;
+  std::string actual;
+  tree.toJson(expected);
+  if (!view.valid() || !view.toJson(actual) || actual != expected) {
+    std::fprintf(stderr, "build_image: the image does not read back\n");
+    return 1;
+  }
+  if (!writeOutput(options, image.bytes)) {
+    std::fprintf(stderr, "build_image: cannot write %s\n", options.output.c_str());
+    return 1;
+  }
+
+  if (!options.quiet) {
+    const PoolStats stats = tree.poolStats();
+    const size_t poolUsed = sizeof(pool) - tree.freeBytes();
+    const size_t nodeBytes = stats.nodeSlots * assoc_tree::AssocTreeBase::kNodeBytes;
+    std::fprintf(stderr, "input:   %zu bytes of JSON\n", json.size());
+    std::fprintf(stderr, "nodes:   %zu x %zu = %zu bytes\n", stats.nodeSlots,
+                 assoc_tree::AssocTreeBase::kNodeBytes, nodeBytes);
+    std::fprintf(stderr, "strings: %zu bytes (%u shared, %zu bytes saved)\n",
+                 poolUsed - nodeBytes, static_cast<unsigned>(stats.internHits),
+                 stats.internSavedBytes);
+    std::fprintf(stderr, "image:   %zu bytes\n", image.bytes.size());
+    if (options.poolBytes >= poolUsed) {
+      std::fprintf(stderr, "free:    %zu of %zu pool bytes after loading\n",
+                   options.poolBytes - poolUsed, options.poolBytes);
+    } else {
+      std::fprintf(stderr, "free:    does not fit, %zu pool bytes needed\n", poolUsed);
+    }
+  }
+  return 0;
+}